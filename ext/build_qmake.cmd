@@ -4,7 +4,7 @@
 call %CMGEN_EXT_DIR%\compiler_vars.cmd
 
 @echo JOM...
-jom
+jom /J %CMGEN_BUILD_JOBS%
 @if not '%ERRORLEVEL%'=='0' exit /B 1
-jom install
+jom /J 1 install
 @if not '%ERRORLEVEL%'=='0' exit /B 1
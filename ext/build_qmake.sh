@@ -6,5 +6,8 @@ set -e # exit if error
 $CMGEN_EXT_DIR/compiler_vars.sh
 
 echo Make...
-make
-make install
+case "$MAKEFLAGS" in
+    *jobserver*) make ;; # jobs are given by cmgen's jobserver
+    *) make -j${CMGEN_BUILD_JOBS:-1} ;;
+esac
+MAKEFLAGS= make install # install rules often aren't safe to run in parallel
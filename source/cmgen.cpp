@@ -17,7 +17,9 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
 #include <dmk_time.h>
+#include <dmk_thread.h>
 #include <set>
+#include <limits>
 
 #include "expressions.h"
 #include "cmgen.h"
@@ -28,7 +30,15 @@
 namespace dmk
 {
     ptr<const environment> env;
+    ptr<state_log> states;
+    ptr<descriptor_cache> descriptors;
+    ptr<manifest_cache> manifests;
     bool build_process::quiet = false;
+    std::shared_ptr<jobserver> build_process::jobs;
+    std::shared_ptr<const environment_block> build_process::tools_environment;
+    thread_budget builder::jobs( 1 );
+    job_budget builder::build_jobs( 1 );
+    thread_budget fetcher::jobs( 1 );
 
     namespace usage
     {
@@ -54,16 +64,66 @@ namespace dmk
         static const std::string build       = "[ arch\t[ config ] ]";
         static const std::string rebuild     = "[ arch\t[ config ] ]";
         static const std::string clean       = "[ arch\t[ config ] ]";
+        static const std::string history     = "[ module ]";
+        static const std::string cache       = "[ size max_size[K|M|G]\t| age days\t| clear ]";
     }
 
     class cmds : public command_processor
     {
     public:
+        cmds( ) : jobs( 1 ), m_capture_output( false ), m_graph( nullptr ), m_projects( new project_cache( ) )
+        {
+        }
         std::string project_name;
+        // Maximum number of projects processed at once by batch
+        size_t jobs;
 
     private:
         std::vector<std::string> m_project_stack;
 
+        struct batch_step
+        {
+            std::string task;
+            std::string output;
+            std::string message;
+            // Last lines of output of the processes started by the task and their log files
+            std::vector<std::string> tail;
+            std::vector<path> logs;
+            double seconds;
+            bool ok;
+        };
+        // Output of batch tasks is collected here when several projects are processed at once
+        bool m_capture_output;
+        std::vector<batch_step> m_batch_steps;
+        // Dependency graph shared by batch with its workers
+        const dependency_graph* m_graph;
+
+        // Projects loaded during the session, shared by batch with its workers
+        // An entry is reused while the descriptor and the environment (their hashes) are the same
+        struct project_cache
+        {
+            struct entry
+            {
+                ptr<project> proj;
+                std::string env_hash;
+            };
+            std::mutex mutex;
+            std::unordered_map<std::string, entry> entries;
+        };
+        ptr<project_cache> m_projects;
+
+        // All dependencies of the module, each one placed after its own dependencies
+        std::vector<std::string> get_dependencies( const std::string& name ) const
+        {
+            if ( m_graph )
+            {
+                return m_graph->all_dependencies( name );
+            }
+            dependency_graph graph;
+            graph.load( name );
+            return graph.all_dependencies( name );
+        }
+
         void push_project( )
         {
             m_project_stack.push_back( project_name );
@@ -99,22 +159,24 @@ namespace dmk
             {
                 return;
             }
+            elapsed_timer t;
             create_directories( env->source_root_dir / name );
             project::set_imported( name );
             project::clear_configured( name );
             do_select( name );
             fetch( );
+            project::set_imported( name, t.elapsed( ).as_double( ) );
         }
 
         void do_import_tree( redo_mode mode, const std::string& name )
         {
-            auto deps = project::get_dependencies( name );
+            auto deps = get_dependencies( name );
             if ( !deps.empty( ) )
             {
                 if ( !build_process::quiet )
                     println( "List of dependencies: {}", join( deps, ", " ) );
                 push_project( );
-                for ( const std::string& dep : reversed( deps ) )
+                for ( const std::string& dep : deps )
                 {
                     if ( !build_process::quiet )
                         println( "Importing dependencies... {}", dep );
@@ -130,7 +192,7 @@ namespace dmk
         {
             if ( is_nonempty_directory( env->modules_dir / proj->name( ) ) )
             {
-                copy_content( env->modules_dir / proj->name( ), proj->source_dir( ), false );
+                update_content( env->modules_dir / proj->name( ), proj->source_dir( ) );
             }
         }
 
@@ -148,28 +210,26 @@ namespace dmk
                     if ( !is_file( p.path( ).string( ) + ".applied" ) )
                     {
                         println( "Applying patch..." );
-                        exec<build_process>(
-                            proj->source_dir( ), env->patch_path, "-l -u -p0 -i {}", qo( p ) );
+                        exec<build_process>( proj->source_dir( ),
+                                             env->patch_path,
+                                             argument_list{ "-l", "-u", "-p0", "-i", p.path( ).string( ) } );
                         touch_file( p.path( ).string( ) + ".applied" );
                     }
                 }
             }
-            if ( proj->data( ).has_key( "afterimport" ) )
+            json script = proj->data( "afterimport" );
+            if ( !script.is_null( ) )
             {
-                std::string script = proj->data( )["afterimport"] || "";
-                exec<build_process>( proj->source_dir( ), proj->source_dir( ) / script, "" );
+                exec<build_process>(
+                    proj->source_dir( ), proj->source_dir( ) / ( script || "" ), argument_list{ } );
             }
         }
 
         void do_fetch( )
         {
             ptr<project> project = get_project( project_name );
-            json package = project->data( )["source"];
-            for ( const json& a : package.flatten_array( ) )
-            {
-                ptr<fetcher> f = fetcher::create( project.get( ), a, project->source_dir( ) );
-                f->fetch( );
-            }
+            json package = project->data( "source" );
+            fetcher::fetch_all( project.get( ), package.flatten_array( ), project->source_dir( ) );
             do_patch( project.get( ) );
         }
 
@@ -198,7 +258,7 @@ namespace dmk
         void do_license( )
         {
             ptr<project> project = get_project( project_name );
-            json licenses        = project->data( )["license"];
+            json licenses        = project->data( "license" );
             path target_dir = env->licenses_dir / project_name;
             if ( licenses.is_object( ) )
             {
@@ -223,7 +283,7 @@ namespace dmk
             paths += entries( project->source_dir( ), "copying*" );
             paths += entries( project->source_dir( ), "lgpl*" );
 
-            if ( paths.empty( ) && project->data( )["source"] != "local" )
+            if ( paths.empty( ) && project->data( "source" ) != "local" )
             {
                 throw error( "Can't find license for project {}", project_name );
             }
@@ -252,7 +312,19 @@ namespace dmk
 
             try
             {
-                return ptr<project>( new project( name ) );
+                const std::string hash     = descriptors->get( project::module_path( name ) ).hash;
+                const std::string env_hash = env->hash( );
+                {
+                    std::lock_guard<std::mutex> lock( m_projects->mutex );
+                    auto it = m_projects->entries.find( name );
+                    if ( it != m_projects->entries.end( ) && it->second.env_hash == env_hash &&
+                         it->second.proj->hash( ) == hash && is_directory( it->second.proj->source_dir( ) ) )
+                        return it->second.proj;
+                }
+                ptr<project> proj( new project( name ) );
+                std::lock_guard<std::mutex> lock( m_projects->mutex );
+                m_projects->entries[name] = project_cache::entry{ proj, env_hash };
+                return proj;
             }
             catch ( const std::exception& e )
             {
@@ -276,13 +348,13 @@ namespace dmk
             get_project( project_name );
             if ( action_dependencies )
             {
-                auto deps = project::get_dependencies( project_name );
+                auto deps = get_dependencies( project_name );
                 if ( !deps.empty( ) )
                 {
                     if ( !build_process::quiet )
                         println( "List of dependencies: {}", join( deps, ", " ) );
                     push_project( );
-                    for ( const std::string& dep : reversed( deps ) )
+                    for ( const std::string& dep : deps )
                     {
                         project_name = dep;
                         do_build( action_dependencies, arch, config );
@@ -319,29 +391,62 @@ namespace dmk
             }
         }
 
-        bool batch_task( const std::string& task, const std::function<void( )>& func )
+        static void print_batch_step( const batch_step& step )
         {
-            elapsed_timer t;
-            build_process::quiet = true;
-            try
+            fmt::print( "{}", step.output );
+            if ( step.ok )
             {
-                func( );
                 green_err_text c;
-                fmt::print( stderr, "--- {}: ok ({:4.2f}s)\n", task, t.elapsed( ).as_double( ) );
+                fmt::print( stderr, "--- {}: ok ({:4.2f}s)\n", step.task, step.seconds );
             }
-            catch ( const std::exception& e )
+            else
             {
                 red_err_text c;
-                fmt::print( stderr, "--- {}: failed ({:4.2f}s)\n", task, t.elapsed( ).as_double( ) );
-                fmt::print( stderr, "{}\n", e.what( ) );
-                build_process::quiet = false;
-                return false;
+                fmt::print( stderr, "--- {}: failed ({:4.2f}s)\n", step.task, step.seconds );
+                fmt::print( stderr, "{}\n", step.message );
+                if ( !step.tail.empty( ) )
+                {
+                    fmt::print( stderr, "Last lines of output:\n" );
+                    for ( const std::string& line : step.tail )
+                        fmt::print( stderr, "    {}\n", line );
+                }
+                for ( const path& log : step.logs )
+                    fmt::print( stderr, "Log: {}\n", log.string( ) );
             }
-            build_process::quiet = false;
-            return true;
         }
 
-        void do_batch( redo_mode mode,
+        bool batch_task( const std::string& task, const std::function<void( )>& func )
+        {
+            elapsed_timer t;
+            batch_step step;
+            step.task = task;
+            {
+                std::unique_ptr<output_capture> capture( m_capture_output ? new output_capture( ) : nullptr );
+                output_tail tail;
+                try
+                {
+                    func( );
+                    step.ok = true;
+                }
+                catch ( const std::exception& e )
+                {
+                    step.ok      = false;
+                    step.message = e.what( );
+                }
+                if ( capture )
+                    step.output = capture->text( );
+                step.tail = tail.lines( );
+                step.logs = tail.logs( );
+            }
+            step.seconds = t.elapsed( ).as_double( );
+            if ( m_capture_output )
+                m_batch_steps.push_back( step );
+            else
+                print_batch_step( step );
+            return step.ok;
+        }
+
+        bool do_batch( redo_mode mode,
                        const std::string& name,
                        const std::string& arch,
                        const std::string& config )
@@ -351,21 +456,59 @@ namespace dmk
                               {
                                   import( DoOnce, name );
                               } ) )
-                return;
+                return false;
             if ( !batch_task( "configure",
                               [&]( )
                               {
                                   do_select( name );
                                   configure( mode, arch, config );
                               } ) )
-                return;
+                return false;
             if ( !batch_task( "build",
                               [&]( )
                               {
                                   do_select( name );
                                   build( mode, arch, config );
                               } ) )
-                return;
+                return false;
+            return true;
+        }
+
+        // Import, configure and build one project of the batch in a separate command context,
+        // so the projects can be processed concurrently
+        bool do_batch_project( redo_mode mode,
+                               const std::string& name,
+                               bool dependency,
+                               const dependency_graph& dependencies,
+                               const std::string& arch,
+                               const std::string& config,
+                               std::mutex& print_mutex )
+        {
+            cmds worker;
+            worker.m_capture_output = jobs > 1;
+            worker.m_graph          = &dependencies;
+            worker.m_projects       = m_projects;
+            const std::string title = dependency ? name + " (dep)" : name;
+            if ( !worker.m_capture_output )
+            {
+                {
+                    cyan_err_text c;
+                    fmt::print( stderr, "- project: {}\n", title );
+                }
+                return worker.do_batch( mode, name, arch, config );
+            }
+            bool ok = worker.do_batch( mode, name, arch, config );
+
+            std::lock_guard<std::mutex> lock( print_mutex );
+            {
+                cyan_err_text c;
+                fmt::print( stderr, "- project: {}\n", title );
+            }
+            for ( const batch_step& step : worker.m_batch_steps )
+            {
+                print_batch_step( step );
+            }
+            return ok;
         }
 
     public:
@@ -446,21 +589,35 @@ namespace dmk
             }
         }
 
+        void help( )
+        {
+            command_processor::help( );
+            println( "" );
+            println( "import, configure, build, rebuild and batch process the project, and its dependencies" );
+            println( "unless they are already up to date. With ! the dependencies are always processed," );
+            println( "with ? the project is skipped as well when it is up to date." );
+            println( "A build is up to date when the module data and the dependencies are unchanged, and no file" );
+            println( "was added, removed or renamed in its source and output directories (use ! after files" );
+            println( "are changed in place)." );
+        }
+
         void deps( const std::string& name )
         {
             try
             {
-                auto deps = project::get_dependencies( name );
+                dependency_graph graph;
+                graph.load( name );
+                auto deps = graph.all_dependencies( name );
                 println( "{}: {}", name, join( deps, ", " ) );
                 for ( auto dep : deps )
                 {
-                    auto subdeps = project::get_dependencies( dep );
+                    auto subdeps = graph.all_dependencies( dep );
                     println( "    {}: {}", dep, join( subdeps, ", " ) );
                 }
             }
             catch ( const std::exception& e )
             {
-                throw command_error( e, "Couldn't get dependencies for {}", project_name );
+                throw command_error( e, "Couldn't get dependencies for {}", name );
             }
         }
 
@@ -525,6 +682,7 @@ namespace dmk
             {
                 switch ( mode )
                 {
+                // build? skips up to date builds without starting anything
                 case DoOnce:
                     do_build_tree( &builder::build_once, &builder::build_once, arch, config );
                     break;
@@ -579,7 +737,7 @@ namespace dmk
             std::vector<std::string> result;
             for ( auto a : env->archs )
             {
-                result.push_back( is_file( project::flag_path( name, flag, a ) ) ? "Y" : "." );
+                result.push_back( states->is_set( name, flag, env->platform, a.name ) ? "Y" : "." );
             }
             return join( result, " " );
         }
@@ -605,49 +763,61 @@ namespace dmk
                 }
             }
             std::set<std::string> original_list( list.begin( ), list.end( ) );
-            for ( size_t i = 0; i < list.size( ); )
+            dependency_graph dependencies;
+            for ( const std::string& name : original_list )
             {
-                std::string name              = list[i];
-                std::vector<std::string> deps = project::get_dependencies( name );
-                deps = reversed( deps );
-                list.insert( list.begin( ) + i, deps.begin( ), deps.end( ) );
-                i += 1 + deps.size( );
+                dependencies.load( name );
             }
-            for ( size_t i = 1; i < list.size( ); )
+            list = dependencies.order( list );
+            println( "projects included in the batch: {}", join( list, ", " ) );
+
+            std::map<std::string, size_t> indices;
+            for ( size_t i = 0; i < list.size( ); i++ )
             {
-                std::string name = list[i];
-                auto it = list.begin( ) + i;
-                if ( std::find( list.begin( ), it, name ) != it )
-                {
-                    list.erase( it );
-                }
-                else
-                {
-                    i++;
-                }
+                indices[list[i]] = i;
             }
-            println( "projects included in the batch: {}", join( list, ", " ) );
+            std::mutex print_mutex;
+            task_graph graph;
             for ( const std::string& name : list )
             {
-                push_project( );
-                if ( original_list.find( name ) != original_list.end( ) )
-                {
-                    {
-                        cyan_err_text c;
-                        fmt::print( stderr, "- project: {}\n", name );
-                    }
-                    do_batch( mode, name, arch, config );
-                }
-                else
+                bool dependency = original_list.find( name ) == original_list.end( );
+                graph.add( name,
+                           [this, mode, name, dependency, &dependencies, &arch, &config, &print_mutex]( )
+                           {
+                               return do_batch_project( dependency ? DoOnce : mode,
+                                                        name,
+                                                        dependency,
+                                                        dependencies,
+                                                        arch,
+                                                        config,
+                                                        print_mutex );
+                           } );
+            }
+            for ( size_t i = 0; i < list.size( ); i++ )
+            {
+                for ( const std::string& dep : dependencies.dependencies( list[i] ) )
                 {
-                    {
-                        cyan_err_text c;
-                        fmt::print( stderr, "- project: {} (dep)\n", name );
-                    }
-                    do_batch( DoOnce, name, arch, config );
+                    graph.depends( i, indices[dep] );
                 }
-                pop_project( );
             }
+
+            build_process::quiet = true;
+            try
+            {
+                graph.run( jobs,
+                           [&]( size_t index )
+                           {
+                               std::lock_guard<std::mutex> lock( print_mutex );
+                               red_err_text c;
+                               fmt::print( stderr, "--- {}: skipped (dependency failed)\n", graph.name( index ) );
+                           } );
+            }
+            catch ( ... )
+            {
+                build_process::quiet = false;
+                throw;
+            }
+            build_process::quiet = false;
         }
 
         void modules( const std::string& pattern )
@@ -667,7 +837,7 @@ namespace dmk
                 {
                     try
                     {
-                        json data = file_get_json( entry );
+                        json data = descriptors->get( entry.path( ) ).data;
                         println( "{:20} {:20} {:10} {:10} {:10}",
                                  name,
                                  data["version"].as_string( "unknown version" ),
@@ -689,6 +859,103 @@ namespace dmk
             }
         }
 
+        // Parse size with optional K, M or G suffix
+        static uint64_t parse_size( const std::string& text )
+        {
+            char* end          = nullptr;
+            double value       = std::strtod( text.c_str( ), &end );
+            std::string suffix = asci_lowercase( end );
+            if ( end == text.c_str( ) || value < 0 )
+                throw command_error( "Invalid size: {}", text );
+            if ( suffix == "k" || suffix == "kb" )
+                value *= 1024.0;
+            else if ( suffix == "m" || suffix == "mb" )
+                value *= 1024.0 * 1024.0;
+            else if ( suffix == "g" || suffix == "gb" )
+                value *= 1024.0 * 1024.0 * 1024.0;
+            else if ( !suffix.empty( ) )
+                throw command_error( "Invalid size: {}", text );
+            return static_cast<uint64_t>( value );
+        }
+
+        void cache( const std::string& action, const std::string& value )
+        {
+            std::vector<download_cache::entry> removed;
+            if ( action.empty( ) )
+            {
+                std::vector<download_cache::entry> list = download_cache::entries( );
+                uint64_t total                          = 0;
+                for ( const download_cache::entry& e : list )
+                {
+                    total += e.size;
+                }
+                download_cache::statistics s = download_cache::stats( );
+                int64_t requests             = s.hits + s.misses;
+                yellow_text c;
+                println( "Cache dir: {}", env->cache_dir );
+                println( "Files: {} ({:.1f} MB)", list.size( ), total / 1048576.0 );
+                println( "Hits: {}, misses: {}, hit rate: {:.1f}%",
+                         s.hits,
+                         s.misses,
+                         requests ? 100.0 * s.hits / requests : 0.0 );
+                return;
+            }
+            else if ( action == "size" )
+            {
+                removed = download_cache::prune( parse_size( value ), std::numeric_limits<double>::max( ) );
+            }
+            else if ( action == "age" )
+            {
+                char* end   = nullptr;
+                double days = std::strtod( value.c_str( ), &end );
+                if ( end == value.c_str( ) || *end || days < 0 )
+                    throw command_error( "Invalid number of days: {}", value );
+                removed = download_cache::prune( std::numeric_limits<uint64_t>::max( ), days * 24 * 3600 );
+            }
+            else if ( action == "clear" )
+            {
+                removed = download_cache::prune( 0, 0 );
+                download_cache::reset_stats( );
+            }
+            else
+            {
+                throw command_error( "Unknown cache action: {}", action );
+            }
+            uint64_t total = 0;
+            for ( const download_cache::entry& e : removed )
+            {
+                total += e.size;
+            }
+            println( "Removed {} file(s) ({:.1f} MB)", removed.size( ), total / 1048576.0 );
+        }
+
+        void history( const std::string& name )
+        {
+            try
+            {
+                yellow_text c;
+                println( "{:19} {:20} {:10} {:10} {:8} {:>9}", "time", "module", "state", "platform", "arch", "duration" );
+                println( "{0:-<19} {0:-<20} {0:-<10} {0:-<10} {0:-<8} {0:->9}", "" );
+                for ( const state_log::record& r : states->history( name ) )
+                {
+                    char buff[32]    = { 0 };
+                    std::time_t time = static_cast<std::time_t>( r.time );
+                    std::strftime( buff, countof( buff ), "%Y-%m-%d %H:%M:%S", std::localtime( &time ) );
+                    println( "{:19} {:20} {:10} {:10} {:8} {:>8.2f}s",
+                             buff,
+                             r.module,
+                             ( r.set ? "" : "-" ) + r.flag,
+                             r.platform,
+                             r.arch,
+                             r.duration );
+                }
+            }
+            catch ( const std::exception& e )
+            {
+                throw command_error( e, "Couldn't read build history" );
+            }
+        }
+
         void data( const std::string& arch, const std::string& config )
         {
             try
@@ -728,7 +995,7 @@ namespace dmk
             try
             {
                 yellow_text c;
-                variable_list list = env->variables;
+                variable_scope list = env->variables_scope;
                 println( "{:30}   {}", "Variable", "Value" );
                 println( "{0:-<30}   {0:-<44}", "" );
                 if ( !project_name.empty( ) )
@@ -759,7 +1026,7 @@ namespace dmk
             try
             {
                 yellow_text c;
-                variable_list list = env->variables;
+                variable_scope list = env->variables_scope;
                 println( "{:30}   {}", "Variable", "Value" );
                 println( "{0:-<30}   {0:-<44}", "" );
                 if ( !project_name.empty( ) )
@@ -778,8 +1045,7 @@ namespace dmk
                         env->find_archs( arch )[0], configuration::all( ), project_name );
                 }
                 list += dynamic_variables( );
-                list = list.transform( "CMGEN_", "", text_case::upper );
-                list.print( );
+                list.transform( "CMGEN_", "", text_case::upper ).print( );
             }
             catch ( const std::exception& e )
             {
@@ -795,6 +1061,21 @@ namespace dmk
         namespace u = usage;
         cmds cp;
 
+        std::string jobs = args.extract( "--jobs", "CMGEN_JOBS", env->variables.at( "cpus" ) );
+        cp.jobs          = std::max( 1, std::atoi( jobs.c_str( ) ) );
+
+        std::string arch_jobs = args.extract( "--arch-jobs", "CMGEN_ARCH_JOBS", "1" );
+        builder::jobs.reset( std::max( 1, std::atoi( arch_jobs.c_str( ) ) ) );
+
+        std::string build_jobs =
+            args.extract( "--build-jobs", "CMGEN_BUILD_JOBS", env->variables.at( "build_cpus" ) );
+        builder::build_jobs.reset( std::max( 1, std::atoi( build_jobs.c_str( ) ) ) );
+        if ( args.extract( "--jobserver", "CMGEN_JOBSERVER", "1" ) != "0" )
+            build_process::start_jobserver( builder::build_jobs.jobs( ) );
+
+        std::string fetch_jobs = args.extract( "--fetch-jobs", "CMGEN_FETCH_JOBS", "4" );
+        fetcher::jobs.reset( std::max( 1, std::atoi( fetch_jobs.c_str( ) ) ) );
+
         std::string proj = args.extract( "--project" );
         if ( !proj.empty( ) )
         {
@@ -811,6 +1092,8 @@ namespace dmk
         cp.bind( "modules", u::data, bind( &cmds::modules, &cp, _1 ), 0, 1 );
         cp.bind( "deps", u::deps, bind( &cmds::deps, &cp, _1 ), 1, 1 );
         cp.bind( "data", u::data, bind( &cmds::data, &cp, _1, _2 ), 0, 2 );
+        cp.bind( "history", u::history, bind( &cmds::history, &cp, _1 ), 0, 1 );
+        cp.bind( "cache", u::cache, bind( &cmds::cache, &cp, _1, _2 ), 0, 2 );
         cp.bind( "vars", u::vars, bind( &cmds::vars, &cp, _1, _2 ), 0, 2 );
         cp.bind( "env", u::envvars, bind( &cmds::envvars, &cp, _1, _2 ), 0, 2 );
         cp.bind( "help", u::help, bind( &cmds::help, &cp ) );
@@ -869,6 +1152,13 @@ int main( int argc, char** argv, char** envp )
     {
         println( "CMGen v0.3" );
         env.reset( new environment( args ) );
+        states.reset( new state_log( env->flags_dir / "state.log" ) );
+        descriptors.reset( new descriptor_cache( env->flags_dir / "descriptors" ) );
+        manifests.reset( new manifest_cache( env->flags_dir / "manifests" ) );
+        if ( !states->existed( ) )
+        {
+            project::import_flag_files( );
+        }
         println( "Type help for a list of supported commands" );
     }
     catch ( const std::exception& e )
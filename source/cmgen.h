@@ -21,6 +21,7 @@
 
 #include <vector>
 #include <memory>
+#include <algorithm>
 #include <dmk.h>
 #include <dmk_string.h>
 #include <dmk_json.h>
@@ -40,8 +41,31 @@ namespace dmk
             : process( program, working_dir )
         {
             log_output( quiet );
+            set_env( base_environment( ) );
         }
         static bool quiet;
+        // Shared by all the build tools, see builder::build_arch
+        static std::shared_ptr<jobserver> jobs;
+
+        // Build tools started after this share the jobserver,
+        // its options are appended to MAKEFLAGS inherited by cmgen
+        static void start_jobserver( size_t count )
+        {
+            jobs                  = std::make_shared<jobserver>( count );
+            const char* makeflags = std::getenv( "MAKEFLAGS" );
+            tools_environment     = std::make_shared<const environment_block>(
+                *environment_block::inherited( ),
+                environment_block::variables{ { "MAKEFLAGS",
+                                                std::string( makeflags ? makeflags : "" ) + jobs->makeflags( ) } } );
+        }
+        // Environment the build tools start with
+        static const std::shared_ptr<const environment_block>& base_environment( )
+        {
+            return tools_environment ? tools_environment : environment_block::inherited( );
+        }
+
+    private:
+        static std::shared_ptr<const environment_block> tools_environment;
 
     protected:
         virtual void before( ) override
@@ -271,6 +295,26 @@ namespace dmk
         }
     }
 
+    // Copy files that are missing in the target, differ in size or are newer than the copy
+    // Files that are up to date keep their modification time
+    inline void update_content( const path& directory, const path& target )
+    {
+        create_directories( target );
+        for ( const directory_entry& entry : directory_iterator( directory ) )
+        {
+            path dest = target / entry.path( ).filename( );
+            if ( is_directory( entry ) )
+            {
+                update_content( entry, dest );
+            }
+            else if ( !is_file( dest ) || file_size( entry ) != file_size( dest ) ||
+                      file_mtime( entry ) > file_mtime( dest ) )
+            {
+                safe_copy_all( entry, dest );
+            }
+        }
+    }
+
     inline std::string join_list( const json& value,
                                   const std::string& delimeter,
                                   const std::string& prefix  = "",
@@ -413,6 +457,7 @@ namespace dmk
         path platform_dir;
         path licenses_dir;
         path flags_dir;
+        path cache_dir;
         path temp_dir;
         path git_path;
         path hg_path;
@@ -423,7 +468,6 @@ namespace dmk
         path make_path;
         path python_path;
         path scons_path;
-        path unzip_path;
         path msys_dir;
         path msys_bin_dir;
         path ext_dir;
@@ -443,6 +487,9 @@ namespace dmk
         architectures archs;
         variable_list variables;
         variable_list env;
+        // Shared copies of variables and env to compose variable scopes
+        variable_scope variables_scope;
+        variable_scope env_scope;
 
     public:
         environment( arguments& args )
@@ -458,9 +505,9 @@ namespace dmk
 #endif
             variables["cpus"] = std::to_string( std::max( 1u, std::thread::hardware_concurrency( ) ) );
             variables["build_cpus"] =
-                std::to_string( std::max( 1u, std::thread::hardware_concurrency( ) - 1 ) );
+                std::to_string( std::max( 2u, std::thread::hardware_concurrency( ) ) - 1 );
 
-            for ( const std::string str : args.env( ) )
+            for ( const std::string& str : args.env( ) )
             {
                 size_t p = str.find( "=" );
                 if ( p != std::string::npos )
@@ -492,9 +539,23 @@ namespace dmk
 #endif
 
             std::string platform = args.extract( "--platform", "CMGEN_PLATFORM", default_platform );
+            cache_dir = args.extract( "--cache", "CMGEN_CACHE", ( dev_dir / "cache" ).string( ) );
 
             initialize_dirs( root );
             initialize_platform( platform );
+
+            variables_scope = variables;
+            env_scope       = env;
+        }
+        // Hash of the values modules are expanded with, projects loaded with another hash are outdated
+        std::string hash( ) const
+        {
+            uint64_t hash = fnv1a_hash( platform_version + '\n' + options.stringify( ) + '\n' );
+            for ( const auto& v : variables )
+                hash = fnv1a_hash( v.first + '=' + v.second + '\n', hash );
+            for ( const auto& v : env )
+                hash = fnv1a_hash( v.first + '=' + v.second + '\n', hash );
+            return hash_string( hash );
         }
         void initialize_dirs( const path& root )
         {
@@ -508,6 +569,7 @@ namespace dmk
             create_directories( modules_dir );
             create_directories( licenses_dir );
             create_directories( flags_dir );
+            create_directories( cache_dir );
             variables["root_dir"]        = root_dir.string( );
             variables["dev_dir"]         = dev_dir.string( );
             variables["tools_dir"]       = tools_dir.string( );
@@ -515,6 +577,7 @@ namespace dmk
             variables["licenses_dir"]    = licenses_dir.string( );
             variables["source_root_dir"] = source_root_dir.string( );
             variables["flags_dir"]       = flags_dir.string( );
+            variables["cache_dir"]       = cache_dir.string( );
 
             println( "Dev dir: {}", dev_dir );
             println( "Root dir: {}", root_dir );
@@ -522,6 +585,7 @@ namespace dmk
             println( "Source dir: {}", source_root_dir );
             println( "Modules dir: {}", modules_dir );
             println( "Licenses dir: {}", licenses_dir );
+            println( "Cache dir: {}", cache_dir );
             load_paths( );
         }
         path find_msvc_dir( const char* env ) const
@@ -689,7 +753,6 @@ namespace dmk
             jom_path      = add_tool( tools_dir / "jom" / "jom" DMK_EXEC_EXT, "jom" );
             ninja_path    = add_tool( tools_dir / "ninja" / "ninja" DMK_EXEC_EXT, "ninja" );
             tar_path      = add_tool( msys_bin_dir / "bsdtar" DMK_EXEC_EXT, "tar" );
-            unzip_path    = add_tool( msys_bin_dir / "unzip" DMK_EXEC_EXT, "unzip" );
             curl_path     = add_tool( msys_bin_dir / "curl" DMK_EXEC_EXT, "curl" );
             wget_path     = add_tool( msys_bin_dir / "wget" DMK_EXEC_EXT, "wget" );
             patch_path    = add_tool( msys_bin_dir / "patch" DMK_EXEC_EXT, "patch" );
@@ -711,7 +774,6 @@ namespace dmk
             perl_path                                 = add_tool( "perl", "perl" );
             sevenzip_path                             = add_tool( "7za", "sevenzip" );
             tar_path                                  = add_tool( "bsdtar", "tar" );
-            unzip_path                                = add_tool( "unzip", "unzip" );
             curl_path                                 = add_tool( "curl", "curl" );
             wget_path                                 = add_tool( "wget", "wget" );
             patch_path                                = add_tool( "patch", "patch" );
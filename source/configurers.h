@@ -20,6 +20,9 @@
 #pragma once
 
 #include "cmgen.h"
+#include "manifests.h"
+#include <dmk_thread.h>
+#include <dmk_time.h>
 
 namespace dmk
 {
@@ -44,52 +47,52 @@ namespace dmk
         // Configure (all choosen architechtures)
         void configure( )
         {
-            for ( const architecture& a : m_archs )
-            {
-                configure_arch( a, false );
-            }
+            for_each_arch( [this]( const architecture& a )
+                           {
+                               configure_arch( a, false );
+                           } );
         }
         // Configure (all choosen architechtures)
         // Skip if it's already configured
         void configure_once( )
         {
-            for ( const architecture& a : m_archs )
-            {
-                configure_arch( a, true );
-            }
+            for_each_arch( [this]( const architecture& a )
+                           {
+                               configure_arch( a, true );
+                           } );
         }
         // Clean (all choosen architechtures)
         void configure_clean( )
         {
-            for ( const architecture& a : m_archs )
-            {
-                configure_clean_arch( a );
-            }
+            for_each_arch( [this]( const architecture& a )
+                           {
+                               configure_clean_arch( a );
+                           } );
         }
         // Build (all choosen architechtures)
         void build( )
         {
-            for ( const architecture& a : m_archs )
-            {
-                build_arch( a, false );
-            }
+            for_each_arch( [this]( const architecture& a )
+                           {
+                               build_arch( a, false );
+                           } );
         }
         // Build (all choosen architechtures)
         // Skip if it's already built
         void build_once( )
         {
-            for ( const architecture& a : m_archs )
-            {
-                build_arch( a, true );
-            }
+            for_each_arch( [this]( const architecture& a )
+                           {
+                               build_arch( a, true );
+                           } );
         }
         // Clean (all choosen architechtures)
         void build_clean( )
         {
-            for ( const architecture& a : m_archs )
-            {
-                build_clean_arch( a );
-            }
+            for_each_arch( [this]( const architecture& a )
+                           {
+                               build_clean_arch( a );
+                           } );
         }
 
         // Clean both (all choosen architechtures)
@@ -111,6 +114,11 @@ namespace dmk
             build( );
         }
 
+        // Limits how many architectures/configurations are processed at once (1 = sequentially)
+        static thread_budget jobs;
+        // Compiler jobs shared by all the build steps running at once
+        static job_budget build_jobs;
+
     protected:
         struct context
         {
@@ -119,6 +127,8 @@ namespace dmk
             json data;
             architecture arch;
             configuration config;
+            // Parallelism passed to the build tool
+            size_t jobs;
         };
         enum kind
         { //                   configure   build
@@ -147,6 +157,7 @@ namespace dmk
         {
             m_project_name = m_project->name( );
             m_insource     = m_data["insource"] || 0;
+            m_parallel     = !m_data.has_key( "parallel" ) || m_data["parallel"].as_bool( );
             m_multi_config = configurations( { configuration::all( ) } );
         }
         // Get configs for configure stage
@@ -193,83 +204,216 @@ namespace dmk
         {
             return SingleConfig;
         }
+
+        // Architectures use separate directories, so they can be processed concurrently
+        // unless the module disables it with "parallel": false
+        void for_each_arch( const std::function<void( const architecture& )>& func )
+        {
+            static thread_budget sequential( 1 );
+            get_kind( ); // resolve m_kind before worker threads read it
+            parallel_for_each( m_archs, m_parallel ? jobs : sequential, func );
+        }
+
+        // Only configurations of SingleConfig builders have their own configure directories,
+        // other kinds share one and must be processed sequentially
+        void for_each_config( const configurations& configs,
+                              const std::function<void( const configuration& )>& func )
+        {
+            static thread_budget sequential( 1 );
+            parallel_for_each( configs, m_parallel && get_kind( ) == SingleConfig ? jobs : sequential, func );
+        }
         // Configure project for given architecture
+        // When once is set, configurations with unchanged fingerprint are skipped
         void configure_arch( const architecture& a, bool once )
         {
-            if ( once && project::is_configured( m_project_name, a ) )
-                return;
-            for ( const configuration& c : c_configs( ) )
-            {
-                console_title ct( true, "Configuring {} {} {}...", m_project_name, a.name, c.name );
-                context ctx;
-                prepare( ctx, a, c );
+            elapsed_timer t;
+            std::atomic<bool> changed( false );
+            for_each_config( c_configs( ),
+                             [&]( const configuration& c )
+                             {
+                                 std::string fingerprint = configure_fingerprint( a, c );
+                                 if ( once && project::is_configured( m_project_name, a, c, fingerprint ) )
+                                     return;
+                                 changed = true;
+                                 elapsed_timer config_timer;
+                                 console_title ct(
+                                     true, "Configuring {} {} {}...", m_project_name, a.name, c.name );
+                                 context ctx;
+                                 prepare( ctx, a, c );
 #if !defined DMK_BUILDER_NOP
-                if ( m_insource )
-                {
-                    if ( !build_process::quiet )
-                        println( "In-source build: {}", ctx.configure_dir );
-                    copy_content( m_original_source_dir, ctx.configure_dir );
-                    ctx.source_dir = ctx.configure_dir;
-                }
-
-                do_configure( ctx );
+                                 if ( m_insource )
+                                 {
+                                     if ( !build_process::quiet )
+                                         println( "In-source build: {}", ctx.configure_dir );
+                                     copy_content( m_original_source_dir, ctx.configure_dir );
+                                     ctx.source_dir = ctx.configure_dir;
+                                 }
+
+                                 do_configure( ctx );
 #else
 #endif
-            }
-            project::set_configured( m_project_name, a );
+                                 project::set_configured(
+                                     m_project_name, a, c, fingerprint, config_timer.elapsed( ).as_double( ) );
+                             } );
+            if ( changed || !project::is_configured( m_project_name, a ) )
+                project::set_configured( m_project_name, a, m_project->hash( ), t.elapsed( ).as_double( ) );
         }
 
         // Clean project for given architecture
         void configure_clean_arch( const architecture& a )
         {
-            for ( const configuration& c : c_configs( ) )
-            {
-                console_title ct( true, "Cleaning {} {} {}...", m_project_name, a.name, c.name );
-                context ctx;
-                prepare( ctx, a, c );
+            for_each_config( c_configs( ),
+                             [&]( const configuration& c )
+                             {
+                                 console_title ct(
+                                     true, "Cleaning {} {} {}...", m_project_name, a.name, c.name );
+                                 context ctx;
+                                 prepare( ctx, a, c );
 #if !defined DMK_BUILDER_NOP
-                do_configure_clean( ctx );
+                                 do_configure_clean( ctx );
 #else
 #endif
-            }
+                             } );
             project::clear_configured( m_project_name, a, false );
         }
 
         // Build project for given architecture
+        // When once is set, configurations with unchanged fingerprint are skipped
         void build_arch( const architecture& a, bool once )
         {
-            if ( once && project::is_built( m_project_name, a ) )
-                return;
             configure_arch( a, true );
-            for ( const configuration& c : b_configs( ) )
-            {
-                console_title ct( true, "Building {} {} {}...", m_project_name, a.name, c.name );
-                context ctx;
-                prepare( ctx, a, c );
+            elapsed_timer t;
+            std::atomic<bool> changed( false );
+            for_each_config( b_configs( ),
+                             [&]( const configuration& c )
+                             {
+                                 std::string fingerprint = build_fingerprint( a, c );
+                                 if ( once && project::is_built( m_project_name,
+                                                                 a,
+                                                                 c,
+                                                                 fingerprint,
+                                                                 output_manifest( a, c ) ) )
+                                     return;
+                                 changed = true;
+                                 elapsed_timer config_timer;
+                                 console_title ct(
+                                     true, "Building {} {} {}...", m_project_name, a.name, c.name );
+                                 context ctx;
+                                 prepare( ctx, a, c );
+                                 job_budget::share share( build_jobs );
+                                 jobserver::slot slot( build_process::jobs.get( ) );
+                                 ctx.jobs = share.count( );
 #if !defined DMK_BUILDER_NOP
-                do_build( ctx );
+                                 do_build( ctx );
 #else
 #endif
-            }
-            project::set_built( m_project_name, a );
+                                 project::set_built( m_project_name,
+                                                     a,
+                                                     c,
+                                                     fingerprint,
+                                                     config_timer.elapsed( ).as_double( ),
+                                                     output_manifest( a, c ) );
+                             } );
+            if ( changed || !project::is_built( m_project_name, a ) )
+                project::set_built( m_project_name, a, m_project->hash( ), t.elapsed( ).as_double( ) );
         }
 
         // Clean project for given architecture
         void build_clean_arch( const architecture& a )
         {
-            for ( const configuration& c : b_configs( ) )
-            {
-                console_title ct( true, "Cleaning {} {} {}...", m_project_name, a.name, c.name );
-                context ctx;
-                prepare( ctx, a, c );
+            for_each_config( b_configs( ),
+                             [&]( const configuration& c )
+                             {
+                                 console_title ct(
+                                     true, "Cleaning {} {} {}...", m_project_name, a.name, c.name );
+                                 context ctx;
+                                 prepare( ctx, a, c );
 #if !defined DMK_BUILDER_NOP
-                do_build_clean( ctx );
+                                 do_build_clean( ctx );
 #else
 #endif
-            }
+                             } );
             project::clear_built( m_project_name, a, false );
         }
 
+        // Configure step depends on the expanded module data
+        // (and on the source tree for in-source builds, which are configured in a copy)
+        std::string configure_fingerprint( const architecture& a, const configuration& c ) const
+        {
+            uint64_t hash = fnv1a_hash( m_project->data( a, c ).stringify( ) );
+            if ( m_insource )
+                hash = fnv1a_hash( source_manifest( ), hash );
+            return hash_string( hash );
+        }
+
+        // Build result depends on the expanded module data, the source tree
+        // and the builds of the dependencies
+        std::string build_fingerprint( const architecture& a, const configuration& c ) const
+        {
+            uint64_t hash = fnv1a_hash( m_project->data( a, c ).stringify( ) );
+            hash          = fnv1a_hash( source_manifest( ), hash );
+            for ( const json& d : m_data["dependencies"].flatten( ) )
+            {
+                std::string dep = d || "";
+                if ( dep.empty( ) )
+                    continue;
+                hash = fnv1a_hash( dep + '=' + project::built_fingerprint( dep, a, c ) + '\n', hash );
+            }
+            return hash_string( hash );
+        }
+
+        // Hash of the listings of the directories the project is built into,
+        // a build is repeated if they are changed (or removed) after it
+        std::string output_manifest( const architecture& a, const configuration& c ) const
+        {
+            uint64_t hash = fnv1a_hash( "" );
+            for ( project::dir d : { project::dir::libraries,
+                                     project::dir::binaries,
+                                     project::dir::includes,
+                                     project::dir::install } )
+            {
+                hash = fnv1a_hash( manifests->hash( m_project->output_dir( d, a, c ) ), hash );
+            }
+            return hash_string( hash );
+        }
+
+        // Hash of the source tree listing, computed once per builder
+        // (only the directories changed since the previous run are read)
+        const std::string& source_manifest( ) const
+        {
+            std::call_once( m_source_manifest_once,
+                            [this]( )
+                            {
+                                m_source_manifest = manifests->hash( m_original_source_dir );
+                            } );
+            return m_source_manifest;
+        }
+
+        // Environment of the commands run for the context: project variables as CMGEN_* plus extra
+        // Built once per architecture/configuration and shared by all the processes started for them
+        ptr<const environment_block> child_environment( const context& ctx,
+                                                        const variable_list& extra = variable_list( ) )
+        {
+            std::string key = ctx.arch.name + '|' + ctx.config.name;
+            for ( const auto& e : extra )
+                key += '|' + e.first + '=' + e.second;
+            std::lock_guard<std::mutex> lock( m_environments_mutex );
+            auto it = m_environments.find( key );
+            if ( it == m_environments.end( ) )
+            {
+                variable_scope vars = env->variables_scope +
+                                      m_project->public_variables( ctx.arch, ctx.config ) + dynamic_variables( );
+                variable_list list = vars.transform( "CMGEN_", "", text_case::upper );
+                list.insert( extra.begin( ), extra.end( ) );
+                it = m_environments
+                         .emplace( key,
+                                   std::make_shared<const environment_block>(
+                                       *build_process::base_environment( ), list ) )
+                         .first;
+            }
+            return it->second;
+        }
+
         // Perform configuring (overridded in the derived classes)
         virtual void do_configure( const context& ctx )
         {
@@ -301,6 +445,7 @@ namespace dmk
             ctx.arch       = arch;
             ctx.config     = config;
             ctx.data       = m_project->data( arch, config );
+            ctx.jobs       = 1;
 
             if ( get_kind( ) == MultiConfig )
             {
@@ -344,7 +489,12 @@ namespace dmk
         configurations m_configs;
         path m_original_source_dir;
         mutable kind m_kind;
+        mutable std::once_flag m_source_manifest_once;
+        mutable std::string m_source_manifest;
+        std::mutex m_environments_mutex;
+        std::map<std::string, ptr<const environment_block>> m_environments;
         bool m_insource;
+        bool m_parallel;
     };
 
     // Builder for prebuilt binaries.
@@ -379,22 +529,22 @@ namespace dmk
         }
         cmake_console& D( const std::string& name, bool value )
         {
-            ( *this )( "-D" + name + ":BOOL={}", value ? "ON" : "OFF" );
+            arg( "-D" + name + ":BOOL=" + ( value ? "ON" : "OFF" ) );
             return *this;
         }
         cmake_console& D( const std::string& name, const char* value )
         {
-            ( *this )( "-D" + name + ":STRING={}", qo( value ) );
+            arg( "-D" + name + ":STRING=" + value );
             return *this;
         }
         cmake_console& D( const std::string& name, const std::string& value )
         {
-            ( *this )( "-D" + name + ":STRING={}", qo( value ) );
+            arg( "-D" + name + ":STRING=" + value );
             return *this;
         }
         cmake_console& D( const std::string& name, const path& value )
         {
-            ( *this )( "-D" + name + ":PATH={}", qo( value ) );
+            arg( "-D" + name + ":PATH=" + value.string( ) );
             return *this;
         }
     };
@@ -409,19 +559,55 @@ namespace dmk
         {
             return MultiConfig;
         }
+        // "generator": "ninja" in the module data selects Ninja Multi-Config (cmake 3.17+),
+        // other values are used as is instead of the generator of the architecture
+        std::string generator( const context& ctx ) const
+        {
+            std::string name = m_data["generator"] || "";
+            if ( name == "ninja" )
+                return "Ninja Multi-Config";
+            return name.empty( ) ? ctx.arch.generator : name;
+        }
+        // Generator of an existing build directory, empty if it isn't configured yet
+        static std::string configured_generator( const path& configure_dir )
+        {
+            path cache = configure_dir / "CMakeCache.txt";
+            if ( !is_file( cache ) )
+                return std::string( );
+            static const std::string key = "CMAKE_GENERATOR:INTERNAL=";
+            for ( std::string line : split( file_get_string( cache ), '\n' ) )
+            {
+                if ( !line.empty( ) && line.back( ) == '\r' )
+                    line.pop_back( );
+                if ( begins_with( line, key ) )
+                    return line.substr( key.size( ) );
+            }
+            return std::string( );
+        }
         virtual void do_configure( const context& ctx ) override
         {
+            const std::string gen     = generator( ctx );
+            const std::string old_gen = configured_generator( ctx.configure_dir );
+            if ( !old_gen.empty( ) && old_gen != gen )
+            {
+                // cmake refuses to change the generator of a configured directory
+                remove_if_exists( ctx.configure_dir / "CMakeCache.txt" );
+                if ( is_directory( ctx.configure_dir / "CMakeFiles" ) )
+                    remove_directory( ctx.configure_dir / "CMakeFiles" );
+            }
             cmake_console cmake( ctx.configure_dir );
-            cmake( "-G{}", qo( ctx.arch.generator ) );
+            cmake.arg( "-G" + gen );
             cmake( "--no-warn-unused-cli" );
+            if ( begins_with( gen, "Ninja" ) )
+                cmake.D( "CMAKE_MAKE_PROGRAM", env->ninja_path );
 
             std::string flags   = join_list( ctx.data["flags"], " " );
             std::string defines = join_list( ctx.data["defines"], ";" );
 
-            variable_list vars =
-                env->variables + m_project->public_variables( ctx.arch, ctx.config ) + dynamic_variables( );
+            variable_scope vars =
+                env->variables_scope + m_project->public_variables( ctx.arch, ctx.config ) + dynamic_variables( );
 
-            for ( const auto& var : vars )
+            for ( const auto& var : vars.flatten( ) )
             {
                 if ( var.first.find( '(' ) != std::string::npos )
                     continue;
@@ -453,7 +639,7 @@ namespace dmk
                 cmake.D( "CMAKE_BUILD_TYPE", ctx.config.name );
             }
 
-            cmake( "-C {}", qo( env->root_dir / "config.cmake" ) );
+            cmake.args( argument_list{ "-C", ( env->root_dir / "config.cmake" ).string( ) } );
             if ( m_data.has_key( "cmake_dir" ) )
             {
                 cmake( ctx.source_dir / ( m_data["cmake_dir"] || "" ) );
@@ -466,23 +652,32 @@ namespace dmk
         }
         virtual void do_build( const context& ctx ) override
         {
-            exec<build_process>(
-                ctx.configure_dir, env->cmake_path, "--build . --config {} ", ctx.config.name );
+            build_process cmd( env->cmake_path, ctx.configure_dir );
+            cmd.args( argument_list{ "--build", ".", "--config", ctx.config.name } );
+            // Passed by cmake 3.12+ to the native tool (-j, /m or -jobs),
+            // older versions ignore it unlike --parallel
+            // Makefile generators join the jobserver instead
+            if ( !build_process::jobs || !contains( generator( ctx ), "Makefiles" ) )
+                cmd.set_env( "CMAKE_BUILD_PARALLEL_LEVEL", std::to_string( ctx.jobs ) );
+            cmd( );
             bool install = m_data["cmakeinstall"] || 0;
             if ( install )
             {
+                path prefix = m_project->output_dir( project::dir::install, ctx.arch, ctx.config );
                 exec<build_process>( ctx.configure_dir,
                                      env->cmake_path,
-                                     "-DCMAKE_INSTALL_CONFIG_NAME={} "
-                                     "-DCMAKE_INSTALL_PREFIX:PATH={} -P cmake_install.cmake",
-                                     ctx.config.name,
-                                     m_project->output_dir( project::dir::install, ctx.arch, ctx.config ) );
+                                     argument_list{ "-DCMAKE_INSTALL_CONFIG_NAME=" + ctx.config.name,
+                                                    "-DCMAKE_INSTALL_PREFIX:PATH=" + prefix.string( ),
+                                                    "-P",
+                                                    "cmake_install.cmake" } );
             }
         }
         virtual void do_build_clean( const context& ctx ) override
         {
-            exec<build_process>(
-                ctx.configure_dir, env->cmake_path, "--build . --config {} --target clean", ctx.config.name );
+            exec<build_process>( ctx.configure_dir,
+                                 env->cmake_path,
+                                 argument_list{
+                                     "--build", ".", "--config", ctx.config.name, "--target", "clean" } );
         }
     };
 
@@ -494,12 +689,16 @@ namespace dmk
         friend class builder;
         virtual void do_build( const context& ctx ) override
         {
-            exec<build_process>(
-                ctx.configure_dir, env->scons_path, "{}", join( ctx.data["options"].flatten( ), " " ) );
+            exec<build_process>( ctx.configure_dir,
+                                 env->scons_path,
+                                 "-j{} {}",
+                                 ctx.jobs,
+                                 join( ctx.data["options"].flatten( ), " " ) );
 
             exec<build_process>( ctx.configure_dir,
                                  env->scons_path,
-                                 "{} install",
+                                 "-j{} {} install",
+                                 ctx.jobs,
                                  join( ctx.data["options"].flatten( ), " " ) );
         }
     };
@@ -518,10 +717,9 @@ namespace dmk
                 return;
             build_process cmd( command, ctx.configure_dir );
 
-            variable_list list =
-                env->variables + m_project->public_variables( ctx.arch, ctx.config ) + dynamic_variables( );
-            cmd.set_env( list.transform( "CMGEN_", "", text_case::upper ) );
-            cmd.set_env( "CMGEN_OPTIONS", join( ctx.data["options"].flatten( ), " " ) );
+            variable_list extra;
+            extra["CMGEN_OPTIONS"] = join( ctx.data["options"].flatten( ), " " );
+            cmd.set_env( child_environment( ctx, extra ) );
             cmd( );
         }
         virtual void do_build( const context& ctx ) override
@@ -532,10 +730,10 @@ namespace dmk
                 return;
             build_process cmd( command, ctx.configure_dir );
 
-            variable_list vars =
-                env->variables + m_project->public_variables( ctx.arch, ctx.config ) + dynamic_variables( );
-            cmd.set_env( vars.transform( "CMGEN_", "", text_case::upper ) );
-            cmd.set_env( "CMGEN_OPTIONS", join( ctx.data["options"].flatten( ), " " ) );
+            variable_list extra;
+            extra["CMGEN_OPTIONS"]    = join( ctx.data["options"].flatten( ), " " );
+            extra["CMGEN_BUILD_JOBS"] = std::to_string( ctx.jobs );
+            cmd.set_env( child_environment( ctx, extra ) );
             cmd( );
         }
     };
@@ -556,7 +754,8 @@ namespace dmk
             if ( !is_file( command ) )
                 throw error( "Can't file configure script: {}", command );
             build_process cmd( command, ctx.configure_dir );
-            cmd( "--prefix={}", m_project->output_dir( project::dir::install, ctx.arch, ctx.config ) );
+            path prefix = m_project->output_dir( project::dir::install, ctx.arch, ctx.config );
+            cmd.arg( "--prefix=" + prefix.string( ) );
 
             for ( const auto& o : ctx.data["options"].flatten( ) )
             {
@@ -566,8 +765,16 @@ namespace dmk
         }
         virtual void do_build( const context& ctx ) override
         {
-            exec<build_process>( ctx.configure_dir, env->make_path, "" );
-            exec<build_process>( ctx.configure_dir, env->make_path, "install" );
+            // -j would make it start its own jobserver
+            exec<build_process>( ctx.configure_dir,
+                                 env->make_path,
+                                 build_process::jobs ? argument_list{ }
+                                                     : argument_list{ "-j" + std::to_string( ctx.jobs ) } );
+            // install rules often aren't safe to run in parallel
+            build_process install( env->make_path, ctx.configure_dir );
+            install.set_env( environment_block::inherited( ) );
+            install.args( argument_list{ "-j1", "install" } );
+            install( );
         }
     };
 
@@ -593,10 +800,9 @@ namespace dmk
             path qmakefile = get_qmakefile( ctx );
             build_process cmd( env->configure_qmake_path, ctx.configure_dir );
 
-            variable_list vars =
-                env->variables + m_project->public_variables( ctx.arch, ctx.config ) + dynamic_variables( );
-            cmd.set_env( vars.transform( "CMGEN_", "", text_case::upper ) );
-            cmd.set_env( "CMGEN_QMAKEFILE", ( ctx.source_dir / qmakefile ).string( ) );
+            variable_list extra;
+            extra["CMGEN_QMAKEFILE"] = ( ctx.source_dir / qmakefile ).string( );
+            cmd.set_env( child_environment( ctx, extra ) );
             cmd( );
         }
         virtual void do_build( const context& ctx ) override
@@ -604,10 +810,10 @@ namespace dmk
             path qmakefile = get_qmakefile( ctx );
             build_process cmd( env->build_qmake_path, ctx.configure_dir );
 
-            variable_list vars =
-                env->variables + m_project->public_variables( ctx.arch, ctx.config ) + dynamic_variables( );
-            cmd.set_env( vars.transform( "CMGEN_", "", text_case::upper ) );
-            cmd.set_env( "CMGEN_QMAKEFILE", ( ctx.source_dir / qmakefile ).string( ) );
+            variable_list extra;
+            extra["CMGEN_QMAKEFILE"]  = ( ctx.source_dir / qmakefile ).string( );
+            extra["CMGEN_BUILD_JOBS"] = std::to_string( ctx.jobs );
+            cmd.set_env( child_environment( ctx, extra ) );
             cmd( );
         }
     };
@@ -649,7 +855,7 @@ namespace dmk
                                   const architectures& archs,
                                   const configurations& configs )
     {
-        const std::string type = proj->data( )["type"] || guess_type( proj );
+        const std::string type = proj->data( "type" ) || guess_type( proj );
 
         if ( type == "cmake" )
         {
@@ -0,0 +1,151 @@
+/**
+ * CMGen
+ * Copyright (C) 2015  Dmitriy Ka
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#pragma once
+
+#include "cmgen.h"
+#include <unordered_map>
+#include <mutex>
+
+namespace dmk
+{
+
+    // Parsed module descriptors
+    // Each descriptor is stored in binary form (see json_binary) as <dir>/<filename>.bin along with
+    // the path, size and modification time of the text it was parsed from.
+    // The text is parsed again only when one of them changes.
+    // Descriptors loaded by this process are also kept in memory
+    class descriptor_cache
+    {
+    public:
+        struct descriptor
+        {
+            int64_t mtime;
+            uint64_t size;
+            std::string hash; // of the text
+            json data;
+        };
+
+        explicit descriptor_cache( const path& dir ) : m_dir( dir )
+        {
+            create_directories( m_dir );
+        }
+        descriptor_cache( const descriptor_cache& ) = delete;
+        descriptor_cache& operator=( const descriptor_cache& ) = delete;
+
+        descriptor get( const path& filename )
+        {
+            const std::string key = filename.string( );
+            descriptor result;
+            result.mtime = file_mtime( filename );
+            result.size  = file_size( filename );
+            {
+                std::lock_guard<std::mutex> lock( m_mutex );
+                auto it = m_loaded.find( key );
+                if ( it != m_loaded.end( ) && is_current( it->second, result ) )
+                    return it->second;
+            }
+            const path cached = m_dir / ( filename.filename( ).string( ) + ".bin" );
+            if ( !read( cached, key, result ) )
+            {
+                file_contents text( filename );
+                result.hash = hash_string( fnv1a_hash( text.data( ), text.size( ) ) );
+                result.data = json::parse( text.data( ), text.size( ) );
+                // Changes made within the same second can keep the size and the time,
+                // such descriptors are cached only after they settle
+                if ( text.size( ) != result.size || file_age( filename ) < 2.0 )
+                    return result;
+                write( cached, key, result );
+            }
+            std::lock_guard<std::mutex> lock( m_mutex );
+            m_loaded[key] = result;
+            return result;
+        }
+
+    private:
+        static bool is_current( const descriptor& d, const descriptor& file )
+        {
+            return d.mtime == file.mtime && d.size == file.size;
+        }
+
+        // False if there is no valid entry for the current version of the file
+        static bool read( const path& cached, const std::string& key, descriptor& result )
+        {
+            if ( !is_file( cached ) )
+                return false;
+            try
+            {
+                file_contents contents( cached );
+                const size_t length = std::strlen( signature( ) );
+                if ( contents.size( ) < length || std::memcmp( contents.data( ), signature( ), length ) != 0 )
+                    return false;
+                json entry = json_binary::read( contents.data( ) + length, contents.size( ) - length );
+                descriptor d;
+                d.mtime = entry["mtime"].as_int( );
+                d.size  = entry["size"].as_int( );
+                if ( entry["path"].as_string( ) != key || !is_current( d, result ) )
+                    return false;
+                result.hash = entry["hash"].as_string( );
+                result.data = entry["data"];
+                return true;
+            }
+            catch ( const std::exception& )
+            {
+                return false;
+            }
+        }
+
+        // The cache is optional, failure to write it is ignored
+        void write( const path& cached, const std::string& key, const descriptor& d )
+        {
+            json entry = json::object( );
+            entry["path"]  = key;
+            entry["mtime"] = d.mtime;
+            entry["size"]  = d.size;
+            entry["hash"]  = d.hash;
+            entry["data"]  = d.data;
+            std::string bytes = signature( );
+            json_binary::write( entry, bytes );
+            std::lock_guard<std::mutex> lock( m_mutex );
+            // Written under another name, so readers never see a partially written file
+            path temp = unique_path( m_dir, ".tmp", cached.stem( ).string( ) + "-%04d" );
+            try
+            {
+                file_put_bytes( temp, bytes, open_mode::Binary );
+                rename( temp, cached );
+            }
+            catch ( const std::exception& )
+            {
+                remove_if_exists( temp );
+            }
+        }
+
+        // Changed along with the format of the entries
+        static const char* signature( )
+        {
+            return "CMGD0001";
+        }
+
+        const path m_dir;
+        std::mutex m_mutex;
+        std::unordered_map<std::string, descriptor> m_loaded;
+    };
+
+    extern ptr<descriptor_cache> descriptors;
+}
@@ -34,6 +34,14 @@
 #define DMK_ARCH_SSE 1
 #endif
 
+#if defined( __AVX2__ )
+#define DMK_ARCH_AVX2 1
+#endif
+
+#if defined( __SSE2__ ) || defined( _M_X64 ) || ( defined( _M_IX86_FP ) && _M_IX86_FP >= 2 )
+#define DMK_ARCH_SSE2 1
+#endif
+
 // OS
 
 #if defined( _WIN32 )
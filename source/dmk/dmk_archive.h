@@ -0,0 +1,1108 @@
+/**
+ * DMK
+ * Copyright (C) 2015  Dmitriy Ka
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#pragma once
+
+#include "dmk.h"
+#include "dmk_string.h"
+#include "dmk_result.h"
+#include "dmk_path.h"
+#include "dmk_console.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace dmk
+{
+
+    class archive_error : public error
+    {
+    public:
+        using error::error;
+    };
+
+    // Sequential byte source
+    class input_stream
+    {
+    public:
+        virtual ~input_stream( )
+        {
+        }
+        // Read up to size bytes, returns 0 at the end of the stream
+        virtual size_t read( void* data, size_t size ) = 0;
+
+        // Read exactly size bytes or throw
+        void read_all( void* data, size_t size )
+        {
+            uint8_t* p = static_cast<uint8_t*>( data );
+            while ( size > 0 )
+            {
+                size_t n = read( p, size );
+                if ( n == 0 )
+                    throw archive_error( "Unexpected end of archive" );
+                p += n;
+                size -= n;
+            }
+        }
+
+        void skip( uint64_t size )
+        {
+            uint8_t buffer[16384];
+            while ( size > 0 )
+            {
+                size_t n = static_cast<size_t>( std::min<uint64_t>( size, sizeof( buffer ) ) );
+                read_all( buffer, n );
+                size -= n;
+            }
+        }
+    };
+
+    class file_input : public input_stream
+    {
+    public:
+        explicit file_input( FILE* file, uint64_t limit = UINT64_MAX ) : m_file( file ), m_left( limit )
+        {
+        }
+        virtual size_t read( void* data, size_t size ) override
+        {
+            size = static_cast<size_t>( std::min<uint64_t>( size, m_left ) );
+            if ( size == 0 )
+                return 0;
+            size_t n = fread( data, 1, size, m_file );
+            if ( n == 0 && ferror( m_file ) )
+                throw archive_error( system_error, "Can't read archive" );
+            m_left -= n;
+            return n;
+        }
+
+    private:
+        FILE* m_file;
+        uint64_t m_left;
+    };
+
+    // Standard output of a command, the program is started without a shell
+    class pipe_input : public input_stream
+    {
+    public:
+        explicit pipe_input( const argument_list& args )
+        {
+            for ( const std::string& arg : args )
+            {
+                m_command += ( m_command.empty( ) ? "" : " " ) + qo( arg );
+            }
+#if defined( DMK_OS_WIN )
+            m_pipe = _popen( m_command.c_str( ), "rb" );
+            if ( !m_pipe )
+                throw archive_error( system_error, "Can't run {}", m_command );
+#else
+            int fds[2];
+            if ( open_pipe( fds ) != 0 )
+                throw archive_error( system_error, "Can't create pipe" );
+            std::vector<char*> argv;
+            for ( const std::string& arg : args )
+            {
+                argv.push_back( const_cast<char*>( arg.c_str( ) ) );
+            }
+            argv.push_back( nullptr );
+            posix_spawn_file_actions_t actions;
+            posix_spawn_file_actions_init( &actions );
+            int result = posix_spawn_file_actions_adddup2( &actions, fds[1], STDOUT_FILENO );
+            if ( result == 0 )
+                result = posix_spawnp(
+                    &m_pid, argv[0], &actions, NULL, argv.data( ), environment_block::inherited( )->envp( ) );
+            posix_spawn_file_actions_destroy( &actions );
+            ::close( fds[1] );
+            if ( result != 0 )
+            {
+                ::close( fds[0] );
+                errno = result;
+                throw archive_error( system_error, "Can't run {}", m_command );
+            }
+            m_pipe = fdopen( fds[0], "r" );
+#endif
+        }
+        ~pipe_input( )
+        {
+            if ( m_pipe )
+                close( );
+        }
+        virtual size_t read( void* data, size_t size ) override
+        {
+            return fread( data, 1, size, m_pipe );
+        }
+        // Wait for the command and check its exit code
+        void finish( )
+        {
+            // drain the output so the command isn't stopped by a broken pipe
+            uint8_t buffer[16384];
+            while ( read( buffer, sizeof( buffer ) ) > 0 )
+            {
+            }
+            int code = close( );
+            if ( code != 0 )
+                throw archive_error( "{} returns {}", m_command, code );
+        }
+
+    private:
+        int close( )
+        {
+#if defined( DMK_OS_WIN )
+            int code = _pclose( m_pipe );
+#else
+            fclose( m_pipe );
+            int status = 0;
+            while ( waitpid( m_pid, &status, 0 ) < 0 && errno == EINTR )
+            {
+            }
+            int code = WIFEXITED( status ) ? WEXITSTATUS( status ) : -1;
+#endif
+            m_pipe = nullptr;
+            return code;
+        }
+        std::string m_command;
+        FILE* m_pipe;
+#if !defined( DMK_OS_WIN )
+        pid_t m_pid;
+#endif
+    };
+
+    // CRC-32 (IEEE 802.3) as used by gzip and zip
+    class crc32
+    {
+    public:
+        crc32( ) : m_value( 0xFFFFFFFF )
+        {
+        }
+        void update( const void* data, size_t size )
+        {
+            static const std::vector<uint32_t> table = make_table( );
+            const uint8_t* p = static_cast<const uint8_t*>( data );
+            uint32_t c       = m_value;
+            for ( size_t i = 0; i < size; i++ )
+            {
+                c = table[( c ^ p[i] ) & 0xFF] ^ ( c >> 8 );
+            }
+            m_value = c;
+        }
+        uint32_t value( ) const
+        {
+            return m_value ^ 0xFFFFFFFF;
+        }
+
+    private:
+        static std::vector<uint32_t> make_table( )
+        {
+            std::vector<uint32_t> table( 256 );
+            for ( uint32_t n = 0; n < 256; n++ )
+            {
+                uint32_t c = n;
+                for ( int k = 0; k < 8; k++ )
+                {
+                    c = c & 1 ? 0xEDB88320 ^ ( c >> 1 ) : c >> 1;
+                }
+                table[n] = c;
+            }
+            return table;
+        }
+        uint32_t m_value;
+    };
+
+    // Streaming decoder of raw deflate data (RFC 1951)
+    class inflate_input : public input_stream
+    {
+    public:
+        explicit inflate_input( input_stream& source )
+            : m_source( source ),
+              m_in_pos( 0 ),
+              m_in_size( 0 ),
+              m_bits( 0 ),
+              m_count( 0 ),
+              m_eof( false ),
+              m_total( 0 ),
+              m_state( Header ),
+              m_final( false ),
+              m_stored_left( 0 ),
+              m_copy_len( 0 ),
+              m_copy_dist( 0 )
+        {
+        }
+
+        virtual size_t read( void* data, size_t size ) override
+        {
+            uint8_t* out    = static_cast<uint8_t*>( data );
+            size_t produced = 0;
+            while ( produced < size )
+            {
+                if ( m_copy_len > 0 )
+                {
+                    size_t n = std::min( m_copy_len, size - produced );
+                    for ( size_t i = 0; i < n; i++ )
+                    {
+                        put( out, produced, m_window[( m_total - m_copy_dist ) & window_mask] );
+                    }
+                    m_copy_len -= n;
+                    continue;
+                }
+                switch ( m_state )
+                {
+                case Header:
+                    if ( m_final )
+                    {
+                        m_state = Done;
+                        break;
+                    }
+                    read_block_header( );
+                    break;
+                case Stored:
+                    for ( ; m_stored_left > 0 && produced < size; m_stored_left-- )
+                    {
+                        put( out, produced, static_cast<uint8_t>( bits( 8 ) ) );
+                    }
+                    if ( m_stored_left == 0 )
+                        m_state = Header;
+                    break;
+                case Codes:
+                    while ( produced < size && m_copy_len == 0 && m_state == Codes )
+                    {
+                        decode_symbol( out, produced );
+                    }
+                    break;
+                case Done:
+                    return produced;
+                }
+            }
+            return produced;
+        }
+
+        // Read bytes that follow the deflate stream (e.g. gzip trailer)
+        void read_trailer( void* data, size_t size )
+        {
+            if ( m_state != Done )
+                throw archive_error( "Deflate stream isn't finished" );
+            drop( m_count % 8 );
+            uint8_t* p = static_cast<uint8_t*>( data );
+            for ( size_t i = 0; i < size; i++ )
+            {
+                p[i] = static_cast<uint8_t>( bits( 8 ) );
+            }
+        }
+
+    private:
+        enum
+        {
+            window_size = 32768,
+            window_mask = window_size - 1,
+            fast_bits   = 10,
+            max_bits    = 15
+        };
+
+        enum state
+        {
+            Header,
+            Stored,
+            Codes,
+            Done
+        };
+
+        struct huffman
+        {
+            uint16_t count[max_bits + 1];
+            uint16_t symbol[288];
+            uint16_t fast[1 << fast_bits]; // ( symbol << 4 ) | length, 0 if the code is longer
+
+            void build( const uint8_t* lengths, int n )
+            {
+                std::memset( count, 0, sizeof( count ) );
+                std::memset( fast, 0, sizeof( fast ) );
+                for ( int i = 0; i < n; i++ )
+                {
+                    count[lengths[i]]++;
+                }
+                count[0] = 0;
+                int left = 1;
+                for ( int len = 1; len <= max_bits; len++ )
+                {
+                    left = ( left << 1 ) - count[len];
+                    if ( left < 0 )
+                        throw archive_error( "Invalid deflate code lengths" );
+                }
+                uint16_t offsets[max_bits + 2];
+                offsets[1] = 0;
+                for ( int len = 1; len <= max_bits; len++ )
+                {
+                    offsets[len + 1] = offsets[len] + count[len];
+                }
+                for ( int i = 0; i < n; i++ )
+                {
+                    if ( lengths[i] )
+                        symbol[offsets[lengths[i]]++] = static_cast<uint16_t>( i );
+                }
+                // symbols are sorted by code, assign canonical codes in the same order
+                uint32_t code = 0;
+                int index     = 0;
+                for ( int len = 1; len <= fast_bits; len++ )
+                {
+                    for ( int i = 0; i < count[len]; i++, index++, code++ )
+                    {
+                        uint32_t reversed = 0;
+                        for ( int b = 0; b < len; b++ )
+                        {
+                            reversed |= ( ( code >> b ) & 1 ) << ( len - 1 - b );
+                        }
+                        for ( uint32_t j = reversed; j < ( 1u << fast_bits ); j += 1u << len )
+                        {
+                            fast[j] = static_cast<uint16_t>( ( symbol[index] << 4 ) | len );
+                        }
+                    }
+                    code <<= 1;
+                }
+            }
+        };
+
+        void put( uint8_t* out, size_t& produced, uint8_t value )
+        {
+            out[produced++]                  = value;
+            m_window[m_total & window_mask] = value;
+            m_total++;
+        }
+
+        void refill( )
+        {
+            while ( m_count <= 56 )
+            {
+                if ( m_in_pos == m_in_size )
+                {
+                    if ( m_eof )
+                        return;
+                    m_in_size = m_source.read( m_in, sizeof( m_in ) );
+                    m_in_pos  = 0;
+                    if ( m_in_size == 0 )
+                    {
+                        m_eof = true;
+                        return;
+                    }
+                }
+                m_bits |= uint64_t( m_in[m_in_pos++] ) << m_count;
+                m_count += 8;
+            }
+        }
+
+        void drop( int n )
+        {
+            if ( n > m_count )
+                throw archive_error( "Unexpected end of deflate stream" );
+            m_bits >>= n;
+            m_count -= n;
+        }
+
+        uint32_t bits( int n )
+        {
+            if ( m_count < n )
+                refill( );
+            uint32_t value = static_cast<uint32_t>( m_bits & ( ( uint64_t( 1 ) << n ) - 1 ) );
+            drop( n );
+            return value;
+        }
+
+        int decode( const huffman& h )
+        {
+            if ( m_count < max_bits )
+                refill( );
+            uint16_t entry = h.fast[m_bits & ( ( 1 << fast_bits ) - 1 )];
+            if ( entry )
+            {
+                drop( entry & 15 );
+                return entry >> 4;
+            }
+            int code  = 0;
+            int first = 0;
+            int index = 0;
+            for ( int len = 1; len <= max_bits; len++ )
+            {
+                code |= static_cast<int>( ( m_bits >> ( len - 1 ) ) & 1 );
+                int count = h.count[len];
+                if ( code - count < first )
+                {
+                    drop( len );
+                    return h.symbol[index + ( code - first )];
+                }
+                index += count;
+                first += count;
+                first <<= 1;
+                code <<= 1;
+            }
+            throw archive_error( "Invalid deflate code" );
+        }
+
+        void read_block_header( )
+        {
+            m_final   = bits( 1 ) != 0;
+            int type = bits( 2 );
+            if ( type == 0 )
+            {
+                drop( m_count % 8 );
+                uint32_t len  = bits( 16 );
+                uint32_t nlen = bits( 16 );
+                if ( len != ( ~nlen & 0xFFFF ) )
+                    throw archive_error( "Invalid stored block length" );
+                m_stored_left = len;
+                m_state       = Stored;
+            }
+            else if ( type == 1 )
+            {
+                uint8_t lengths[288 + 30];
+                std::memset( lengths, 8, 144 );
+                std::memset( lengths + 144, 9, 112 );
+                std::memset( lengths + 256, 7, 24 );
+                std::memset( lengths + 280, 8, 8 );
+                std::memset( lengths + 288, 5, 30 );
+                m_lencode.build( lengths, 288 );
+                m_distcode.build( lengths + 288, 30 );
+                m_state = Codes;
+            }
+            else if ( type == 2 )
+            {
+                read_dynamic_tables( );
+                m_state = Codes;
+            }
+            else
+            {
+                throw archive_error( "Invalid deflate block type" );
+            }
+        }
+
+        void read_dynamic_tables( )
+        {
+            static const uint8_t order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+            int nlen  = bits( 5 ) + 257;
+            int ndist = bits( 5 ) + 1;
+            int ncode = bits( 4 ) + 4;
+            if ( nlen > 286 || ndist > 30 )
+                throw archive_error( "Invalid deflate table size" );
+            uint8_t lengths[288 + 32] = { 0 };
+            for ( int i = 0; i < ncode; i++ )
+            {
+                lengths[order[i]] = static_cast<uint8_t>( bits( 3 ) );
+            }
+            huffman lencode;
+            lencode.build( lengths, 19 );
+
+            std::memset( lengths, 0, sizeof( lengths ) );
+            for ( int i = 0; i < nlen + ndist; )
+            {
+                int sym = decode( lencode );
+                if ( sym < 16 )
+                {
+                    lengths[i++] = static_cast<uint8_t>( sym );
+                    continue;
+                }
+                uint8_t value = 0;
+                int repeat;
+                if ( sym == 16 )
+                {
+                    if ( i == 0 )
+                        throw archive_error( "Invalid deflate code lengths" );
+                    value  = lengths[i - 1];
+                    repeat = 3 + bits( 2 );
+                }
+                else if ( sym == 17 )
+                {
+                    repeat = 3 + bits( 3 );
+                }
+                else
+                {
+                    repeat = 11 + bits( 7 );
+                }
+                if ( i + repeat > nlen + ndist )
+                    throw archive_error( "Invalid deflate code lengths" );
+                while ( repeat-- )
+                {
+                    lengths[i++] = value;
+                }
+            }
+            if ( lengths[256] == 0 )
+                throw archive_error( "Invalid deflate code lengths" );
+            m_lencode.build( lengths, nlen );
+            m_distcode.build( lengths + nlen, ndist );
+        }
+
+        void decode_symbol( uint8_t* out, size_t& produced )
+        {
+            static const uint16_t length_base[29] = { 3,  4,  5,  6,  7,  8,  9,  10, 11,  13,
+                                                      15, 17, 19, 23, 27, 31, 35, 43, 51,  59,
+                                                      67, 83, 99, 115, 131, 163, 195, 227, 258 };
+            static const uint8_t length_extra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+                                                      2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+            static const uint16_t dist_base[30] = { 1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+                                                    33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+                                                    1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+            static const uint8_t dist_extra[30] = { 0, 0, 0, 0, 1, 1, 2, 2,  3,  3,  4,  4,  5,  5,  6,
+                                                    6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+            int sym = decode( m_lencode );
+            if ( sym < 256 )
+            {
+                put( out, produced, static_cast<uint8_t>( sym ) );
+                return;
+            }
+            if ( sym == 256 )
+            {
+                m_state = Header;
+                return;
+            }
+            sym -= 257;
+            if ( sym >= 29 )
+                throw archive_error( "Invalid deflate length code" );
+            size_t len = length_base[sym] + bits( length_extra[sym] );
+            int dsym   = decode( m_distcode );
+            if ( dsym >= 30 )
+                throw archive_error( "Invalid deflate distance code" );
+            size_t dist = dist_base[dsym] + bits( dist_extra[dsym] );
+            if ( dist > m_total )
+                throw archive_error( "Invalid deflate distance" );
+            m_copy_len  = len;
+            m_copy_dist = dist;
+        }
+
+        input_stream& m_source;
+        uint8_t m_in[65536];
+        size_t m_in_pos;
+        size_t m_in_size;
+        uint64_t m_bits;
+        int m_count;
+        bool m_eof;
+        uint8_t m_window[window_size];
+        uint64_t m_total;
+        state m_state;
+        bool m_final;
+        size_t m_stored_left;
+        size_t m_copy_len;
+        size_t m_copy_dist;
+        huffman m_lencode;
+        huffman m_distcode;
+    };
+
+    // Decoder of gzip data (RFC 1952), checks CRC and size of the content
+    class gzip_input : public input_stream
+    {
+    public:
+        explicit gzip_input( input_stream& source ) : m_source( source ), m_size( 0 ), m_done( false )
+        {
+            uint8_t header[10];
+            m_source.read_all( header, sizeof( header ) );
+            if ( header[0] != 0x1F || header[1] != 0x8B || header[2] != 8 )
+                throw archive_error( "Invalid gzip header" );
+            uint8_t flags = header[3];
+            if ( flags & 4 ) // FEXTRA
+            {
+                uint8_t len[2];
+                m_source.read_all( len, 2 );
+                m_source.skip( len[0] | ( len[1] << 8 ) );
+            }
+            for ( uint8_t flag : { 8, 16 } ) // FNAME, FCOMMENT
+            {
+                if ( !( flags & flag ) )
+                    continue;
+                uint8_t c;
+                do
+                {
+                    m_source.read_all( &c, 1 );
+                } while ( c );
+            }
+            if ( flags & 2 ) // FHCRC
+                m_source.skip( 2 );
+            m_inflate.reset( new inflate_input( m_source ) );
+        }
+
+        virtual size_t read( void* data, size_t size ) override
+        {
+            if ( m_done )
+                return 0;
+            size_t n = m_inflate->read( data, size );
+            m_crc.update( data, n );
+            m_size += n;
+            if ( n == 0 && size > 0 )
+            {
+                uint8_t trailer[8];
+                m_inflate->read_trailer( trailer, sizeof( trailer ) );
+                uint32_t crc = trailer[0] | ( trailer[1] << 8 ) | ( trailer[2] << 16 ) | ( uint32_t( trailer[3] ) << 24 );
+                uint32_t isize =
+                    trailer[4] | ( trailer[5] << 8 ) | ( trailer[6] << 16 ) | ( uint32_t( trailer[7] ) << 24 );
+                if ( crc != m_crc.value( ) || isize != static_cast<uint32_t>( m_size ) )
+                    throw archive_error( "gzip data is corrupted (CRC mismatch)" );
+                m_done = true;
+            }
+            return n;
+        }
+
+        // Read the rest of the stream to verify the trailer
+        void finish( )
+        {
+            uint8_t buffer[16384];
+            while ( read( buffer, sizeof( buffer ) ) > 0 )
+            {
+            }
+        }
+
+    private:
+        input_stream& m_source;
+        std::unique_ptr<inflate_input> m_inflate;
+        crc32 m_crc;
+        uint64_t m_size;
+        bool m_done;
+    };
+
+    // Writes archive entries into the target directory
+    // Leading path components are removed according to strip,
+    // entries with fewer components are skipped
+    class archive_writer
+    {
+    public:
+        archive_writer( const path& target, int strip ) : m_target( target ), m_strip( strip )
+        {
+            create_directories( m_target );
+        }
+
+        // Return target path of the entry or empty path if it's stripped
+        path target_path( const std::string& name ) const
+        {
+            std::vector<std::string> parts;
+            for ( const std::string& part : split( replace_all( name, "\\", "/" ), '/' ) )
+            {
+                if ( part.empty( ) || part == "." )
+                    continue;
+                if ( part == ".." )
+                    throw archive_error( "Unsafe path in archive: {}", name );
+                parts.push_back( part );
+            }
+            if ( static_cast<int>( parts.size( ) ) <= m_strip )
+                return path( );
+            path result = m_target;
+            for ( size_t i = m_strip; i < parts.size( ); i++ )
+            {
+                result /= parts[i];
+            }
+            return result;
+        }
+
+        void directory( const path& p )
+        {
+            check_parents( p / "." );
+            if ( m_directories.insert( p.string( ) ).second )
+                create_directories( p );
+        }
+
+        // Copy size bytes from the input into the file
+        void file( const path& p, input_stream& in, uint64_t size, int mode, int64_t mtime, crc32* crc = nullptr )
+        {
+            directory( p.parent_path( ) );
+            check_parents( p );
+            if ( is_symlink( p ) )
+                remove( p );
+            FILE* f = open_file( p, open_mode::Write | open_mode::Binary );
+            if ( !f )
+                throw archive_error( system_error, "Can't create file {}", p );
+            try
+            {
+                uint8_t buffer[65536];
+                while ( size > 0 )
+                {
+                    size_t n = static_cast<size_t>( std::min<uint64_t>( size, sizeof( buffer ) ) );
+                    in.read_all( buffer, n );
+                    if ( crc )
+                        crc->update( buffer, n );
+                    if ( fwrite( buffer, 1, n, f ) != n )
+                        throw archive_error( system_error, "Can't write file {}", p );
+                    size -= n;
+                }
+            }
+            catch ( ... )
+            {
+                fclose( f );
+                throw;
+            }
+            fclose( f );
+            set_attributes( p, mode, mtime );
+        }
+
+        void symlink( const path& p, const std::string& target )
+        {
+            // Only relative links that stay inside of the target directory are allowed
+            path link( replace_all( target, "\\", "/" ) );
+            if ( link.has_root_path( ) )
+                throw archive_error( "Unsafe link in archive: {} -> {}", p, target );
+            // and don't go through other symlinks
+            path resolved = p.parent_path( );
+            size_t depth  = relative_parts( resolved ).size( );
+            for ( const path& part : link )
+            {
+                if ( is_symlink( resolved ) && depth > 0 )
+                    throw archive_error( "Unsafe link in archive: {} -> {}", p, target );
+                if ( part == ".." )
+                {
+                    if ( depth == 0 )
+                        throw archive_error( "Unsafe link in archive: {} -> {}", p, target );
+                    resolved = resolved.parent_path( );
+                    depth--;
+                }
+                else if ( part != "." && !part.empty( ) )
+                {
+                    resolved /= part;
+                    depth++;
+                }
+            }
+            directory( p.parent_path( ) );
+            check_parents( p );
+            if ( exists( symlink_status( p ) ) )
+                remove( p );
+            create_symlink( path( target ), p );
+        }
+
+        void hardlink( const path& p, const path& existing )
+        {
+            directory( p.parent_path( ) );
+            check_parents( p );
+            check_parents( existing );
+            copy_file( existing, p, DMK_COPY_OVERWRITE );
+        }
+
+    private:
+        // Components of the path below the target directory
+        std::vector<std::string> relative_parts( const path& p ) const
+        {
+            std::vector<std::string> parts;
+            auto it = p.begin( );
+            for ( auto t = m_target.begin( ); t != m_target.end( ) && it != p.end( ); ++t )
+            {
+                ++it;
+            }
+            for ( ; it != p.end( ); ++it )
+            {
+                parts.push_back( it->string( ) );
+            }
+            return parts;
+        }
+
+        // Throw if the entry would be written through a symlink extracted earlier
+        void check_parents( const path& p ) const
+        {
+            path current = m_target;
+            std::vector<std::string> parts = relative_parts( p.parent_path( ) );
+            for ( const std::string& part : parts )
+            {
+                current /= part;
+                if ( is_symlink( current ) )
+                    throw archive_error( "Unsafe path in archive: {} is a symlink", current );
+            }
+        }
+
+        static void set_attributes( const path& p, int mode, int64_t mtime )
+        {
+#if !defined( DMK_OS_WIN )
+            if ( mode > 0 )
+                permissions( p, static_cast<perms>( mode & 0777 ) );
+            if ( mtime > 0 )
+                last_write_time( p, static_cast<std::time_t>( mtime ) );
+#endif
+        }
+
+        const path m_target;
+        const int m_strip;
+        std::set<std::string> m_directories;
+    };
+
+    // Extract tar stream (ustar, GNU and pax extensions)
+    inline void extract_tar( input_stream& in, const path& target, int strip )
+    {
+        archive_writer writer( target, strip );
+        std::string long_name;
+        std::string long_link;
+        uint8_t header[512];
+        for ( ;; )
+        {
+            size_t n = in.read( header, sizeof( header ) );
+            if ( n == 0 )
+                break;
+            if ( n < sizeof( header ) )
+                in.read_all( header + n, sizeof( header ) - n );
+            if ( std::all_of( header, header + 512, []( uint8_t c ) { return c == 0; } ) )
+                break; // end of archive
+
+            auto field = [&]( size_t offset, size_t size )
+            {
+                const char* p = reinterpret_cast<const char*>( header + offset );
+                return std::string( p, std::find( p, p + size, '\0' ) );
+            };
+            auto number = [&]( size_t offset, size_t size ) -> uint64_t
+            {
+                if ( header[offset] & 0x80 ) // base-256
+                {
+                    uint64_t value = header[offset] & 0x7F;
+                    for ( size_t i = 1; i < size; i++ )
+                    {
+                        value = ( value << 8 ) | header[offset + i];
+                    }
+                    return value;
+                }
+                return std::strtoull( field( offset, size ).c_str( ), nullptr, 8 );
+            };
+
+            std::string name = field( 0, 100 );
+            if ( field( 257, 5 ) == "ustar" && header[345] )
+                name = field( 345, 155 ) + "/" + name;
+            std::string link = field( 157, 100 );
+            uint64_t size    = number( 124, 12 );
+            int mode         = static_cast<int>( number( 100, 8 ) );
+            int64_t mtime    = static_cast<int64_t>( number( 136, 12 ) );
+            char type        = static_cast<char>( header[156] );
+            uint64_t padding = ( 512 - size % 512 ) % 512;
+
+            if ( type == 'L' || type == 'K' || type == 'x' )
+            {
+                std::string data( static_cast<size_t>( size ), '\0' );
+                in.read_all( &data[0], data.size( ) );
+                in.skip( padding );
+                if ( type == 'L' )
+                    long_name = data.c_str( );
+                else if ( type == 'K' )
+                    long_link = data.c_str( );
+                else
+                {
+                    // pax records: "<length> <key>=<value>\n"
+                    for ( size_t pos = 0; pos < data.size( ); )
+                    {
+                        size_t len = std::strtoul( data.c_str( ) + pos, nullptr, 10 );
+                        size_t sp  = data.find( ' ', pos );
+                        if ( len == 0 || sp == std::string::npos || pos + len > data.size( ) )
+                            break;
+                        std::string record = data.substr( sp + 1, pos + len - sp - 2 );
+                        size_t eq          = record.find( '=' );
+                        if ( eq != std::string::npos )
+                        {
+                            std::string key = record.substr( 0, eq );
+                            if ( key == "path" )
+                                long_name = record.substr( eq + 1 );
+                            else if ( key == "linkpath" )
+                                long_link = record.substr( eq + 1 );
+                        }
+                        pos += len;
+                    }
+                }
+                continue;
+            }
+            if ( !long_name.empty( ) )
+                name = long_name;
+            if ( !long_link.empty( ) )
+                link = long_link;
+            long_name.clear( );
+            long_link.clear( );
+
+            path p = writer.target_path( name );
+            if ( p.empty( ) )
+            {
+                if ( type == '0' || type == '\0' || type == '7' )
+                    in.skip( size + padding );
+                continue;
+            }
+            switch ( type )
+            {
+            case '0':
+            case '\0':
+            case '7':
+                writer.file( p, in, size, mode, mtime );
+                in.skip( padding );
+                break;
+            case '5':
+                writer.directory( p );
+                break;
+            case '2':
+                writer.symlink( p, link );
+                break;
+            case '1':
+            {
+                path existing = writer.target_path( link );
+                if ( existing.empty( ) || !is_file( existing ) )
+                    throw archive_error( "Invalid hard link in archive: {} -> {}", name, link );
+                writer.hardlink( p, existing );
+                break;
+            }
+            default: // devices, fifos and unknown entries
+                in.skip( size + padding );
+                break;
+            }
+        }
+    }
+
+    // Extract zip archive (stored and deflated entries)
+    inline void extract_zip( FILE* file, const path& target, int strip )
+    {
+        auto u16 = []( const uint8_t* p )
+        {
+            return static_cast<uint32_t>( p[0] | ( p[1] << 8 ) );
+        };
+        auto u32 = []( const uint8_t* p )
+        {
+            return static_cast<uint32_t>( p[0] | ( p[1] << 8 ) | ( p[2] << 16 ) | ( uint32_t( p[3] ) << 24 ) );
+        };
+
+        // find the end of central directory record
+        if ( fseek( file, 0, SEEK_END ) != 0 )
+            throw archive_error( system_error, "Can't read zip archive" );
+        long file_size = ftell( file );
+        long tail_size = std::min<long>( file_size, 65535 + 22 );
+        std::vector<uint8_t> tail( static_cast<size_t>( tail_size ) );
+        fseek( file, file_size - tail_size, SEEK_SET );
+        file_input( file ).read_all( tail.data( ), tail.size( ) );
+        long eocd = -1;
+        for ( long i = tail_size - 22; i >= 0; i-- )
+        {
+            if ( u32( &tail[i] ) == 0x06054b50 )
+            {
+                eocd = i;
+                break;
+            }
+        }
+        if ( eocd < 0 )
+            throw archive_error( "Invalid zip archive" );
+        uint32_t entries   = u16( &tail[eocd + 10] );
+        uint32_t cd_size   = u32( &tail[eocd + 12] );
+        uint32_t cd_offset = u32( &tail[eocd + 16] );
+        if ( entries == 0xFFFF || cd_size == 0xFFFFFFFF || cd_offset == 0xFFFFFFFF )
+            throw archive_error( "zip64 archives aren't supported" );
+
+        std::vector<uint8_t> cd( cd_size );
+        fseek( file, cd_offset, SEEK_SET );
+        file_input( file ).read_all( cd.data( ), cd.size( ) );
+
+        archive_writer writer( target, strip );
+        size_t pos = 0;
+        for ( uint32_t e = 0; e < entries; e++ )
+        {
+            if ( pos + 46 > cd.size( ) || u32( &cd[pos] ) != 0x02014b50 )
+                throw archive_error( "Invalid zip central directory" );
+            const uint8_t* h     = &cd[pos];
+            uint32_t made_by     = u16( h + 4 );
+            uint32_t flags       = u16( h + 8 );
+            uint32_t method      = u16( h + 10 );
+            uint32_t crc         = u32( h + 16 );
+            uint32_t csize       = u32( h + 20 );
+            uint32_t usize       = u32( h + 24 );
+            uint32_t name_len    = u16( h + 28 );
+            uint32_t extra_len   = u16( h + 30 );
+            uint32_t comment_len = u16( h + 32 );
+            uint32_t attributes  = u32( h + 38 );
+            uint32_t offset      = u32( h + 42 );
+            if ( pos + 46 + name_len > cd.size( ) )
+                throw archive_error( "Invalid zip central directory" );
+            std::string name( reinterpret_cast<const char*>( h + 46 ), name_len );
+            pos += 46 + name_len + extra_len + comment_len;
+
+            bool unix_host  = ( made_by >> 8 ) == 3;
+            int mode        = unix_host ? static_cast<int>( ( attributes >> 16 ) & 0777 ) : 0;
+            bool is_symlink = unix_host && ( ( attributes >> 16 ) & 0170000 ) == 0120000;
+
+            path p = writer.target_path( name );
+            if ( p.empty( ) )
+                continue;
+            if ( ends_with( name, '/' ) )
+            {
+                writer.directory( p );
+                continue;
+            }
+            if ( flags & 1 )
+                throw archive_error( "Encrypted zip entries aren't supported: {}", name );
+            if ( method != 0 && method != 8 )
+                throw archive_error( "Unsupported zip compression method {}: {}", method, name );
+
+            uint8_t local[30];
+            fseek( file, offset, SEEK_SET );
+            file_input( file ).read_all( local, sizeof( local ) );
+            if ( u32( local ) != 0x04034b50 )
+                throw archive_error( "Invalid zip local header: {}", name );
+            fseek( file, offset + 30 + u16( local + 26 ) + u16( local + 28 ), SEEK_SET );
+
+            file_input data( file, csize );
+            std::unique_ptr<inflate_input> inflated( method == 8 ? new inflate_input( data ) : nullptr );
+            input_stream& in = inflated ? static_cast<input_stream&>( *inflated ) : data;
+            crc32 actual;
+            if ( is_symlink )
+            {
+                std::string link( usize, '\0' );
+                in.read_all( &link[0], link.size( ) );
+                actual.update( link.data( ), link.size( ) );
+                writer.symlink( p, link );
+            }
+            else
+            {
+                writer.file( p, in, usize, mode, 0, &actual );
+            }
+            if ( actual.value( ) != crc )
+                throw archive_error( "zip entry is corrupted (CRC mismatch): {}", name );
+        }
+    }
+
+    // Extract archive using the built-in decoders (tar, tar.gz and zip)
+    // Returns false if the format isn't supported
+    inline bool extract_archive( const path& filename, const path& target, int strip )
+    {
+        FILE* f = open_file( filename, open_mode::Read | open_mode::Binary );
+        if ( !f )
+            throw archive_error( system_error, "Can't open archive {}", filename );
+        try
+        {
+            uint8_t magic[512] = { 0 };
+            size_t n           = fread( magic, 1, sizeof( magic ), f );
+            fseek( f, 0, SEEK_SET );
+            bool result = true;
+            if ( n >= 4 && magic[0] == 'P' && magic[1] == 'K' && ( magic[2] == 3 || magic[2] == 5 ) )
+            {
+                extract_zip( f, target, strip );
+            }
+            else if ( n >= 3 && magic[0] == 0x1F && magic[1] == 0x8B )
+            {
+                file_input file( f );
+                gzip_input gzip( file );
+                extract_tar( gzip, target, strip );
+                gzip.finish( );
+            }
+            else if ( n == 512 && std::memcmp( magic + 257, "ustar", 5 ) == 0 )
+            {
+                file_input file( f );
+                extract_tar( file, target, strip );
+            }
+            else
+            {
+                result = false;
+            }
+            fclose( f );
+            return result;
+        }
+        catch ( const std::exception& e )
+        {
+            fclose( f );
+            throw archive_error( e, "Can't extract archive {}", filename );
+        }
+    }
+}
@@ -34,13 +34,28 @@
 #include <unistd.h>
 #include <spawn.h>
 #include <sys/wait.h>
-#include <wordexp.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <cerrno>
+#if defined DMK_OS_LINUX
+#include <sys/epoll.h>
+#endif
+// posix_spawn can set the working directory of the child (glibc 2.29, macOS 10.15)
+#if defined DMK_OS_MAC
+#define DMK_SPAWN_CHDIR 1
+#elif defined __GLIBC__ && ( __GLIBC__ > 2 || ( __GLIBC__ == 2 && __GLIBC_MINOR__ >= 29 ) )
+#define DMK_SPAWN_CHDIR 1
+#endif
 #endif
 #include <iostream>
 #include <cstdlib>
 #include <map>
 #include <functional>
 #include <exception>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <deque>
 
 #if defined DMK_OS_POSIX
 extern char** environ;
@@ -199,58 +214,559 @@ namespace dmk
         using error::error;
     };
 
+    // Redirects println/errorln output of the current thread into a string
+    // Threads started on behalf of the current one may share the capture (see parallel_for_each)
+    struct output_capture
+    {
+    public:
+        output_capture( ) : m_saved( current( ) )
+        {
+            current( ) = this;
+        }
+        ~output_capture( )
+        {
+            current( ) = m_saved;
+        }
+        void append( const std::string& text )
+        {
+            std::lock_guard<std::mutex> lock( m_mutex );
+            m_text.append( text );
+        }
+        const std::string& text( ) const
+        {
+            return m_text;
+        }
+        static output_capture*& current( )
+        {
+            static thread_local output_capture* capture = nullptr;
+            return capture;
+        }
+
+    private:
+        output_capture* m_saved;
+        std::mutex m_mutex;
+        std::string m_text;
+    };
+
+    // Last lines of output of the processes started by the current thread (and threads working
+    // on its behalf, see parallel_for_each) and the names of their log files
+    // Filled only for processes whose output goes to log files
+    struct output_tail
+    {
+    public:
+        static const size_t default_lines = 30;
+
+        explicit output_tail( size_t max_lines = default_lines )
+            : m_saved( current( ) ), m_max_lines( max_lines )
+        {
+            current( ) = this;
+        }
+        ~output_tail( )
+        {
+            current( ) = m_saved;
+        }
+        void append( const std::deque<std::string>& lines, const std::vector<path>& logs )
+        {
+            std::lock_guard<std::mutex> lock( m_mutex );
+            m_lines.insert( m_lines.end( ), lines.begin( ), lines.end( ) );
+            while ( m_lines.size( ) > m_max_lines )
+                m_lines.pop_front( );
+            m_logs.insert( m_logs.end( ), logs.begin( ), logs.end( ) );
+        }
+        std::vector<std::string> lines( ) const
+        {
+            std::lock_guard<std::mutex> lock( m_mutex );
+            return std::vector<std::string>( m_lines.begin( ), m_lines.end( ) );
+        }
+        std::vector<path> logs( ) const
+        {
+            std::lock_guard<std::mutex> lock( m_mutex );
+            return m_logs;
+        }
+        static output_tail*& current( )
+        {
+            static thread_local output_tail* tail = nullptr;
+            return tail;
+        }
+
+    private:
+        output_tail* m_saved;
+        const size_t m_max_lines;
+        mutable std::mutex m_mutex;
+        std::deque<std::string> m_lines;
+        std::vector<path> m_logs;
+    };
+
+#if defined DMK_OS_POSIX
+    // Pipe with both ends closed on exec
+    inline int open_pipe( int fds[2] )
+    {
+#if defined DMK_OS_LINUX
+        return pipe2( fds, O_CLOEXEC );
+#else
+        if ( pipe( fds ) != 0 )
+            return -1;
+        fcntl( fds[0], F_SETFD, FD_CLOEXEC );
+        fcntl( fds[1], F_SETFD, FD_CLOEXEC );
+        return 0;
+#endif
+    }
+
+    // Output of a child process: stdout and stderr are written into log files,
+    // the last lines of both are kept in memory
+    class process_output
+    {
+    public:
+        process_output( const path& stdout_log, const path& stderr_log, size_t max_lines )
+            : m_logs{ stdout_log, stderr_log }, m_max_lines( max_lines ), m_open( 2 )
+        {
+            for ( int i = 0; i < 2; i++ )
+            {
+                m_files[i] = open_file( m_logs[i], open_mode::Write | open_mode::Binary );
+                if ( !m_files[i] )
+                {
+                    if ( i )
+                        fclose( m_files[0] );
+                    throw error( system_error, "Can't create log file {}", m_logs[i] );
+                }
+            }
+        }
+        ~process_output( )
+        {
+            fclose( m_files[0] );
+            fclose( m_files[1] );
+        }
+        process_output( const process_output& ) = delete;
+        process_output& operator=( const process_output& ) = delete;
+
+        // Called by the pump thread only
+        void write( int stream, const char* data, size_t size )
+        {
+            fwrite( data, 1, size, m_files[stream] );
+            std::lock_guard<std::mutex> lock( m_mutex );
+            std::string& partial = m_partial[stream];
+            for ( const char* end = data + size; data < end; )
+            {
+                const char* eol = static_cast<const char*>( std::memchr( data, '\n', end - data ) );
+                if ( !eol )
+                {
+                    partial.append( data, end );
+                    break;
+                }
+                partial.append( data, eol );
+                add_line( partial );
+                partial.clear( );
+                data = eol + 1;
+            }
+        }
+        // End of one of the streams
+        void close( int stream )
+        {
+            fflush( m_files[stream] );
+            std::lock_guard<std::mutex> lock( m_mutex );
+            if ( !m_partial[stream].empty( ) )
+                add_line( m_partial[stream] );
+            m_partial[stream].clear( );
+            if ( --m_open == 0 )
+                m_closed.notify_all( );
+        }
+        // Until both streams are closed
+        void wait( )
+        {
+            std::unique_lock<std::mutex> lock( m_mutex );
+            m_closed.wait( lock, [this]( ) { return m_open == 0; } );
+        }
+        // False if the streams are still open after the timeout
+        bool wait_for( std::chrono::milliseconds timeout )
+        {
+            std::unique_lock<std::mutex> lock( m_mutex );
+            return m_closed.wait_for( lock, timeout, [this]( ) { return m_open == 0; } );
+        }
+        const std::deque<std::string>& lines( ) const
+        {
+            return m_lines;
+        }
+        const std::vector<path>& logs( ) const
+        {
+            return m_logs;
+        }
+
+    private:
+        void add_line( const std::string& line )
+        {
+            m_lines.push_back( line );
+            if ( m_lines.size( ) > m_max_lines )
+                m_lines.pop_front( );
+        }
+
+        const std::vector<path> m_logs;
+        const size_t m_max_lines;
+        FILE* m_files[2];
+        std::string m_partial[2];
+        std::deque<std::string> m_lines;
+        int m_open;
+        std::mutex m_mutex;
+        std::condition_variable m_closed;
+    };
+
+    // Reads output pipes of all child processes in a single thread (epoll on Linux, poll elsewhere),
+    // so any number of concurrent processes can write without blocking
+    class output_pump
+    {
+    public:
+        static output_pump& instance( )
+        {
+            static output_pump pump;
+            return pump;
+        }
+
+        // Takes ownership of fd, the pipe is read until the end of file
+        void add( int fd, int stream, const std::shared_ptr<process_output>& output )
+        {
+            fcntl( fd, F_SETFL, fcntl( fd, F_GETFL ) | O_NONBLOCK );
+            source* src = new source{ fd, stream, output };
+            std::lock_guard<std::mutex> lock( m_mutex );
+#if defined DMK_OS_LINUX
+            epoll_event event;
+            event.events   = EPOLLIN;
+            event.data.ptr = src;
+            if ( epoll_ctl( m_poll, EPOLL_CTL_ADD, fd, &event ) != 0 )
+            {
+                delete src;
+                throw error( system_error, "Can't read output of the process" );
+            }
+            m_sources.push_back( src );
+#else
+            m_sources.push_back( src );
+            wake( );
+#endif
+        }
+
+        // Stops reading the pipes of the output which may be held open by background children
+        // of the process: data already in the pipes is read, then the pipes are closed
+        void release( const std::shared_ptr<process_output>& output )
+        {
+            std::lock_guard<std::mutex> lock( m_mutex );
+            m_released.push_back( output );
+            wake( );
+        }
+
+    private:
+        struct source
+        {
+            int fd;
+            int stream;
+            std::shared_ptr<process_output> output;
+        };
+
+        output_pump( )
+        {
+            if ( open_pipe( m_wake ) != 0 )
+                throw error( system_error, "Can't create pipe" );
+#if defined DMK_OS_LINUX
+            m_poll = epoll_create1( EPOLL_CLOEXEC );
+            epoll_event event;
+            event.events   = EPOLLIN;
+            event.data.ptr = nullptr;
+            if ( m_poll < 0 || epoll_ctl( m_poll, EPOLL_CTL_ADD, m_wake[0], &event ) != 0 )
+                throw error( system_error, "Can't create epoll instance" );
+#endif
+            // lives until the end of the program
+            std::thread( [this]( ) { run( ); } ).detach( );
+        }
+
+        // False at the end of the stream
+        static bool read( source* src )
+        {
+            char buffer[65536];
+            ssize_t size = ::read( src->fd, buffer, sizeof( buffer ) );
+            if ( size > 0 )
+            {
+                src->output->write( src->stream, buffer, size );
+                return true;
+            }
+            return size < 0 && ( errno == EAGAIN || errno == EINTR );
+        }
+        // Unregisters the source before closing, so the descriptor can't be reused while it is still polled
+        void drop( source* src )
+        {
+#if defined DMK_OS_LINUX
+            epoll_ctl( m_poll, EPOLL_CTL_DEL, src->fd, nullptr );
+#endif
+            {
+                std::lock_guard<std::mutex> lock( m_mutex );
+                m_sources.erase( std::find( m_sources.begin( ), m_sources.end( ), src ) );
+            }
+            ::close( src->fd );
+            src->output->close( src->stream );
+            delete src;
+        }
+
+        // Called with the mutex locked
+        void wake( )
+        {
+            char wake = 0;
+            if ( ::write( m_wake[1], &wake, 1 ) )
+            {
+            }
+        }
+
+        // Drops sources of the released outputs after reading what is left in their pipes
+        void drop_released( )
+        {
+            char wake[64];
+            if ( ::read( m_wake[0], wake, sizeof( wake ) ) )
+            {
+            }
+            std::vector<source*> released;
+            {
+                std::lock_guard<std::mutex> lock( m_mutex );
+                for ( source* src : m_sources )
+                {
+                    if ( std::find( m_released.begin( ), m_released.end( ), src->output ) != m_released.end( ) )
+                        released.push_back( src );
+                }
+                m_released.clear( );
+            }
+            for ( source* src : released )
+            {
+                char buffer[65536];
+                ssize_t size;
+                while ( ( size = ::read( src->fd, buffer, sizeof( buffer ) ) ) > 0 )
+                    src->output->write( src->stream, buffer, size );
+                drop( src );
+            }
+        }
+
+#if defined DMK_OS_LINUX
+        void run( )
+        {
+            epoll_event events[64];
+            for ( ;; )
+            {
+                int count  = epoll_wait( m_poll, events, 64, -1 );
+                bool woken = false;
+                for ( int i = 0; i < count; i++ )
+                {
+                    source* src = static_cast<source*>( events[i].data.ptr );
+                    if ( !src )
+                        woken = true;
+                    else if ( !read( src ) )
+                        drop( src );
+                }
+                // after the events, which may refer to the dropped sources
+                if ( woken )
+                    drop_released( );
+            }
+        }
+
+        int m_poll;
+#else
+        void run( )
+        {
+            std::vector<pollfd> fds;
+            std::vector<source*> sources;
+            for ( ;; )
+            {
+                {
+                    std::lock_guard<std::mutex> lock( m_mutex );
+                    sources = m_sources;
+                }
+                fds.assign( 1, pollfd{ m_wake[0], POLLIN, 0 } );
+                for ( source* src : sources )
+                    fds.push_back( pollfd{ src->fd, POLLIN, 0 } );
+                if ( poll( fds.data( ), fds.size( ), -1 ) <= 0 )
+                    continue;
+                for ( size_t i = 0; i < sources.size( ); i++ )
+                {
+                    if ( fds[i + 1].revents && !read( sources[i] ) )
+                        drop( sources[i] );
+                }
+                if ( fds[0].revents )
+                    drop_released( );
+            }
+        }
+#endif
+
+        int m_wake[2];
+        std::mutex m_mutex;
+        std::vector<source*> m_sources;
+        std::vector<std::shared_ptr<process_output>> m_released;
+    };
+#endif
+
+    // GNU make jobserver: a pool of tokens shared by the child processes, cooperating tools (make)
+    // started with makeflags( ) in MAKEFLAGS take a token for every job they run beyond the first one.
+    // The pool holds a token for each job, the first job of a tool is paid with a slot taken before
+    // the tool is started, so the number of jobs never exceeds the size of the pool
+    class jobserver
+    {
+    public:
+        explicit jobserver( size_t jobs )
+        {
+#if defined DMK_OS_WIN
+            m_name      = fmt::format( "cmgen-jobserver-{}", GetCurrentProcessId( ) );
+            m_semaphore = CreateSemaphoreA( NULL, LONG( jobs ), LONG( jobs ), m_name.c_str( ) );
+            if ( !m_semaphore )
+                throw error( system_error, "Can't create jobserver" );
+#else
+            // inherited by the children
+            if ( pipe( m_fds ) != 0 )
+                throw error( system_error, "Can't create jobserver" );
+            const std::string tokens( jobs, '+' );
+            if ( ::write( m_fds[1], tokens.data( ), tokens.size( ) ) != ssize_t( tokens.size( ) ) )
+            {
+                ::close( m_fds[0] );
+                ::close( m_fds[1] );
+                throw error( system_error, "Can't create jobserver" );
+            }
+#endif
+        }
+        ~jobserver( )
+        {
+#if defined DMK_OS_WIN
+            CloseHandle( m_semaphore );
+#else
+            ::close( m_fds[0] );
+            ::close( m_fds[1] );
+#endif
+        }
+        jobserver( const jobserver& ) = delete;
+        jobserver& operator=( const jobserver& ) = delete;
+
+        // Value of MAKEFLAGS for the children (--jobserver-fds is understood by make before 4.2)
+        std::string makeflags( ) const
+        {
+#if defined DMK_OS_WIN
+            return " -j --jobserver-auth=" + m_name;
+#else
+            return fmt::format( " -j --jobserver-fds={0},{1} --jobserver-auth={0},{1}", m_fds[0], m_fds[1] );
+#endif
+        }
+
+        // Token held while a tool runs, waits until one is free
+        // Nothing is taken if there is no jobserver
+        class slot
+        {
+        public:
+            explicit slot( jobserver* server )
+                : m_server( server ), m_token( server ? server->acquire( ) : 0 )
+            {
+            }
+            ~slot( )
+            {
+                if ( m_server )
+                    m_server->release( m_token );
+            }
+            slot( const slot& ) = delete;
+            slot& operator=( const slot& ) = delete;
+
+        private:
+            jobserver* m_server;
+            const char m_token;
+        };
+
+    private:
+        char acquire( )
+        {
+#if defined DMK_OS_WIN
+            if ( WaitForSingleObject( m_semaphore, INFINITE ) != WAIT_OBJECT_0 )
+                throw error( system_error, "Can't get a token from jobserver" );
+            return '+';
+#else
+            for ( ;; )
+            {
+                char token;
+                ssize_t size = ::read( m_fds[0], &token, 1 );
+                if ( size == 1 )
+                    return token;
+                if ( size < 0 && errno == EAGAIN )
+                {
+                    // a child has made the pipe non-blocking
+                    pollfd fd = { m_fds[0], POLLIN, 0 };
+                    poll( &fd, 1, -1 );
+                }
+                else if ( size == 0 || errno != EINTR )
+                    throw error( system_error, "Can't get a token from jobserver" );
+            }
+#endif
+        }
+        // Tokens are returned as they were taken
+        void release( char token )
+        {
+#if defined DMK_OS_WIN
+            ReleaseSemaphore( m_semaphore, 1, NULL );
+#else
+            while ( ::write( m_fds[1], &token, 1 ) < 0 && errno == EINTR )
+            {
+            }
+#endif
+        }
+
+#if defined DMK_OS_WIN
+        std::string m_name;
+        HANDLE m_semaphore;
+#else
+        int m_fds[2];
+#endif
+    };
+
+    inline void console_print( const std::string& text )
+    {
+        if ( output_capture* capture = output_capture::current( ) )
+        {
+            capture->append( text );
+        }
+        else
+        {
+            fmt::print( "{}", text );
+        }
+    }
+
     void println( const std::string& message )
     {
-        fmt::print( "{}", message );
-        fmt::print( "\n" );
+        console_print( message + "\n" );
     }
 
     void println( const char* message )
     {
-        fmt::print( "{}", message );
-        fmt::print( "\n" );
+        console_print( std::string( message ) + "\n" );
     }
 
     template <typename... Args>
     void println( const std::string& message, const Args&... args )
     {
-        fmt::print( message, args... );
-        fmt::print( "\n" );
+        console_print( fmt::format( message, args... ) + "\n" );
     }
     template <typename... Args>
     void println( const char* message, const Args&... args )
     {
-        fmt::print( message, args... );
-        fmt::print( "\n" );
+        console_print( fmt::format( message, args... ) + "\n" );
     }
 
     void errorln( const std::string& message )
     {
         red_text c;
-        fmt::print( "{}", message );
-        fmt::print( "\n" );
+        console_print( message + "\n" );
     }
 
     void errorln( const char* message )
     {
         red_text c;
-        fmt::print( "{}", message );
-        fmt::print( "\n" );
+        console_print( std::string( message ) + "\n" );
     }
 
     template <typename... Args>
     void errorln( const std::string& message, const Args&... args )
     {
         red_text c;
-        fmt::print( message, args... );
-        fmt::print( "\n" );
+        console_print( fmt::format( message, args... ) + "\n" );
     }
     template <typename... Args>
     void errorln( const char* message, const Args&... args )
     {
         red_text c;
-        fmt::print( message, args... );
-        fmt::print( "\n" );
+        console_print( fmt::format( message, args... ) + "\n" );
     }
 
 #ifdef DMK_OS_WIN
@@ -286,6 +802,121 @@ namespace dmk
 
 #endif
 
+    // Environment of child processes: the environment of this process with some variables added or replaced
+    // It is kept as one block in the form the system takes it, so it is built once and
+    // shared by all the processes started with it
+    class environment_block
+    {
+    public:
+#if defined DMK_OS_WIN
+        typedef std::wstring string_type;
+#else
+        typedef std::string string_type;
+#endif
+        typedef std::map<std::string, std::string> variables;
+
+        // Environment of this process as it was at the first call
+        static const std::shared_ptr<const environment_block>& inherited( )
+        {
+            static const std::shared_ptr<const environment_block> block( new environment_block( ) );
+            return block;
+        }
+
+        environment_block( const environment_block& base, const variables& vars )
+            : m_entries( base.m_entries )
+        {
+            for ( const auto& v : vars )
+            {
+                string_type name( v.first.begin( ), v.first.end( ) );
+                string_type value( v.second.begin( ), v.second.end( ) );
+                m_entries[key( name )] = name + string_type( 1, '=' ) + value;
+            }
+            build( );
+        }
+        environment_block( const environment_block& ) = delete;
+        environment_block& operator=( const environment_block& ) = delete;
+
+#if defined DMK_OS_WIN
+        // For CreateProcess with CREATE_UNICODE_ENVIRONMENT
+        void* data( ) const
+        {
+            return const_cast<wchar_t*>( m_block.data( ) );
+        }
+#else
+        char* const* envp( ) const
+        {
+            return m_pointers.data( );
+        }
+        // Value of the variable, nullptr if it isn't set
+        const char* get( const std::string& name ) const
+        {
+            auto it = m_entries.find( name );
+            return it != m_entries.end( ) ? it->second.c_str( ) + name.size( ) + 1 : nullptr;
+        }
+#endif
+
+    private:
+        environment_block( )
+        {
+#if defined DMK_OS_WIN
+            LPWCH current_env = GetEnvironmentStringsW( );
+            for ( LPWCH e = current_env; *e; e += wcslen( e ) + 1 )
+                add( e );
+            FreeEnvironmentStringsW( current_env );
+#else
+            for ( char** e = environ; *e; e++ )
+                add( *e );
+#endif
+            build( );
+        }
+
+        void add( const string_type& entry )
+        {
+            // the name can start with '=' on Windows (current directories of drives)
+            size_t eq = entry.find( '=', 1 );
+            if ( eq != string_type::npos )
+                m_entries[key( entry.substr( 0, eq ) )] = entry;
+        }
+
+        // Names are case insensitive on Windows, the block must be sorted by them
+        static string_type key( string_type name )
+        {
+#if defined DMK_OS_WIN
+            for ( wchar_t& c : name )
+                c = towupper( c );
+#endif
+            return name;
+        }
+
+        void build( )
+        {
+            size_t size = 1;
+            for ( const auto& e : m_entries )
+                size += e.second.size( ) + 1;
+            m_block.reserve( size );
+            for ( const auto& e : m_entries )
+            {
+                m_block += e.second;
+                m_block.push_back( 0 );
+            }
+            m_block.push_back( 0 );
+#if !defined DMK_OS_WIN
+            m_pointers.reserve( m_entries.size( ) + 1 );
+            for ( size_t pos = 0; m_block[pos]; pos += std::strlen( &m_block[pos] ) + 1 )
+                m_pointers.push_back( &m_block[pos] );
+            m_pointers.push_back( nullptr );
+#endif
+        }
+
+        std::map<string_type, string_type> m_entries;
+        string_type m_block;
+#if !defined DMK_OS_WIN
+        std::vector<char*> m_pointers;
+#endif
+    };
+
+    typedef std::vector<std::string> argument_list;
+
     struct process
     {
     public:
@@ -293,25 +924,43 @@ namespace dmk
             : m_program( program ), m_working_dir( working_dir ), m_exit_code( 0 ), m_log_output( false )
         {
         }
+        // Append a part of the command line, it is split into arguments as the shell would do it
+        // (see split_arguments, variables are expanded when the program is started)
         process& operator( )( const std::string& value )
         {
             if ( !m_args.empty( ) )
                 m_args += " ";
             m_args += value;
+#if defined DMK_OS_POSIX
+            m_argv.push_back( std::make_pair( true, value ) );
+#endif
             return *this;
         }
         process& operator( )( const char* value )
         {
-            if ( !m_args.empty( ) )
-                m_args += " ";
-            m_args += value;
-            return *this;
+            return ( *this )( std::string( value ) );
         }
         process& operator( )( const path& value )
+        {
+            return arg( value.string( ) );
+        }
+        // Append a single argument as is
+        process& arg( const std::string& value )
         {
             if ( !m_args.empty( ) )
                 m_args += " ";
             m_args += qo( value );
+#if defined DMK_OS_POSIX
+            m_argv.push_back( std::make_pair( false, value ) );
+#endif
+            return *this;
+        }
+        process& args( const argument_list& values )
+        {
+            for ( const std::string& v : values )
+            {
+                arg( v );
+            }
             return *this;
         }
         void set_env( const std::map<std::string, std::string>& map )
@@ -322,6 +971,11 @@ namespace dmk
         {
             m_environ[name] = value;
         }
+        // Variables set by set_env are added on top of this block
+        void set_env( const std::shared_ptr<const environment_block>& block )
+        {
+            m_environment = block;
+        }
         template <typename... Args>
         process& operator( )( const std::string& key, const Args&... args )
         {
@@ -333,49 +987,285 @@ namespace dmk
         }
 
 #if defined DMK_OS_POSIX
-        void split_free( char** argv )
+        // Split the command line as the shell would do it: quotes and backslashes are handled,
+        // $NAME, ${NAME} and ~ at the start of a word are expanded using env (the expanded values
+        // aren't split into words). Other expansions need a shell and are rejected
+        static void split_arguments( const std::string& cmdline,
+                                     const environment_block& env,
+                                     argument_list& result )
         {
-            if ( argv )
+            std::string word;
+            bool in_word = false;
+            // a word made of empty expansions only is dropped, as by the shell
+            bool literal = false;
+            for ( size_t i = 0; i < cmdline.size( ); i++ )
             {
-                for ( int i = 0; argv[i]; i++ )
+                char c = cmdline[i];
+                if ( c == ' ' || c == '\t' || c == '\n' )
+                {
+                    if ( in_word && ( literal || !word.empty( ) ) )
+                        result.push_back( std::move( word ) );
+                    word.clear( );
+                    in_word = false;
+                    literal = false;
+                    continue;
+                }
+                if ( c == '~' && !in_word )
                 {
-                    free( argv[i] );
+                    std::string prefix = cmdline.substr( i, cmdline.find_first_of( "/ \t\n", i ) - i );
+                    if ( prefix != "~" )
+                        throw error( "Can't expand {} in {}: only ~ is supported", prefix, cmdline );
+                    const char* home = env.get( "HOME" );
+                    if ( !home )
+                        throw error( "Can't expand ~ in {}: HOME isn't set", cmdline );
+                    word += home;
+                    in_word = true;
+                    literal = true;
+                    continue;
+                }
+                in_word = true;
+                if ( c == '\'' )
+                {
+                    size_t end = cmdline.find( '\'', i + 1 );
+                    if ( end == std::string::npos )
+                        throw error( "Unterminated quote in {}", cmdline );
+                    word.append( cmdline, i + 1, end - i - 1 );
+                    i       = end;
+                    literal = true;
+                }
+                else if ( c == '"' )
+                {
+                    for ( i++;; i++ )
+                    {
+                        if ( i == cmdline.size( ) )
+                            throw error( "Unterminated quote in {}", cmdline );
+                        if ( cmdline[i] == '"' )
+                            break;
+                        if ( cmdline[i] == '$' || cmdline[i] == '`' )
+                        {
+                            i = expand( cmdline, i, env, word ) - 1;
+                            continue;
+                        }
+                        if ( cmdline[i] == '\\' && i + 1 < cmdline.size( ) &&
+                             std::strchr( "\"\\$`", cmdline[i + 1] ) )
+                            i++;
+                        word += cmdline[i];
+                    }
+                    literal = true;
+                }
+                else if ( c == '$' || c == '`' )
+                {
+                    i = expand( cmdline, i, env, word ) - 1;
+                }
+                else if ( c == '\\' && i + 1 < cmdline.size( ) )
+                {
+                    word += cmdline[++i];
+                    literal = true;
+                }
+                else
+                {
+                    word += c;
+                    literal = true;
                 }
-                free( argv );
             }
+            if ( in_word && ( literal || !word.empty( ) ) )
+                result.push_back( std::move( word ) );
         }
-        char** split_commandline( const char* cmdline, int* argc )
+
+        // Expand $NAME or ${NAME} at pos into word (unset variables are empty)
+        // Returns the position after it. A $ not followed by a name is kept as is
+        static size_t expand( const std::string& cmdline,
+                              size_t pos,
+                              const environment_block& env,
+                              std::string& word )
         {
-            int i;
-            char** argv = NULL;
-            assert( argc );
-            if ( !cmdline )
+            auto is_name = []( char c, bool first )
+            {
+                return c == '_' || ( c >= 'a' && c <= 'z' ) || ( c >= 'A' && c <= 'Z' ) ||
+                       ( !first && c >= '0' && c <= '9' );
+            };
+            auto unsupported = [&]( )
+            {
+                return error( "Can't expand {} in {}: commands are started without a shell, "
+                              "only $NAME, ${{NAME}} and ~ are supported",
+                              cmdline.substr( pos, cmdline.find_first_of( " \t\n", pos ) - pos ),
+                              cmdline );
+            };
+            if ( cmdline[pos] == '`' )
+                throw unsupported( );
+            size_t start      = pos + 1;
+            const bool braces = start < cmdline.size( ) && cmdline[start] == '{';
+            if ( braces )
+                start++;
+            size_t end = start;
+            while ( end < cmdline.size( ) && is_name( cmdline[end], end == start ) )
+                end++;
+            if ( braces && ( end == start || end == cmdline.size( ) || cmdline[end] != '}' ) )
+                throw unsupported( );
+            if ( end == start )
             {
-                return NULL;
+                if ( start < cmdline.size( ) && std::strchr( "(0123456789@*#?$!-", cmdline[start] ) )
+                    throw unsupported( );
+                word += '$';
+                return start;
             }
-            wordexp_t p;
-            if ( wordexp( cmdline, &p, 0 ) )
+            const char* value = env.get( cmdline.substr( start, end - start ) );
+            word += value ? value : "";
+            return braces ? end + 1 : end;
+        }
+
+        // Start the program, output is redirected into the pipes if outputs isn't nullptr
+        // Returns 0 or the error code
+        int start( const argument_list& args, const int* outputs, pid_t& pid )
+        {
+            std::vector<char*> argv;
+            for ( const std::string& a : args )
+            {
+                argv.push_back( const_cast<char*>( a.c_str( ) ) );
+            }
+            argv.push_back( nullptr );
+
+            // output printed so far goes before the output of the program
+            fflush( stdout );
+            fflush( stderr );
+            // The working directory is set for the child only, so processes can be started from any thread
+            const std::string dir = m_working_dir.string( );
+            std::shared_ptr<const environment_block> envp = environment( );
+#if defined DMK_SPAWN_CHDIR
+            posix_spawn_file_actions_t actions;
+            posix_spawn_file_actions_init( &actions );
+            int result = posix_spawn_file_actions_addchdir_np( &actions, dir.c_str( ) );
+            if ( result == 0 && outputs )
+                result = posix_spawn_file_actions_adddup2( &actions, outputs[0], STDOUT_FILENO );
+            if ( result == 0 && outputs )
+                result = posix_spawn_file_actions_adddup2( &actions, outputs[1], STDERR_FILENO );
+            if ( result == 0 )
+                result = posix_spawnp( &pid, argv[0], &actions, NULL, argv.data( ), envp->envp( ) );
+            posix_spawn_file_actions_destroy( &actions );
+            return result;
+#else
+            return fork_exec( pid, dir.c_str( ), argv.data( ), envp->envp( ), outputs );
+#endif
+        }
+
+        // Exit status of the program
+        static int wait_exit( pid_t pid )
+        {
+            int status = 0;
+            while ( waitpid( pid, &status, 0 ) < 0 && errno == EINTR )
             {
-                return NULL;
             }
-            *argc = p.we_wordc;
-            if ( !( argv = ( char** )calloc( *argc + 1, sizeof( char* ) ) ) )
+            return WIFEXITED( status ) ? WEXITSTATUS( status ) : 128 + WTERMSIG( status );
+        }
+
+#if !defined DMK_SPAWN_CHDIR
+        // fork, chdir and exec, an error of chdir or exec is passed to the parent through a pipe
+        // that is closed by a successful exec
+        static int fork_exec(
+            pid_t& pid, const char* dir, char** argv, char* const* envp, const int* outputs )
+        {
+            int fds[2];
+            if ( open_pipe( fds ) != 0 )
+                return errno;
+            pid = fork( );
+            if ( pid == 0 )
             {
-                goto fail;
+                if ( outputs )
+                {
+                    dup2( outputs[0], STDOUT_FILENO );
+                    dup2( outputs[1], STDERR_FILENO );
+                }
+                // the child is a copy of this thread only, nothing else reads environ there
+                environ = const_cast<char**>( envp );
+                if ( chdir( dir ) == 0 )
+                    execvp( argv[0], argv );
+                int code = errno;
+                if ( ::write( fds[1], &code, sizeof( code ) ) )
+                {
+                }
+                _exit( 127 );
             }
-            for ( i = 0; i < p.we_wordc; i++ )
+            int result = pid < 0 ? errno : 0;
+            ::close( fds[1] );
+            if ( pid > 0 )
             {
-                if ( !( argv[i] = strdup( p.we_wordv[i] ) ) )
+                ssize_t size;
+                while ( ( size = ::read( fds[0], &result, sizeof( result ) ) ) < 0 && errno == EINTR )
                 {
-                    goto fail;
                 }
+                if ( size == sizeof( result ) )
+                    waitpid( pid, nullptr, 0 );
+                else
+                    result = 0;
+            }
+            ::close( fds[0] );
+            return result;
+        }
+#endif
+
+        // Run the program, its output goes to the log files if m_log_output is set
+        void run( argument_list& command )
+        {
+            std::shared_ptr<process_output> output;
+            int pipes[2][2];
+            int outputs[2];
+            if ( m_log_output )
+            {
+                {
+                    // log_path picks names not used yet, processes started at once must not get the same
+                    static std::mutex log_mutex;
+                    std::lock_guard<std::mutex> lock( log_mutex );
+                    path stdout_log, stderr_log;
+                    log_path( stdout_log, stderr_log );
+                    output = std::make_shared<process_output>(
+                        stdout_log, stderr_log, static_cast<size_t>( output_tail::default_lines ) );
+                }
+                if ( open_pipe( pipes[0] ) != 0 )
+                    throw error( system_error, "Can't create pipe" );
+                if ( open_pipe( pipes[1] ) != 0 )
+                {
+                    ::close( pipes[0][0] );
+                    ::close( pipes[0][1] );
+                    throw error( system_error, "Can't create pipe" );
+                }
+                outputs[0] = pipes[0][1];
+                outputs[1] = pipes[1][1];
+            }
+            pid_t pid;
+            int result = start( command, output ? outputs : nullptr, pid );
+            if ( result == ENOEXEC && command.front( ) != "bash" )
+            {
+                // script without #! line, the shell used to run it this way
+                command.insert( command.begin( ), "bash" );
+                result = start( command, output ? outputs : nullptr, pid );
+            }
+            if ( output )
+            {
+                for ( int i = 0; i < 2; i++ )
+                {
+                    ::close( pipes[i][1] );
+                    output_pump::instance( ).add( pipes[i][0], i, output );
+                }
+            }
+            if ( result != 0 )
+            {
+                errno = result;
+                throw error( system_error, "Can't start process {}", m_program.string( ) );
+            }
+            m_exit_code = wait_exit( pid );
+            if ( output )
+            {
+                // the pipes are closed when the program and its children exit,
+                // children left running in the background (daemons) aren't waited for
+                if ( !output->wait_for( std::chrono::seconds( 5 ) ) )
+                {
+                    output_pump::instance( ).release( output );
+                    output->wait( );
+                }
+                m_stderr_log = output->logs( )[1];
+                if ( output_tail* tail = output_tail::current( ) )
+                    tail->append( output->lines( ), output->logs( ) );
             }
-            wordfree( &p );
-            return argv;
-        fail:
-            wordfree( &p );
-            split_free( argv );
-            return NULL;
         }
 #endif
         void operator( )( bool may_throw = true )
@@ -385,24 +1275,20 @@ namespace dmk
 #endif
             before( );
 #if defined DMK_OS_POSIX
-            pid_t pid;
-            std::string cmd  = "bash -c \"" + m_program.string( ) + " " + m_args + "\"";
-            //std::string prog = "bash"; // m_program.filename( ).string( );
-
-            path saved = current_path( );
-            current_path( m_working_dir );
-
-            int argc    = 0;
-            char** argv = split_commandline( cmd.c_str( ), &argc );
-            char** envp = environ;
-
-            m_exit_code = posix_spawn( &pid, "/bin/bash", NULL, NULL, argv, envp );
-            if ( m_exit_code == 0 )
+            // The program is started directly, only .sh commands are run by the shell
+            argument_list command;
+            if ( m_program.extension( ) == ".sh" )
+                command.push_back( "bash" );
+            command.push_back( m_program.string( ) );
+            std::shared_ptr<const environment_block> env = environment( );
+            for ( const auto& a : m_argv )
             {
-                waitpid( pid, &m_exit_code, 0 );
+                if ( a.first )
+                    split_arguments( a.second, *env, command );
+                else
+                    command.push_back( a.second );
             }
-            split_free( argv );
-            current_path( saved );
+            run( command );
 #elif defined DMK_OS_WIN
             handle_finalizers handles;
 
@@ -446,7 +1332,8 @@ namespace dmk
                     throw error( system_error, "Can't create log file for {} ({})", m_program, stderr_log );
                 }
                 handles.push_back( si.hStdError );
-                si.dwFlags = STARTF_USESTDHANDLES;
+                si.dwFlags   = STARTF_USESTDHANDLES;
+                m_stderr_log = stderr_log;
             }
 
             std::vector<wchar_t> args;
@@ -467,32 +1354,14 @@ namespace dmk
             }
             args.reserve( args.size( ) + 100 );
 
-            std::vector<wchar_t> env;
-            LPWCH current_env = GetEnvironmentStringsW( );
-
-            for ( LPWCH c_env = current_env; *c_env; )
-            {
-                size_t len = wcslen( c_env );
-                env.insert( env.end( ), c_env, c_env + len );
-                env.push_back( 0 );
-                c_env += len + 1;
-            }
-            FreeEnvironmentStringsW( current_env );
-            for ( const auto& e : m_environ )
-            {
-                env.insert( env.end( ), e.first.begin( ), e.first.end( ) );
-                env.push_back( '=' );
-                env.insert( env.end( ), e.second.begin( ), e.second.end( ) );
-                env.push_back( 0 );
-            }
-            env.push_back( 0 );
+            std::shared_ptr<const environment_block> env = environment( );
             if ( !CreateProcessW( NULL,
                                   args.data( ),
                                   NULL,
                                   NULL,
                                   m_log_output ? TRUE : FALSE,
                                   NORMAL_PRIORITY_CLASS | CREATE_UNICODE_ENVIRONMENT,
-                                  env.data( ),
+                                  env->data( ),
                                   m_working_dir.wstring( ).c_str( ),
                                   &si,
                                   &pi ) )
@@ -519,6 +1388,11 @@ namespace dmk
 
             if ( m_exit_code != 0 && may_throw )
             {
+                if ( m_log_output )
+                    throw console_error( "{} returns {} (see {})",
+                                         m_program.filename( ).string( ),
+                                         m_exit_code,
+                                         m_stderr_log.string( ) );
                 throw console_error( "{} returns {}", m_program.filename( ).string( ), m_exit_code );
             }
         }
@@ -534,6 +1408,15 @@ namespace dmk
         virtual void after( )
         {
         }
+        // Environment of the child process
+        std::shared_ptr<const environment_block> environment( ) const
+        {
+            const std::shared_ptr<const environment_block>& base =
+                m_environment ? m_environment : environment_block::inherited( );
+            if ( m_environ.empty( ) )
+                return base;
+            return std::make_shared<const environment_block>( *base, m_environ );
+        }
         virtual void log_path( path& stdout_log, path& stderr_log )
         {
             char buff[64];
@@ -550,9 +1433,16 @@ namespace dmk
         const path m_program;
         const path m_working_dir;
         std::map<std::string, std::string> m_environ;
+        std::shared_ptr<const environment_block> m_environment;
+        // Command line as text (started as is on Windows, shown to the user)
         std::string m_args;
+#if defined DMK_OS_POSIX
+        // Arguments as (split, text), the parts added by operator() are split when the program is started
+        std::vector<std::pair<bool, std::string>> m_argv;
+#endif
         int m_exit_code;
         bool m_log_output;
+        path m_stderr_log;
     };
 
     template <typename _Process = process>
@@ -563,6 +1453,14 @@ namespace dmk
         p( );
     }
 
+    template <typename _Process = process>
+    void exec( const path& curdir, const path& program, const argument_list& args )
+    {
+        _Process p( program, curdir );
+        p.args( args );
+        p( );
+    }
+
     template <typename _Process = process, typename... Args>
     void exec( const path& curdir, const path& program, const std::string& args, const Args&... params )
     {
@@ -618,7 +1516,7 @@ namespace dmk
             m_executable = argv[0];
 #endif
             m_args.reserve( argc );
-            for ( size_t i = 1; i < argc; i++ )
+            for ( int i = 1; i < argc; i++ )
             {
                 m_args.push_back( argv[i] );
             }
@@ -28,10 +28,33 @@
 #include <vector>
 #include <map>
 #include <exception>
+#include <atomic>
+#include <cstring>
+#include <functional>
+#include <cstdint>
+#include <cstdio>
+
+#if defined DMK_OS_WIN
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+#if defined DMK_ARCH_AVX2
+#include <immintrin.h>
+#elif defined DMK_ARCH_SSE2
+#include <emmintrin.h>
+#endif
+#if defined DMK_COMPILER_MSVC
+#include <intrin.h>
+#endif
 
 namespace dmk
 {
 
+    // Vector of key-value pairs that keeps insertion order
+    // Objects with index_threshold or more keys get a hash index (positions in an open addressing table)
+    // The index is built lazily by non-const lookups and extended for appended items,
+    // const lookups use it only when it is up to date (so concurrent readers never modify the map)
     template <typename _Type>
     struct ordered_map : public std::vector<std::pair<std::string, _Type>>
     {
@@ -40,27 +63,28 @@ namespace dmk
         typedef typename inherited::iterator iterator;
         typedef typename inherited::const_iterator const_iterator;
 
+        static const size_t index_threshold = 16;
+
+        ordered_map( ) : m_indexed( 0 )
+        {
+        }
+
         const_iterator find( const std::string& key ) const
         {
-            for ( const_iterator it = this->begin( ); it != this->end( ); ++it )
+            if ( m_indexed == this->size( ) && !m_index.empty( ) )
             {
-                if ( it->first == key )
-                {
-                    return it;
-                }
+                return this->begin( ) + indexed_find( key );
             }
-            return this->end( );
+            return this->begin( ) + linear_find( key );
         }
         iterator find( const std::string& key )
         {
-            for ( iterator it = this->begin( ); it != this->end( ); ++it )
+            if ( this->size( ) < index_threshold )
             {
-                if ( it->first == key )
-                {
-                    return it;
-                }
+                return this->begin( ) + linear_find( key );
             }
-            return this->end( );
+            update_index( );
+            return this->begin( ) + indexed_find( key );
         }
         void insert_or_assign( const std::string& key, const _Type& value )
         {
@@ -112,6 +136,99 @@ namespace dmk
                 return empty;
             }
         }
+
+        // Operations that move items invalidate the index
+        template <typename... _Args>
+        iterator erase( _Args&&... args )
+        {
+            reset_index( );
+            return inherited::erase( std::forward<_Args>( args )... );
+        }
+        template <typename... _Args>
+        iterator insert( _Args&&... args )
+        {
+            reset_index( );
+            return inherited::insert( std::forward<_Args>( args )... );
+        }
+        void pop_back( )
+        {
+            reset_index( );
+            inherited::pop_back( );
+        }
+        void clear( )
+        {
+            reset_index( );
+            inherited::clear( );
+        }
+
+    private:
+        const std::string& key_at( size_t pos ) const
+        {
+            return inherited::operator[]( pos ).first;
+        }
+        size_t linear_find( const std::string& key ) const
+        {
+            for ( size_t i = 0; i < this->size( ); i++ )
+            {
+                if ( key_at( i ) == key )
+                {
+                    return i;
+                }
+            }
+            return this->size( );
+        }
+        size_t indexed_find( const std::string& key ) const
+        {
+            const size_t mask = m_index.size( ) - 1;
+            for ( size_t slot = std::hash<std::string>( )( key ) & mask; m_index[slot];
+                  slot = ( slot + 1 ) & mask )
+            {
+                const size_t pos = m_index[slot] - 1;
+                if ( key_at( pos ) == key )
+                {
+                    return pos;
+                }
+            }
+            return this->size( );
+        }
+        void update_index( )
+        {
+            if ( m_indexed > this->size( ) || this->size( ) * 2 > m_index.size( ) )
+            {
+                size_t capacity = 64;
+                while ( capacity < this->size( ) * 4 )
+                    capacity *= 2;
+                m_index.assign( capacity, 0 );
+                m_indexed = 0;
+            }
+            const size_t mask = m_index.size( ) - 1;
+            for ( ; m_indexed < this->size( ); m_indexed++ )
+            {
+                const std::string& key = key_at( m_indexed );
+                size_t slot            = std::hash<std::string>( )( key ) & mask;
+                bool duplicate         = false;
+                for ( ; m_index[slot]; slot = ( slot + 1 ) & mask )
+                {
+                    if ( key_at( m_index[slot] - 1 ) == key ) // first item with the key wins
+                    {
+                        duplicate = true;
+                        break;
+                    }
+                }
+                if ( !duplicate )
+                {
+                    m_index[slot] = static_cast<uint32_t>( m_indexed + 1 );
+                }
+            }
+        }
+        void reset_index( )
+        {
+            m_index.clear( );
+            m_indexed = 0;
+        }
+
+        std::vector<uint32_t> m_index; // position + 1, 0 for empty slots
+        size_t m_indexed;
     };
 
     class json_error : public error
@@ -166,31 +283,46 @@ namespace dmk
     template <typename _JsonFormat = json_format<>>
     struct json_parser;
 
+    struct json_binary;
+
     struct json;
 
     template <typename _TargetType>
     inline _TargetType json_cast( const json& value );
 
-    struct json // sizeof(json) = 12
+    struct json
     {
     public:
         template <bool _pretty_print, typename _JsonFormat>
         friend struct json_printer;
         template <typename _JsonFormat>
         friend struct json_parser;
+        friend struct json_binary;
 
         template <typename _JsonFormat = json_format<>>
         static json parse( const std::string& data )
+        {
+            return parse<_JsonFormat>( data.data( ), data.size( ) );
+        }
+
+        template <typename _JsonFormat = json_format<>>
+        static json parse( const char* data, size_t size )
         {
             json_parser<_JsonFormat> parser;
-            return parser.parse_json( data.c_str( ) );
+            return parser.parse_json( data, size );
         }
 
         template <typename _JsonFormat = json_format<>>
         static json parse_object( const std::string& data )
+        {
+            return parse_object<_JsonFormat>( data.data( ), data.size( ) );
+        }
+
+        template <typename _JsonFormat = json_format<>>
+        static json parse_object( const char* data, size_t size )
         {
             json_parser<_JsonFormat> parser;
-            return parser.parse_naked_object( data.c_str( ) );
+            return parser.parse_naked_object( data, size );
         }
 
         template <bool _pretty_print = true, typename _JsonFormat = json_format<>>
@@ -200,13 +332,40 @@ namespace dmk
             return printer.print_json( *this );
         }
 
+        // Same text as stringify( ), written to the file without building the string
+        template <bool _pretty_print = true, typename _JsonFormat = json_format<>>
+        void print_to( FILE* file ) const
+        {
+            json_printer<_pretty_print, _JsonFormat> printer;
+            printer.print_json( *this, file );
+        }
+
+        template <bool _pretty_print = true, typename _JsonFormat = json_format<>>
+        void print_to( int fd ) const
+        {
+            json_printer<_pretty_print, _JsonFormat> printer;
+            printer.print_json( *this, fd );
+        }
+
+        template <bool _pretty_print = true, typename _JsonFormat = json_format<>>
+        void print_object_to( FILE* file ) const
+        {
+            if ( is_object( ) )
+            {
+                json_printer<_pretty_print, _JsonFormat> printer;
+                printer.print_naked_object( m_obj->value, file );
+            }
+            else
+                throw json_error( "Specified value is not object" );
+        }
+
         template <bool _pretty_print = true, typename _JsonFormat = json_format<>>
         std::string stringify_object( ) const
         {
             if ( is_object( ) )
             {
                 json_printer<_pretty_print, _JsonFormat> printer;
-                printer.print_naked_object( *m_obj );
+                printer.print_naked_object( m_obj->value );
                 return printer.wr.str( );
             }
             else
@@ -252,7 +411,7 @@ namespace dmk
         {
             assign( value );
         }
-        json( json&& value )
+        json( json&& value ) noexcept
         {
             assign_null( );
             swap( value );
@@ -387,127 +546,126 @@ namespace dmk
         }
         json& operator=( json value )
         {
-            return assign( value ), *this;
+            return replace( std::move( value ) );
         }
         json& operator=( std::nullptr_t )
         {
-            return assign_null( ), *this;
+            return replace( json( ) );
         }
         json& operator=( bool value )
         {
-            return assign( value ), *this;
+            return replace( json( value ) );
         }
         json& operator=( int8_t value )
         {
-            return assign( static_cast<int64_t>( value ) ), *this;
+            return replace( json( static_cast<int64_t>( value ) ) );
         }
         json& operator=( uint8_t value )
         {
-            return assign( static_cast<int64_t>( value ) ), *this;
+            return replace( json( static_cast<int64_t>( value ) ) );
         }
         json& operator=( int16_t value )
         {
-            return assign( static_cast<int64_t>( value ) ), *this;
+            return replace( json( static_cast<int64_t>( value ) ) );
         }
         json& operator=( uint16_t value )
         {
-            return assign( static_cast<int64_t>( value ) ), *this;
+            return replace( json( static_cast<int64_t>( value ) ) );
         }
         json& operator=( int32_t value )
         {
-            return assign( static_cast<int64_t>( value ) ), *this;
+            return replace( json( static_cast<int64_t>( value ) ) );
         }
         json& operator=( uint32_t value )
         {
-            return assign( static_cast<int64_t>( value ) ), *this;
+            return replace( json( static_cast<int64_t>( value ) ) );
         }
         json& operator=( int64_t value )
         {
-            return assign( static_cast<int64_t>( value ) ), *this;
+            return replace( json( static_cast<int64_t>( value ) ) );
         }
         json& operator=( uint64_t value )
         {
-            return assign( static_cast<int64_t>( value ) ), *this;
+            return replace( json( static_cast<int64_t>( value ) ) );
         }
         json& operator=( double value )
         {
-            return assign( static_cast<double>( value ) ), *this;
+            return replace( json( static_cast<double>( value ) ) );
         }
         json& operator=( float value )
         {
-            return assign( static_cast<float>( value ) ), *this;
+            return replace( json( static_cast<float>( value ) ) );
         }
         json& operator=( std::string&& value )
         {
-            return assign( std::move( value ) ), *this;
+            return replace( json( std::move( value ) ) );
         }
         json& operator=( const std::string& value )
         {
-            return assign( value ), *this;
+            return replace( json( value ) );
         }
 
         json& operator=( const std::wstring& value )
         {
-            return assign( make_string( value ) ), *this;
+            return replace( json( make_string( value ) ) );
         }
         json& operator=( const wchar_t* value )
         {
-            return assign( make_string( value ) ), *this;
+            return replace( json( make_string( value ) ) );
         }
         template <size_t N>
         json& operator=( const wchar_t( &value )[N] )
         {
-            return assign( make_string( value ) ), *this;
+            return replace( json( make_string( value ) ) );
         }
 
         json& operator=( const std::u16string& value )
         {
-            return assign( make_string( value ) ), *this;
+            return replace( json( make_string( value ) ) );
         }
         json& operator=( const char16_t* value )
         {
-            return assign( make_string( value ) ), *this;
+            return replace( json( make_string( value ) ) );
         }
         template <size_t N>
         json& operator=( const char16_t( &value )[N] )
         {
-            return assign( make_string( value ) ), *this;
+            return replace( json( make_string( value ) ) );
         }
 
         json& operator=( const std::u32string& value )
         {
-            return assign( make_string( value ) ), *this;
+            return replace( json( make_string( value ) ) );
         }
         json& operator=( const char32_t* value )
         {
-            return assign( make_string( value ) ), *this;
+            return replace( json( make_string( value ) ) );
         }
         template <size_t N>
         json& operator=( const char32_t( &value )[N] )
         {
-            return assign( make_string( value ) ), *this;
+            return replace( json( make_string( value ) ) );
         }
 
         json& operator=( const array& value )
         {
-            return assign( value ), *this;
+            return replace( json( value ) );
         }
         json& operator=( array&& value )
         {
-            return assign( std::move( value ) ), *this;
+            return replace( json( std::move( value ) ) );
         }
         json& operator=( const object& value )
         {
-            return assign( value ), *this;
+            return replace( json( value ) );
         }
         json& operator=( object&& value )
         {
-            return assign( std::move( value ) ), *this;
+            return replace( json( std::move( value ) ) );
         }
         json& operator=( const std::vector<std::string>& value )
         {
-            assign( value );
-            return *this;
+            return replace( json( value ) );
         }
 
         template <typename _TargetType>
@@ -516,10 +674,11 @@ namespace dmk
             return json_cast<_TargetType>( *this );
         }
 
-        void swap( json& value )
+        void swap( json& value ) noexcept
         {
             std::swap( m_type, value.m_type );
             std::swap( m_i64, value.m_i64 );
+            std::swap( m_length, value.m_length );
         }
 
         bool is_null( ) const
@@ -582,25 +741,25 @@ namespace dmk
         }
         std::string as_string( const std::string& default_value = "" ) const
         {
-            return is_string( ) ? *m_str : default_value;
+            return is_string( ) ? get_string( ) : default_value;
         }
         const array& as_array( ) const
         {
             static const array empty;
-            return is_array( ) ? *m_arr : empty;
+            return is_array( ) ? m_arr->value : empty;
         }
         const object& as_object( ) const
         {
             static const object empty = object();
-            return is_object( ) ? *m_obj : empty;
+            return is_object( ) ? m_obj->value : empty;
         }
         bool has_index( size_t index ) const
         {
-            return is_array( ) && index < m_arr->size( );
+            return is_array( ) && index < m_arr->value.size( );
         }
         bool has_key( const std::string& key ) const
         {
-            return is_object( ) && m_obj->find( key ) != m_obj->end( );
+            return is_object( ) && m_obj->value.find( key ) != m_obj->value.end( );
         }
         std::vector<json> flatten( ) const
         {
@@ -608,13 +767,13 @@ namespace dmk
             switch ( m_type )
             {
             case json::Object:
-                for ( const objectpair& o : *m_obj )
+                for ( const objectpair& o : m_obj->value )
                 {
                     result.push_back( o.second );
                 }
                 break;
             case json::Array:
-                for ( const json& a : *m_arr )
+                for ( const json& a : m_arr->value )
                 {
                     result.push_back( a );
                 }
@@ -633,7 +792,7 @@ namespace dmk
             switch ( m_type )
             {
             case json::Array:
-                for ( const json& a : *m_arr )
+                for ( const json& a : m_arr->value )
                 {
                     result.push_back( a );
                 }
@@ -652,7 +811,7 @@ namespace dmk
             switch ( m_type )
             {
             case json::Object:
-                for ( const objectpair& o : *m_obj )
+                for ( const objectpair& o : m_obj->value )
                 {
                     result.push_back( o.second );
                 }
@@ -671,13 +830,13 @@ namespace dmk
             switch ( m_type )
             {
             case json::Array:
-                for ( json& a : *m_arr )
+                for ( json& a : mutable_array( ) )
                 {
                     visitor( "", a );
                 }
                 break;
             case json::Object:
-                for ( objectpair& o : *m_obj )
+                for ( objectpair& o : mutable_object( ) )
                 {
                     visitor( o.first, o.second );
                 }
@@ -689,9 +848,9 @@ namespace dmk
             switch ( m_type )
             {
             case json::Array:
-                return m_arr->size( );
+                return m_arr->value.size( );
             case json::Object:
-                return m_obj->size( );
+                return m_obj->value.size( );
             }
             return 0;
         }
@@ -708,11 +867,11 @@ namespace dmk
             case json::Double:
                 return std::to_string( m_f64 );
             case json::String:
-                return *m_str;
+                return get_string( );
             case json::Array:
-                return array_str( *m_arr );
+                return array_str( m_arr->value );
             case json::Object:
-                return object_str( *m_obj );
+                return object_str( m_obj->value );
             }
             return "null";
         }
@@ -729,11 +888,11 @@ namespace dmk
             case json::Double:
                 return m_f64 != 0.0;
             case json::String:
-                return !m_str->empty( );
+                return string_size( ) != 0;
             case json::Array:
-                return !m_arr->empty( );
+                return !m_arr->value.empty( );
             case json::Object:
-                return !m_obj->empty( );
+                return !m_obj->value.empty( );
             }
             return false;
         }
@@ -798,7 +957,7 @@ namespace dmk
             switch ( m_type )
             {
             case json::Array:
-                return m_arr->operator[]( index );
+                return m_arr->value[index];
             }
             return readonly_array_item;
         }
@@ -807,14 +966,14 @@ namespace dmk
             switch ( m_type )
             {
             case json::Array:
-                if ( index >= m_arr->size( ) )
+                if ( index >= m_arr->value.size( ) )
                 {
-                    m_arr->resize( index + 1 );
-                    return m_arr->operator[]( index );
+                    mutable_array( ).resize( index + 1 );
+                    return mutable_array( )[index];
                 }
                 else
                 {
-                    return m_arr->operator[]( index );
+                    return mutable_array( )[index];
                 }
             }
             return readonly_array_item;
@@ -824,7 +983,14 @@ namespace dmk
             switch ( m_type )
             {
             case json::Object:
-                return m_obj->operator[]( key );
+            {
+                // the storage can be shared with other values, a missing key must not be added to it
+                const object& obj = m_obj->value;
+                auto it           = obj.find( key );
+                if ( it != obj.end( ) )
+                    return it->second;
+                break;
+            }
             }
             return readonly_object_item;
         }
@@ -833,7 +999,7 @@ namespace dmk
             switch ( m_type )
             {
             case json::Object:
-                return m_obj->operator[]( key );
+                return mutable_object( )[key];
             }
             return readonly_object_item;
         }
@@ -842,7 +1008,7 @@ namespace dmk
             switch ( m_type )
             {
             case json::Array:
-                return m_arr->push_back( value );
+                return mutable_array( ).push_back( value );
             }
         }
         void push_back( json&& value )
@@ -850,7 +1016,7 @@ namespace dmk
             switch ( m_type )
             {
             case json::Array:
-                return m_arr->push_back( std::move( value ) );
+                return mutable_array( ).push_back( std::move( value ) );
             }
         }
         array& get_array( )
@@ -858,7 +1024,7 @@ namespace dmk
             switch ( m_type )
             {
             case json::Array:
-                return *m_arr;
+                return mutable_array( );
             }
             throw std::out_of_range( "json::operator[](size_t): type is not array" );
         }
@@ -867,7 +1033,7 @@ namespace dmk
             switch ( m_type )
             {
             case json::Object:
-                return *m_obj;
+                return mutable_object( );
             }
             throw std::out_of_range( "json::operator[](size_t): type is not object" );
         }
@@ -876,7 +1042,7 @@ namespace dmk
             switch ( m_type )
             {
             case json::Array:
-                return *m_arr;
+                return m_arr->value;
             }
             throw std::out_of_range( "json::operator[](size_t): type is not array" );
         }
@@ -885,7 +1051,7 @@ namespace dmk
             switch ( m_type )
             {
             case json::Object:
-                return *m_obj;
+                return m_obj->value;
             }
             throw std::out_of_range( "json::operator[](size_t): type is not object" );
         }
@@ -915,11 +1081,12 @@ namespace dmk
             case json::Double:
                 return m_f64 == rhs.m_f64;
             case json::String:
-                return *m_str == *rhs.m_str;
+                return string_size( ) == rhs.string_size( ) &&
+                       std::memcmp( string_data( ), rhs.string_data( ), string_size( ) ) == 0;
             case json::Array:
-                return *m_arr == *rhs.m_arr;
+                return m_arr == rhs.m_arr || m_arr->value == rhs.m_arr->value;
             case json::Object:
-                return *m_obj == *rhs.m_obj;
+                return m_obj == rhs.m_obj || m_obj->value == rhs.m_obj->value;
             }
             return false;
         }
@@ -930,6 +1097,84 @@ namespace dmk
         }
 
     private:
+        // Heap value shared by copies of json
+        // Copies share the value until one of them is modified (copy on write)
+        // There is no per-document arena: array, object and std::string are public types that
+        // callers build, move out and modify, so they must allocate through the standard allocator
+        template <typename _Value>
+        struct shared_value
+        {
+            template <typename... _Args>
+            explicit shared_value( _Args&&... args )
+                : refs( 1 ), shareable( true ), value( std::forward<_Args>( args )... )
+            {
+            }
+            std::atomic<uint32_t> refs;
+            // Reset when a mutable reference to the value is returned,
+            // so later copies don't see changes made through that reference
+            bool shareable;
+            _Value value;
+        };
+
+        // Strings up to this size are stored in the value itself
+        static const uint32_t inline_capacity = sizeof( int64_t );
+        static const uint32_t heap_string     = UINT32_MAX;
+
+        template <typename _Value>
+        static shared_value<_Value>* share( shared_value<_Value>* value )
+        {
+            if ( !value->shareable )
+                return new shared_value<_Value>( value->value );
+            value->refs++;
+            return value;
+        }
+        template <typename _Value>
+        static void release( shared_value<_Value>* value )
+        {
+            if ( --value->refs == 0 )
+                delete value;
+        }
+        template <typename _Value>
+        static _Value& detach( shared_value<_Value>*& value )
+        {
+            if ( value->refs != 1 )
+            {
+                shared_value<_Value>* copy = new shared_value<_Value>( value->value );
+                release( value );
+                value = copy;
+            }
+            value->shareable = false;
+            return value->value;
+        }
+        array& mutable_array( )
+        {
+            return detach( m_arr );
+        }
+        object& mutable_object( )
+        {
+            return detach( m_obj );
+        }
+
+        const char* string_data( ) const
+        {
+            return m_length == heap_string ? m_str->value.data( ) : m_chars;
+        }
+        size_t string_size( ) const
+        {
+            return m_length == heap_string ? m_str->value.size( ) : m_length;
+        }
+        std::string get_string( ) const
+        {
+            return m_length == heap_string ? m_str->value : std::string( m_chars, m_length );
+        }
+
+        json& replace( json&& value )
+        {
+            check_readonly( );
+            swap( value );
+            return *this;
+        }
+
         inline void finalize( )
         {
             if ( m_type >= String )
@@ -947,43 +1192,48 @@ namespace dmk
             case json::Double:
                 break;
             case json::String:
-                delete m_str;
+                if ( m_length == heap_string )
+                    release( m_str );
                 break;
             case json::Array:
-                delete m_arr;
+                release( m_arr );
                 break;
             case json::Object:
-                delete m_obj;
+                release( m_obj );
                 break;
             }
         }
+        // assign is called by the constructors only, replace checks for the read-only items
         void assign( json&& value )
         {
-            check_readonly( );
-            m_type = Null;
-            m_i64 = 0;
+            m_type   = Null;
+            m_i64    = 0;
+            m_length = 0;
             swap( value );
         }
         void assign( const std::initializer_list<json>& list )
         {
-            check_readonly( );
-            m_type = Array;
-            m_arr  = new array( list );
+            m_type   = Array;
+            m_length = 0;
+            m_arr    = new shared_value<array>( list );
         }
         void assign( const json& value )
         {
-            check_readonly( );
-            m_type = value.m_type;
+            m_type   = value.m_type;
+            m_length = value.m_length;
             switch ( m_type )
             {
             case json::String:
-                m_str = new std::string( *value.m_str );
+                if ( m_length == heap_string )
+                    m_str = share( value.m_str );
+                else
+                    m_i64 = value.m_i64;
                 break;
             case json::Array:
-                m_arr = new array( *value.m_arr );
+                m_arr = share( value.m_arr );
                 break;
             case json::Object:
-                m_obj = new object( *value.m_obj );
+                m_obj = share( value.m_obj );
                 break;
             default:
                 m_i64 = value.m_i64;
@@ -991,79 +1241,90 @@ namespace dmk
         }
         void assign( size_t count, const json& value )
         {
-            check_readonly( );
-            m_type = Array;
-            m_arr  = new array( count, value );
+            m_type   = Array;
+            m_length = 0;
+            m_arr    = new shared_value<array>( count, value );
         }
         void assign_null( )
         {
-            // check_readonly();
-            m_type = Null;
-            m_i64  = 0;
+            m_type   = Null;
+            m_i64    = 0;
+            m_length = 0;
         }
         void assign( bool value )
         {
-            check_readonly( );
-            m_type = Bool;
-            m_i64  = value ? 1 : 0;
+            m_type   = Bool;
+            m_i64    = value ? 1 : 0;
+            m_length = 0;
         }
         void assign( int64_t value )
         {
-            check_readonly( );
-            m_type = Int;
-            m_i64  = value;
+            m_type   = Int;
+            m_i64    = value;
+            m_length = 0;
         }
         void assign( double value )
         {
-            check_readonly( );
-            m_type = Double;
-            m_f64  = value;
+            m_type   = Double;
+            m_f64    = value;
+            m_length = 0;
         }
         void assign( const std::string& value )
         {
-            check_readonly( );
             m_type = String;
-            m_str  = new std::string( value );
+            if ( value.size( ) <= inline_capacity )
+            {
+                m_i64    = 0;
+                m_length = static_cast<uint32_t>( value.size( ) );
+                std::memcpy( m_chars, value.data( ), value.size( ) );
+            }
+            else
+            {
+                m_length = heap_string;
+                m_str    = new shared_value<std::string>( value );
+            }
         }
         void assign( std::string&& value )
         {
-            check_readonly( );
-            m_type = String;
-            m_str  = new std::string( std::move( value ) );
+            if ( value.size( ) <= inline_capacity )
+                return assign( static_cast<const std::string&>( value ) );
+            m_type   = String;
+            m_length = heap_string;
+            m_str    = new shared_value<std::string>( std::move( value ) );
         }
         void assign( const array& value )
         {
-            check_readonly( );
-            m_type = Array;
-            m_arr  = new array( value );
+            m_type   = Array;
+            m_length = 0;
+            m_arr    = new shared_value<array>( value );
         }
         void assign( array&& value )
         {
-            check_readonly( );
-            m_type = Array;
-            m_arr  = new array( std::move( value ) );
+            m_type   = Array;
+            m_length = 0;
+            m_arr    = new shared_value<array>( std::move( value ) );
         }
         void assign( const object& value )
         {
-            check_readonly( );
-            m_type = Object;
-            m_obj  = new object( value );
+            m_type   = Object;
+            m_length = 0;
+            m_obj    = new shared_value<object>( value );
         }
         void assign( object&& value )
         {
-            check_readonly( );
-            m_type = Object;
-            m_obj  = new object( std::move( value ) );
+            m_type   = Object;
+            m_length = 0;
+            m_obj    = new shared_value<object>( std::move( value ) );
         }
         void assign( const std::vector<std::string>& value )
         {
-            check_readonly( );
-            m_type = Array;
-            m_arr = new array( );
-            m_arr->reserve( value.size( ) );
+            m_type   = Array;
+            m_length = 0;
+            m_arr    = new shared_value<array>( );
+            m_arr->value.reserve( value.size( ) );
             for ( const std::string& s : value )
             {
-                m_arr->push_back( s );
+                m_arr->value.push_back( s );
             }
         }
 
@@ -1073,13 +1334,18 @@ namespace dmk
             int64_t m_i64;
             double m_f64;
             void* m_ptr;
-            std::string* m_str;
-            array* m_arr;
-            object* m_obj;
+            shared_value<std::string>* m_str;
+            shared_value<array>* m_arr;
+            shared_value<object>* m_obj;
+            char m_chars[inline_capacity];
         };
         type m_type;
+        uint32_t m_length; // size of the inline string or heap_string
     };
 
+    // 8 bytes of value (or pointer) and two 32-bit fields, arrays of json stay compact
+    static_assert( sizeof( json ) == 16, "json: unexpected size" );
+
     template <>
     inline int json_cast<int>( const json& value )
     {
@@ -1208,6 +1474,86 @@ namespace dmk
 
     static const int json_max_depth = 200;
 
+    inline unsigned json_lowest_bit( uint32_t mask )
+    {
+#if defined DMK_COMPILER_MSVC
+        unsigned long index;
+        _BitScanForward( &index, mask );
+        return index;
+#else
+        return __builtin_ctz( mask );
+#endif
+    }
+
+    // First '"', '\\' or control character in [text, end), end if there are none
+    inline const char* json_scan_string( const char* text, const char* end )
+    {
+#if defined DMK_ARCH_AVX2
+        const __m256i quote32   = _mm256_set1_epi8( '"' );
+        const __m256i slash32   = _mm256_set1_epi8( '\\' );
+        const __m256i control32 = _mm256_set1_epi8( 0x1F );
+        for ( ; end - text >= 32; text += 32 )
+        {
+            const __m256i c = _mm256_loadu_si256( reinterpret_cast<const __m256i*>( text ) );
+            const __m256i m = _mm256_or_si256(
+                _mm256_or_si256( _mm256_cmpeq_epi8( c, quote32 ), _mm256_cmpeq_epi8( c, slash32 ) ),
+                _mm256_cmpeq_epi8( _mm256_min_epu8( c, control32 ), c ) );
+            const uint32_t mask = static_cast<uint32_t>( _mm256_movemask_epi8( m ) );
+            if ( mask )
+                return text + json_lowest_bit( mask );
+        }
+#endif
+#if defined DMK_ARCH_SSE2
+        const __m128i quote   = _mm_set1_epi8( '"' );
+        const __m128i slash   = _mm_set1_epi8( '\\' );
+        const __m128i control = _mm_set1_epi8( 0x1F );
+        for ( ; end - text >= 16; text += 16 )
+        {
+            const __m128i c = _mm_loadu_si128( reinterpret_cast<const __m128i*>( text ) );
+            const __m128i m =
+                _mm_or_si128( _mm_or_si128( _mm_cmpeq_epi8( c, quote ), _mm_cmpeq_epi8( c, slash ) ),
+                              _mm_cmpeq_epi8( _mm_min_epu8( c, control ), c ) );
+            const uint32_t mask = static_cast<uint32_t>( _mm_movemask_epi8( m ) );
+            if ( mask )
+                return text + json_lowest_bit( mask );
+        }
+#endif
+        for ( ; text < end; text++ )
+        {
+            if ( *text == '"' || *text == '\\' || ( byte_t )*text < ' ' )
+                return text;
+        }
+        return end;
+    }
+
+    // First character in [text, end) that isn't space, tab, CR or LF, end if there are none
+    inline const char* json_scan_spaces( const char* text, const char* end )
+    {
+#if defined DMK_ARCH_SSE2
+        const __m128i space = _mm_set1_epi8( ' ' );
+        const __m128i tab   = _mm_set1_epi8( '\t' );
+        const __m128i cr    = _mm_set1_epi8( '\r' );
+        const __m128i lf    = _mm_set1_epi8( '\n' );
+        // Most runs are a line break and an indent, so check the first character before loading
+        while ( end - text >= 16 && ( *text == ' ' || *text == '\t' || *text == '\r' || *text == '\n' ) )
+        {
+            const __m128i c = _mm_loadu_si128( reinterpret_cast<const __m128i*>( text ) );
+            const __m128i m =
+                _mm_or_si128( _mm_or_si128( _mm_cmpeq_epi8( c, space ), _mm_cmpeq_epi8( c, tab ) ),
+                              _mm_or_si128( _mm_cmpeq_epi8( c, cr ), _mm_cmpeq_epi8( c, lf ) ) );
+            const uint32_t mask = ~static_cast<uint32_t>( _mm_movemask_epi8( m ) ) & 0xFFFF;
+            if ( mask )
+                return text + json_lowest_bit( mask );
+            text += 16;
+        }
+#endif
+        while ( text < end && ( *text == ' ' || *text == '\t' || *text == '\r' || *text == '\n' ) )
+        {
+            text++;
+        }
+        return text;
+    }
+
     template <typename _JsonFormat>
     struct json_parser
     {
@@ -1218,31 +1564,36 @@ namespace dmk
         static const char object_bracket = _JsonFormat::object_bracket;
         static const bool optional_quote = _JsonFormat::optional_quote;
 
+        // Parsed text is [begin, end), reading at end gives '\0'
+        char peek( const char* text, size_t offset = 0 ) const
+        {
+            return text + offset < m_end ? text[offset] : '\0';
+        }
+
         bool skip_comment( const char*& text )
         {
-            if ( *text == '/' )
+            if ( peek( text ) == '/' )
             {
-                if ( text[1] == '/' ) // single-line
+                if ( peek( text, 1 ) == '/' ) // single-line
                 {
-
                     text += 2;
-                    while ( *text && *text != '\n' )
-                    {
-                        text++;
-                    }
-                    if ( *text == '\n' )
+                    const char* eol = static_cast<const char*>( std::memchr( text, '\n', m_end - text ) );
+                    text            = eol ? eol : m_end;
+                    if ( peek( text ) == '\n' )
                     {
                         return true;
                     }
                 }
-                else if ( text[1] == '*' ) // multi-line
+                else if ( peek( text, 1 ) == '*' ) // multi-line
                 {
                     text += 2;
-                    while ( *text && ( *text != '*' || text[1] != '/' ) )
+                    while ( text < m_end && ( *text != '*' || peek( text, 1 ) != '/' ) )
                     {
-                        text++;
+                        const char* star =
+                            static_cast<const char*>( std::memchr( text + 1, '*', m_end - text - 1 ) );
+                        text = star ? star : m_end;
                     }
-                    if ( *text == '*' && text[1] == '/' )
+                    if ( peek( text ) == '*' && peek( text, 1 ) == '/' )
                     {
                         text++;
                         return true;
@@ -1254,17 +1605,17 @@ namespace dmk
 
         bool skip_whitespace( const char*& text )
         {
-            if ( *text == ' ' || *text == '\r' || *text == '\n' || *text == '\t' || skip_comment( text ) )
+            const char* start = text;
+            for ( ;; )
             {
-                text++;
-                while ( *text == ' ' || *text == '\r' || *text == '\n' || *text == '\t' ||
-                        skip_comment( text ) )
+                text = json_scan_spaces( text, m_end );
+                if ( peek( text ) == '/' && skip_comment( text ) )
                 {
                     text++;
+                    continue;
                 }
-                return true;
+                return text != start;
             }
-            return false;
         }
 
         bool in_range( int32_t value, int32_t min, int32_t max )
@@ -1292,7 +1643,11 @@ namespace dmk
             bool real = false;
             for ( ;; )
             {
-                switch ( *text )
+                if ( buf == buffer + sizeof( buffer ) - 1 )
+                {
+                    throw json_error( "Number is too long" );
+                }
+                switch ( peek( text ) )
                 {
                 case '.':
                 case 'e':
@@ -1305,7 +1660,7 @@ namespace dmk
                     *buf++ = *text++;
                     continue;
                 default:
-                    if ( *text >= '0' && *text <= '9' )
+                    if ( peek( text ) >= '0' && peek( text ) <= '9' )
                     {
                         *buf++ = *text++;
                         continue;
@@ -1327,7 +1682,7 @@ namespace dmk
             else
             {
                 char* end;
-                value = std::strtoll( buffer, &end, 10 );
+                value = static_cast<int64_t>( std::strtoll( buffer, &end, 10 ) );
                 if ( end != buf )
                 {
                     throw json_error( "Invalid number value: {}", buffer );
@@ -1336,64 +1691,71 @@ namespace dmk
             return value;
         }
 
+        // Runs without escapes are found by json_scan_string and copied in bulk
+        // The result is always a copy, not a view of the input: json values own their strings,
+        // so the input may be freed after parsing
         std::string parse_string( const char*& text )
         {
-            fmt::MemoryWriter wr;
             if ( optional_quote )
             {
-                if ( *text != '"' )
+                if ( peek( text ) != '"' )
                 {
-                    while ( ( byte_t )*text > ' ' && *text != array_bracket && *text != object_bracket &&
-                            *text != item_separator && *text != key_separator )
+                    const char* start = text;
+                    while ( text < m_end && ( byte_t )*text > ' ' && *text != array_bracket &&
+                            *text != object_bracket && *text != item_separator && *text != key_separator )
                     {
-                        wr << *text++;
+                        text++;
                     }
-                    return wr.str( );
+                    return std::string( start, text );
                 }
             }
-            if ( *text != '"' )
+            if ( peek( text ) != '"' )
             {
-                throw json_error( "Expected {}, got {}", esc( '"' ), esc( *text ) );
+                throw json_error( "Expected {}, got {}", esc( '"' ), esc( peek( text ) ) );
             }
             text++;
 
+            std::string result;
             for ( ;; )
             {
-                switch ( *text )
+                const char* run = json_scan_string( text, m_end );
+                result.append( text, run );
+                text = run;
+                switch ( peek( text ) )
                 {
                 case '\0':
                     throw json_error( "Unexpected end of string" );
                 case '"':
                     text++;
-                    return wr.str( );
+                    return result;
                 case '\\':
                     text++;
-                    switch ( *text )
+                    switch ( peek( text ) )
                     {
                     case '\0':
                         throw json_error( "Unexpected end of string" );
                     case 'n':
-                        wr << '\n';
+                        result += '\n';
                         break;
                     case 'r':
-                        wr << '\r';
+                        result += '\r';
                         break;
                     case 't':
-                        wr << '\t';
+                        result += '\t';
                         break;
                     case 'b':
-                        wr << '\b';
+                        result += '\b';
                         break;
                     case 'f':
-                        wr << '\f';
+                        result += '\f';
                         break;
                     case '0':
-                        wr << '\0';
+                        result += '\0';
                         break;
                     case '/':
                     case '\\':
                     case '"':
-                        wr << *text;
+                        result += *text;
                         break;
                     case 'u':
                         text++;
@@ -1401,18 +1763,19 @@ namespace dmk
                             uint32_t codepoint = 0;
                             for ( size_t j = 0; j < 4; j++ )
                             {
+                                const char c = peek( text, j );
                                 codepoint <<= 4;
-                                if ( text[j] >= '0' && text[j] <= '9' )
+                                if ( c >= '0' && c <= '9' )
                                 {
-                                    codepoint += text[j] - '0';
+                                    codepoint += c - '0';
                                 }
-                                else if ( text[j] >= 'a' && text[j] <= 'f' )
+                                else if ( c >= 'a' && c <= 'f' )
                                 {
-                                    codepoint += text[j] - 'a' + 10;
+                                    codepoint += c - 'a' + 10;
                                 }
-                                else if ( text[j] >= 'A' && text[j] <= 'F' )
+                                else if ( c >= 'A' && c <= 'F' )
                                 {
-                                    codepoint += text[j] - 'A' + 10;
+                                    codepoint += c - 'A' + 10;
                                 }
                                 else
                                 {
@@ -1423,25 +1786,18 @@ namespace dmk
                             utf_coder<char> encoder;
                             size_t len = encoder.encode_length( codepoint );
                             encoder.encode( len, codepoint, utf8char );
-                            utf8char[len] = '\0';
-                            wr << utf8char;
+                            result.append( utf8char, len );
+                            text += 3; // the last digit is skipped below
                         }
                         break;
                     default:
                         throw json_error( "Invalid escape character {}", esc( *text ) );
                     }
+                    text++;
                     break;
                 default:
-                    if ( ( byte_t )*text < ' ' )
-                    {
-                        throw json_error( "Unescaped \\x{:02x} in string", *text );
-                    }
-                    else
-                    {
-                        wr << *text;
-                    }
+                    throw json_error( "Unescaped \\x{:02x} in string", *text );
                 }
-                text++;
             }
         }
 
@@ -1449,7 +1805,7 @@ namespace dmk
         {
             text++;
             skip_whitespace( text );
-            if ( *text == closed_bracket<array_bracket>::value )
+            if ( peek( text ) == closed_bracket<array_bracket>::value )
             {
                 return text++, json::array( );
             }
@@ -1460,15 +1816,15 @@ namespace dmk
                 for ( ;; )
                 {
                     json item = parse( text );
-                    temp.push_back( item );
+                    temp.push_back( std::move( item ) );
                     if ( item_separator == ' ' )
                     {
                         bool ws = skip_whitespace( text );
-                        if ( *text == closed_bracket<array_bracket>::value )
+                        if ( peek( text ) == closed_bracket<array_bracket>::value )
                         {
-                            return text++, temp;
+                            return text++, json( std::move( temp ) );
                         }
-                        if ( *text == '\0' || !ws )
+                        if ( peek( text ) == '\0' || !ws )
                         {
                             throw json_error( "Unexpected end of array" );
                         }
@@ -1476,11 +1832,11 @@ namespace dmk
                     else
                     {
                         skip_whitespace( text );
-                        if ( *text == closed_bracket<array_bracket>::value )
+                        if ( peek( text ) == closed_bracket<array_bracket>::value )
                         {
-                            return text++, temp;
+                            return text++, json( std::move( temp ) );
                         }
-                        if ( *text != item_separator )
+                        if ( peek( text ) != item_separator )
                         {
                             throw json_error( "Unexpected end of array" );
                         }
@@ -1501,22 +1857,22 @@ namespace dmk
                 json item;
                 std::string key = parse_string( text );
                 skip_whitespace( text );
-                if ( *text != key_separator )
+                if ( peek( text ) != key_separator )
                 {
                     throw json_error( "Expected {}", esc( key_separator ) );
                 }
                 text++;
 
                 item = parse( text );
-                temp[std::move( key )] = item;
+                temp[std::move( key )] = std::move( item );
                 if ( item_separator == ' ' )
                 {
                     bool ws = skip_whitespace( text );
-                    if ( *text == stop )
+                    if ( peek( text ) == stop )
                     {
-                        return text++, temp;
+                        return text++, json( std::move( temp ) );
                     }
-                    if ( *text == '\0' || !ws )
+                    if ( peek( text ) == '\0' || !ws )
                     {
                         throw json_error( "Unexpected end of object" );
                     }
@@ -1524,11 +1880,11 @@ namespace dmk
                 else
                 {
                     skip_whitespace( text );
-                    if ( *text == stop )
+                    if ( peek( text ) == stop )
                     {
-                        return text++, temp;
+                        return text++, json( std::move( temp ) );
                     }
-                    if ( *text != item_separator )
+                    if ( peek( text ) != item_separator )
                     {
                         throw json_error( "Unexpected end of object" );
                     }
@@ -1538,8 +1894,9 @@ namespace dmk
             }
         }
 
-        json parse_naked_object( const char* text )
+        json parse_naked_object( const char* text, size_t size )
         {
+            m_end = text + size;
             return _parse_naked_object<0>( text );
         }
 
@@ -1547,7 +1904,7 @@ namespace dmk
         {
             text++;
             skip_whitespace( text );
-            if ( *text == closed_bracket<object_bracket>::value )
+            if ( peek( text ) == closed_bracket<object_bracket>::value )
                 return text++, json::object( );
             else
             {
@@ -1558,12 +1915,13 @@ namespace dmk
         json parse( const char*& text )
         {
             skip_whitespace( text );
-            switch ( *text )
+            const char c = peek( text );
+            switch ( c )
             {
             case '-':
                 return parse_number( text );
             case 't':
-                if ( text[1] == 'r' && text[2] == 'u' && text[3] == 'e' )
+                if ( peek( text, 1 ) == 'r' && peek( text, 2 ) == 'u' && peek( text, 3 ) == 'e' )
                 {
                     return text += 4, true;
                 }
@@ -1575,7 +1933,8 @@ namespace dmk
                     throw json_error( "Invalid constant, expected true" );
 
             case 'f':
-                if ( text[1] == 'a' && text[2] == 'l' && text[3] == 's' && text[4] == 'e' )
+                if ( peek( text, 1 ) == 'a' && peek( text, 2 ) == 'l' && peek( text, 3 ) == 's' &&
+                     peek( text, 4 ) == 'e' )
                 {
                     return text += 5, false;
                 }
@@ -1587,7 +1946,7 @@ namespace dmk
                     throw json_error( "Invalid constant, expected false" );
 
             case 'n':
-                if ( text[1] == 'u' && text[2] == 'l' && text[3] == 'l' )
+                if ( peek( text, 1 ) == 'u' && peek( text, 2 ) == 'l' && peek( text, 3 ) == 'l' )
                 {
                     return text += 4, nullptr;
                 }
@@ -1608,23 +1967,30 @@ namespace dmk
                 return parse_object( text );
 
             default:
-                if ( *text >= '0' && *text <= '9' )
+                if ( c >= '0' && c <= '9' )
                     return parse_number( text );
-                else if ( optional_quote && ( *text >= 'a' && *text <= 'z' || *text >= 'A' && *text <= 'Z' ) )
+                else if ( optional_quote && ( ( c >= 'a' && c <= 'z' ) || ( c >= 'A' && c <= 'Z' ) ) )
                 {
                     return parse_string( text );
                 }
                 else
                 {
-                    throw json_error( "Invalid character: {}", esc( *text ) );
+                    throw json_error( "Invalid character: {}", esc( c ) );
                 }
             }
         }
 
         json parse_json( const char* text )
+        {
+            return parse_json( text, std::strlen( text ) );
+        }
+
+        // text doesn't have to be null-terminated
+        json parse_json( const char* text, size_t size )
         {
             const char* text_begin = text;
-            const char* text_end   = text_begin + std::strlen( text );
+            const char* text_end   = text_begin + size;
+            m_end                  = text_end;
             try
             {
                 return parse( text );
@@ -1648,6 +2014,7 @@ namespace dmk
         }
 
     private:
+        const char* m_end = nullptr;
     };
 
     template <bool _pretty_print, typename _JsonFormat>
@@ -1670,16 +2037,37 @@ namespace dmk
                 depth -= 16;
             }
         }
+        // Nonzero for bytes that can't be copied as is: quote, backslash, control characters
+        // and 0xE2 (first byte of U+2028 and U+2029)
+        static const byte_t* escape_table( )
+        {
+            static const struct table
+            {
+                table( )
+                {
+                    for ( int c = 0; c < 256; c++ )
+                        values[c] = c < 0x20 || c == '"' || c == '\\' || c == 0xe2;
+                }
+                byte_t values[256];
+            } t;
+            return t.values;
+        }
+
         void print_string( const std::string& value )
+        {
+            print_string( value.data( ), value.size( ) );
+        }
+        void print_string( const char* value, size_t size )
         {
             if ( optional_quote )
             {
                 bool omit_quotes = true;
-                if ( value.size( ) && value[0] >= 'a' && value[0] <= 'z' ||
-                     value[0] >= 'A' && value[0] <= 'Z' )
+                const char first = size ? value[0] : 0;
+                if ( ( first >= 'a' && first <= 'z' ) || ( first >= 'A' && first <= 'Z' ) )
                 {
-                    for ( char c : value )
+                    for ( size_t i = 0; i < size; i++ )
                     {
+                        const char c = value[i];
                         if ( ( byte_t )c <= ' ' || c == key_separator || c == item_separator ||
                              c == array_bracket || c == object_bracket )
                         {
@@ -1692,65 +2080,75 @@ namespace dmk
                 {
                     omit_quotes = false;
                 }
-                if ( value == "true" || value == "false" || value == "null" )
+                if ( is_keyword( value, size ) )
                     omit_quotes = false;
                 if ( omit_quotes )
                 {
-                    wr << value;
+                    wr << fmt::StringRef( value, size );
                     return;
                 }
             }
+            const byte_t* escape = escape_table( );
+            const char* end      = value + size;
             wr << '"';
-            for ( size_t i = 0; i < value.size( ); i++ )
+            for ( ;; )
             {
-                const char ch = value[i];
-                if ( ch == '\\' )
+                const char* run = value;
+                while ( value != end && !escape[( byte_t )*value] )
                 {
-                    wr << "\\\\";
+                    value++;
                 }
-                else if ( ch == '"' )
+                if ( value != run )
                 {
-                    wr << "\\\"";
+                    wr << fmt::StringRef( run, value - run );
                 }
-                else if ( ch == '\b' )
+                if ( value == end )
                 {
-                    wr << "\\b";
+                    break;
                 }
-                else if ( ch == '\f' )
+                const char ch = *value++;
+                switch ( ch )
                 {
+                case '\\':
+                    wr << "\\\\";
+                    break;
+                case '"':
+                    wr << "\\\"";
+                    break;
+                case '\b':
+                    wr << "\\b";
+                    break;
+                case '\f':
                     wr << "\\f";
-                }
-                else if ( ch == '\n' )
-                {
+                    break;
+                case '\n':
                     wr << "\\n";
-                }
-                else if ( ch == '\r' )
-                {
+                    break;
+                case '\r':
                     wr << "\\r";
-                }
-                else if ( ch == '\t' )
-                {
+                    break;
+                case '\t':
                     wr << "\\t";
-                }
-                else if ( byte_t( ch ) <= 0x1f )
-                {
-                    wr.write( "\\u{:04x}", ch );
-                }
-                else if ( value.size( ) - i >= 3 && byte_t( ch ) == 0xe2 && byte_t( value[i + 1] ) == 0x80 &&
-                          byte_t( value[i + 2] ) == 0xa8 )
-                {
-                    wr << "\\u2028";
-                    i += 2;
-                }
-                else if ( value.size( ) - i >= 3 && byte_t( ch ) == 0xe2 && byte_t( value[i + 1] ) == 0x80 &&
-                          byte_t( value[i + 2] ) == 0xa9 )
-                {
-                    wr << "\\u2029";
-                    i += 2;
-                }
-                else
-                {
-                    wr << ch;
+                    break;
+                default:
+                    if ( byte_t( ch ) <= 0x1f )
+                    {
+                        wr.write( "\\u{:04x}", ch );
+                    }
+                    else if ( end - value >= 2 && byte_t( value[0] ) == 0x80 && byte_t( value[1] ) == 0xa8 )
+                    {
+                        wr << "\\u2028";
+                        value += 2;
+                    }
+                    else if ( end - value >= 2 && byte_t( value[0] ) == 0x80 && byte_t( value[1] ) == 0xa9 )
+                    {
+                        wr << "\\u2029";
+                        value += 2;
+                    }
+                    else
+                    {
+                        wr << ch;
+                    }
                 }
             }
             wr << '"';
@@ -1882,18 +2280,22 @@ namespace dmk
                 wr << value.m_f64;
                 break;
             case json::String:
-                print_string( *value.m_str );
+                print_string( value.string_data( ), value.string_size( ) );
                 break;
             case json::Array:
-                print_array( *value.m_arr, depth );
+                print_array( value.m_arr->value, depth );
                 break;
             case json::Object:
-                print_object( *value.m_obj, depth );
+                print_object( value.m_obj->value, depth );
                 break;
             default:
                 wr << "null";
                 break;
             }
+            if ( wr.size( ) >= flush_size && ( m_file || m_fd >= 0 ) )
+            {
+                flush( );
+            }
         }
 
         std::string print_json( const json& value )
@@ -1902,8 +2304,221 @@ namespace dmk
             return wr.str( );
         }
 
+        // Output is written in blocks, the whole text is never kept in memory
+        void print_json( const json& value, FILE* file )
+        {
+            m_file = file;
+            print( value );
+            flush( );
+        }
+        void print_json( const json& value, int fd )
+        {
+            m_fd = fd;
+            print( value );
+            flush( );
+        }
+        void print_naked_object( const json::object& values, FILE* file )
+        {
+            m_file = file;
+            print_naked_object( values );
+            flush( );
+        }
+
     public:
         fmt::MemoryWriter wr;
+
+    private:
+        static const size_t flush_size = 65536;
+
+        static bool is_keyword( const char* value, size_t size )
+        {
+            if ( size == 4 )
+                return std::memcmp( value, "true", 4 ) == 0 || std::memcmp( value, "null", 4 ) == 0;
+            return size == 5 && std::memcmp( value, "false", 5 ) == 0;
+        }
+
+        void flush( )
+        {
+            const char* data = wr.data( );
+            size_t size      = wr.size( );
+            if ( m_file )
+            {
+                if ( fwrite( data, 1, size, m_file ) != size )
+                    throw json_error( "Can't write json" );
+            }
+            else
+            {
+                while ( size )
+                {
+#if defined DMK_OS_WIN
+                    int written = _write( m_fd, data, static_cast<unsigned>( size ) );
+#else
+                    ssize_t written = ::write( m_fd, data, size );
+#endif
+                    if ( written <= 0 )
+                        throw json_error( "Can't write json" );
+                    data += written;
+                    size -= written;
+                }
+            }
+            wr.clear( );
+        }
+
+        FILE* m_file = nullptr;
+        int m_fd     = -1;
+    };
+
+    // Compact binary form of json values, used to cache parsed documents
+    // Values are stored depth-first: type byte, then bool byte, 8-byte int or double,
+    // or 32-bit size followed by string bytes, array items or object key/value pairs.
+    // The data contains no pointers, so it can be read directly from a mapped file.
+    // Native byte order is used: the data isn't meant to be moved between machines
+    struct json_binary
+    {
+    public:
+        static void write( const json& value, std::string& out )
+        {
+            out.push_back( static_cast<char>( value.m_type ) );
+            switch ( value.m_type )
+            {
+            case json::Bool:
+                out.push_back( value.m_i64 ? 1 : 0 );
+                break;
+            case json::Int:
+                write_raw( out, value.m_i64 );
+                break;
+            case json::Double:
+                write_raw( out, value.m_f64 );
+                break;
+            case json::String:
+                write_string( out, value.string_data( ), value.string_size( ) );
+                break;
+            case json::Array:
+                write_size( out, value.m_arr->value.size( ) );
+                for ( const json& item : value.m_arr->value )
+                {
+                    write( item, out );
+                }
+                break;
+            case json::Object:
+                write_size( out, value.m_obj->value.size( ) );
+                for ( const json::objectpair& item : value.m_obj->value )
+                {
+                    write_string( out, item.first.data( ), item.first.size( ) );
+                    write( item.second, out );
+                }
+                break;
+            }
+        }
+
+        static std::string write( const json& value )
+        {
+            std::string result;
+            write( value, result );
+            return result;
+        }
+
+        // Throws json_error if the data is truncated or malformed
+        static json read( const char* data, size_t size )
+        {
+            const char* end = data + size;
+            json result     = read( data, end, 0 );
+            if ( data != end )
+            {
+                throw json_error( "Unexpected data after binary json value" );
+            }
+            return result;
+        }
+
+    private:
+        static const int max_depth = 256;
+
+        template <typename _Type>
+        static void write_raw( std::string& out, _Type value )
+        {
+            out.append( reinterpret_cast<const char*>( &value ), sizeof( value ) );
+        }
+        static void write_size( std::string& out, size_t size )
+        {
+            if ( size > UINT32_MAX )
+                throw json_error( "Value is too large for binary json" );
+            write_raw( out, static_cast<uint32_t>( size ) );
+        }
+        static void write_string( std::string& out, const char* data, size_t size )
+        {
+            write_size( out, size );
+            out.append( data, size );
+        }
+
+        template <typename _Type>
+        static _Type read_raw( const char*& data, const char* end )
+        {
+            _Type value;
+            if ( static_cast<size_t>( end - data ) < sizeof( value ) )
+                throw json_error( "Unexpected end of binary json" );
+            std::memcpy( &value, data, sizeof( value ) );
+            data += sizeof( value );
+            return value;
+        }
+        static std::string read_string( const char*& data, const char* end )
+        {
+            uint32_t size = read_raw<uint32_t>( data, end );
+            if ( static_cast<size_t>( end - data ) < size )
+                throw json_error( "Unexpected end of binary json" );
+            data += size;
+            return std::string( data - size, size );
+        }
+        // Every item takes at least one byte, so a count larger than the rest of the data is invalid
+        static uint32_t read_count( const char*& data, const char* end )
+        {
+            uint32_t count = read_raw<uint32_t>( data, end );
+            if ( static_cast<size_t>( end - data ) < count )
+                throw json_error( "Unexpected end of binary json" );
+            return count;
+        }
+
+        static json read( const char*& data, const char* end, int depth )
+        {
+            if ( depth > max_depth )
+                throw json_error( "Binary json is nested too deep" );
+            switch ( read_raw<uint8_t>( data, end ) )
+            {
+            case json::Null:
+                return json( );
+            case json::Bool:
+                return json( read_raw<uint8_t>( data, end ) != 0 );
+            case json::Int:
+                return json( read_raw<int64_t>( data, end ) );
+            case json::Double:
+                return json( read_raw<double>( data, end ) );
+            case json::String:
+                return json( read_string( data, end ) );
+            case json::Array:
+            {
+                json::array temp;
+                uint32_t count = read_count( data, end );
+                temp.reserve( count );
+                for ( ; count; count-- )
+                {
+                    temp.push_back( read( data, end, depth + 1 ) );
+                }
+                return json( std::move( temp ) );
+            }
+            case json::Object:
+            {
+                json::object temp;
+                uint32_t count = read_count( data, end );
+                temp.reserve( count );
+                for ( ; count; count-- )
+                {
+                    std::string key = read_string( data, end );
+                    temp.emplace_back( std::move( key ), read( data, end, depth + 1 ) );
+                }
+                return json( std::move( temp ) );
+            }
+            }
+            throw json_error( "Invalid binary json type" );
+        }
     };
 
 } // namespace dmk
@@ -25,12 +25,20 @@
 #include "dmk_json.h"
 #if defined( DMK_OS_WIN )
 #include <windows.h>
+#include <io.h>
+#elif defined( DMK_OS_POSIX )
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
 #endif
 #include <iostream>
 #include <vector>
 #include <string>
 #include <system_error>
 #include <chrono>
+#include <ctime>
 #include <iostream>
 #include <ostream>
 #include <istream>
@@ -108,7 +116,11 @@ namespace dmk
         {
             mode_s[i++] = 'r';
         }
-        if ( !!( mode & open_mode::Write ) )
+        if ( !!( mode & open_mode::Append ) )
+        {
+            mode_s[i++] = 'a';
+        }
+        else if ( !!( mode & open_mode::Write ) )
         {
             mode_s[i++] = 'w';
         }
@@ -116,10 +128,6 @@ namespace dmk
         {
             mode_s[i++] = 'b';
         }
-        if ( !!( mode & open_mode::Append ) )
-        {
-            mode_s[i++] = 'a';
-        }
         return _wfopen( file.wstring( ).c_str( ), mode_s );
 #elif defined( DMK_OS_POSIX )
         char mode_s[8] = { 0 };
@@ -128,7 +136,11 @@ namespace dmk
         {
             mode_s[i++] = 'r';
         }
-        if ( !!( mode & open_mode::Write ) )
+        if ( !!( mode & open_mode::Append ) )
+        {
+            mode_s[i++] = 'a';
+        }
+        else if ( !!( mode & open_mode::Write ) )
         {
             mode_s[i++] = 'w';
         }
@@ -136,14 +148,22 @@ namespace dmk
         {
             mode_s[i++] = 'b';
         }
-        if ( !!( mode & open_mode::Append ) )
-        {
-            mode_s[i++] = 'a';
-        }
         return fopen( file.string( ).c_str( ), mode_s );
 #endif
     }
 
+    // Flush the file and wait until its data is written to the disk
+    inline bool sync_file( FILE* f )
+    {
+        if ( fflush( f ) != 0 )
+            return false;
+#if defined( DMK_OS_WIN )
+        return _commit( _fileno( f ) ) == 0;
+#else
+        return fsync( fileno( f ) ) == 0;
+#endif
+    }
+
     inline std::string q( const path& str )
     {
         return q( str.string( ) );
@@ -159,6 +179,16 @@ namespace dmk
         return is_regular_file( p ) || ( is_symlink( p ) && is_regular_file( read_symlink( p ) ) );
     }
 
+    // Last modification time of the file as an integer (units are platform dependent)
+    inline int64_t file_mtime( const path& p )
+    {
+#if defined( DMK_OS_WIN )
+        return static_cast<int64_t>( last_write_time( p ).time_since_epoch( ).count( ) );
+#else
+        return static_cast<int64_t>( last_write_time( p ) );
+#endif
+    }
+
     inline path find_in_path( const path& bin )
     {
         std::vector<std::string> dirs = split( std::getenv( "PATH" ), DMK_IF_WIN( ';', ':' ) );
@@ -175,7 +205,6 @@ namespace dmk
     template <typename _Type>
     inline void file_get_bytes( const path& filename, _Type& bytes, open_mode mode = open_mode::None )
     {
-        typedef typename _Type::pointer pointer;
         static_assert( sizeof( typename _Type::value_type ) == 1, "file_get_bytes: incorrect element size" );
         FILE* f = open_file( filename, open_mode::Read | mode );
         if ( !f )
@@ -183,23 +212,196 @@ namespace dmk
             throw file_error( system_error, "file_get_bytes: Can't open file for read {}", filename );
         }
 
-        static const size_t bufsize = 1024;
+        // Read the whole file with one call if its size is known
+        // (one extra byte to see the end of file, text mode may return less than the size)
+        size_t capacity = 4096;
+        if ( fseek( f, 0, SEEK_END ) == 0 )
+        {
+            long end = ftell( f );
+            if ( end >= 0 )
+            {
+                capacity = static_cast<size_t>( end ) + 1;
+            }
+            fseek( f, 0, SEEK_SET );
+        }
 
         bytes = _Type( );
-        byte_t buffer[bufsize];
+        bytes.resize( capacity );
+        size_t length = 0;
         for ( ;; )
         {
-            size_t rsize = fread( buffer, 1, bufsize, f );
-            if ( !rsize )
+            length += fread( &bytes[length], 1, bytes.size( ) - length, f );
+            if ( length < bytes.size( ) )
             {
                 break;
             }
-            bytes.insert( bytes.end( ), ( pointer )buffer, ( pointer )buffer + rsize );
+            bytes.resize( bytes.size( ) * 2 );
         }
+        bytes.resize( length );
 
+        bool failed = ferror( f ) != 0;
         fclose( f );
+        if ( failed )
+        {
+            throw file_error( system_error, "file_get_bytes: Can't read file {}", filename );
+        }
     }
 
+    // Whole content of the file
+    // Large files are mapped into memory, smaller ones are read with a single call
+    // As with any mapping, reading past the end of a mapped file truncated by another process
+    // raises SIGBUS; the part before the new end stays readable
+    class file_contents
+    {
+    public:
+        static const size_t map_threshold = 256 * 1024;
+
+        explicit file_contents( const path& filename ) : m_data( nullptr ), m_size( 0 ), m_mapped( false )
+        {
+#if defined( DMK_OS_WIN )
+            m_file = CreateFileW( filename.wstring( ).c_str( ),
+                                  GENERIC_READ,
+                                  FILE_SHARE_READ,
+                                  NULL,
+                                  OPEN_EXISTING,
+                                  FILE_ATTRIBUTE_NORMAL,
+                                  NULL );
+            m_mapping = NULL;
+            LARGE_INTEGER size;
+            if ( m_file == INVALID_HANDLE_VALUE || !GetFileSizeEx( m_file, &size ) )
+            {
+                close( );
+                throw file_error( system_error, "file_contents: Can't open file for read {}", filename );
+            }
+            m_size = static_cast<size_t>( size.QuadPart );
+            if ( m_size >= map_threshold )
+            {
+                m_mapping = CreateFileMappingW( m_file, NULL, PAGE_READONLY, 0, 0, NULL );
+                if ( m_mapping )
+                {
+                    m_data = static_cast<const char*>( MapViewOfFile( m_mapping, FILE_MAP_READ, 0, 0, 0 ) );
+                }
+                m_mapped = m_data != nullptr;
+            }
+            if ( !m_mapped )
+            {
+                m_buffer.resize( m_size );
+                DWORD read = 0;
+                for ( size_t pos = 0; pos < m_size; pos += read )
+                {
+                    DWORD chunk = static_cast<DWORD>( std::min<size_t>( m_size - pos, 1u << 30 ) );
+                    if ( !ReadFile( m_file, &m_buffer[pos], chunk, &read, NULL ) || !read )
+                    {
+                        close( );
+                        throw file_error( system_error, "file_contents: Can't read file {}", filename );
+                    }
+                }
+                m_data = m_buffer.data( );
+            }
+#elif defined( DMK_OS_POSIX )
+            m_fd = ::open( filename.string( ).c_str( ), O_RDONLY );
+            struct stat st;
+            if ( m_fd < 0 || fstat( m_fd, &st ) != 0 )
+            {
+                close( );
+                throw file_error( system_error, "file_contents: Can't open file for read {}", filename );
+            }
+            m_size = static_cast<size_t>( st.st_size );
+            if ( S_ISREG( st.st_mode ) && m_size >= map_threshold )
+            {
+                void* p  = mmap( nullptr, m_size, PROT_READ, MAP_PRIVATE, m_fd, 0 );
+                m_mapped = p != MAP_FAILED;
+                if ( m_mapped )
+                {
+                    m_data = static_cast<const char*>( p );
+                }
+            }
+            if ( !m_mapped )
+            {
+                // Read until the end of file: the size is 0 for pipes and /proc files
+                // and changes if the file is written meanwhile (one extra byte to see the end)
+                m_buffer.resize( m_size + 1 );
+                size_t pos = 0;
+                for ( ;; )
+                {
+                    ssize_t count = ::read( m_fd, &m_buffer[pos], m_buffer.size( ) - pos );
+                    if ( count < 0 && errno == EINTR )
+                        continue;
+                    if ( count < 0 )
+                    {
+                        close( );
+                        throw file_error( system_error, "file_contents: Can't read file {}", filename );
+                    }
+                    if ( count == 0 )
+                        break;
+                    pos += static_cast<size_t>( count );
+                    if ( pos == m_buffer.size( ) )
+                        m_buffer.resize( m_buffer.size( ) * 2 );
+                }
+                m_buffer.resize( pos );
+                m_size = pos;
+                m_data = m_buffer.data( );
+            }
+#endif
+        }
+        ~file_contents( )
+        {
+            close( );
+        }
+        file_contents( const file_contents& ) = delete;
+        file_contents& operator=( const file_contents& ) = delete;
+
+        const char* data( ) const
+        {
+            return m_data;
+        }
+        size_t size( ) const
+        {
+            return m_size;
+        }
+        bool mapped( ) const
+        {
+            return m_mapped;
+        }
+        std::string str( ) const
+        {
+            return std::string( m_data, m_size );
+        }
+
+    private:
+        void close( )
+        {
+#if defined( DMK_OS_WIN )
+            if ( m_mapped )
+                UnmapViewOfFile( m_data );
+            if ( m_mapping )
+                CloseHandle( m_mapping );
+            if ( m_file != INVALID_HANDLE_VALUE )
+                CloseHandle( m_file );
+            m_mapping = NULL;
+            m_file    = INVALID_HANDLE_VALUE;
+#elif defined( DMK_OS_POSIX )
+            if ( m_mapped )
+                munmap( const_cast<char*>( m_data ), m_size );
+            if ( m_fd >= 0 )
+                ::close( m_fd );
+            m_fd = -1;
+#endif
+            m_mapped = false;
+        }
+
+        const char* m_data;
+        size_t m_size;
+        bool m_mapped;
+        std::string m_buffer;
+#if defined( DMK_OS_WIN )
+        HANDLE m_file;
+        HANDLE m_mapping;
+#elif defined( DMK_OS_POSIX )
+        int m_fd;
+#endif
+    };
+
     template <typename _Type>
     inline void file_put_bytes( const path& filename, const _Type& bytes, open_mode mode = open_mode::None )
     {
@@ -232,13 +434,15 @@ namespace dmk
     template <typename _JsonFormat = json_format<>>
     inline json file_get_json( const path& filename )
     {
-        return json::parse<_JsonFormat>( file_get_string( filename ) );
+        file_contents text( filename );
+        return json::parse<_JsonFormat>( text.data( ), text.size( ) );
     }
 
     template <typename _JsonFormat = json_format<>>
     inline json file_get_json_object( const path& filename )
     {
-        return json::parse_object<_JsonFormat>( file_get_string( filename ) );
+        file_contents text( filename );
+        return json::parse_object<_JsonFormat>( text.data( ), text.size( ) );
     }
 
     inline void file_put_string( const path& filename, const std::string& string )
@@ -254,13 +458,41 @@ namespace dmk
     template <bool _pretty_print = true, typename _JsonFormat = json_format<>>
     inline void file_put_json( const path& filename, const json& json )
     {
-        file_put_string( filename, json.stringify<_pretty_print, _JsonFormat>( ) );
+        FILE* f = open_file( filename, open_mode::Write );
+        if ( !f )
+        {
+            throw file_error( system_error, "file_put_json: Can't open file for write {}", filename );
+        }
+        try
+        {
+            json.print_to<_pretty_print, _JsonFormat>( f );
+        }
+        catch ( ... )
+        {
+            fclose( f );
+            throw;
+        }
+        fclose( f );
     }
 
     template <bool _pretty_print = true, typename _JsonFormat = json_format<>>
     inline void file_put_json_object( const path& filename, const json& json )
     {
-        file_put_string( filename, json.stringify_object<_pretty_print, _JsonFormat>( ) );
+        FILE* f = open_file( filename, open_mode::Write );
+        if ( !f )
+        {
+            throw file_error( system_error, "file_put_json_object: Can't open file for write {}", filename );
+        }
+        try
+        {
+            json.print_object_to<_pretty_print, _JsonFormat>( f );
+        }
+        catch ( ... )
+        {
+            fclose( f );
+            throw;
+        }
+        fclose( f );
     }
 
     inline void file_append_string( const path& filename, const std::string& string )
@@ -336,6 +568,26 @@ namespace dmk
 #endif
     }
 
+    // Set modification time of the file to the current time
+    inline void touch_mtime( const path& p )
+    {
+#if defined( DMK_OS_WIN )
+        last_write_time( p, file_time_type::clock::now( ) );
+#else
+        last_write_time( p, std::time( nullptr ) );
+#endif
+    }
+
+    // Seconds since the last modification of the file
+    inline double file_age( const path& p )
+    {
+#if defined( DMK_OS_WIN )
+        return std::chrono::duration<double>( file_time_type::clock::now( ) - last_write_time( p ) ).count( );
+#else
+        return std::difftime( std::time( nullptr ), last_write_time( p ) );
+#endif
+    }
+
     typedef std::vector<path> path_list;
 
     inline path_list operator+( const path_list& left, const path_list& right )
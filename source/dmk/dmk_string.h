@@ -55,14 +55,14 @@ namespace dmk
     inline std::string asci_lowercase( std::string&& str )
     {
         std::string temp = std::move( str );
-        std::transform( str.begin( ), str.end( ), temp.begin( ), ::tolower );
+        std::transform( temp.begin( ), temp.end( ), temp.begin( ), ::tolower );
         return temp;
     }
 
     inline std::string asci_uppercase( std::string&& str )
     {
         std::string temp = std::move( str );
-        std::transform( str.begin( ), str.end( ), temp.begin( ), ::toupper );
+        std::transform( temp.begin( ), temp.end( ), temp.begin( ), ::toupper );
         return temp;
     }
 
@@ -517,6 +517,28 @@ namespace dmk
         return result;
     }
 
+    // 64-bit FNV-1a
+    inline uint64_t fnv1a_hash( const void* data, size_t size, uint64_t hash = 0xcbf29ce484222325ull )
+    {
+        const byte_t* bytes = reinterpret_cast<const byte_t*>( data );
+        for ( size_t i = 0; i < size; i++ )
+        {
+            hash ^= bytes[i];
+            hash *= 0x100000001b3ull;
+        }
+        return hash;
+    }
+
+    inline uint64_t fnv1a_hash( const std::string& str, uint64_t hash = 0xcbf29ce484222325ull )
+    {
+        return fnv1a_hash( str.data( ), str.size( ), hash );
+    }
+
+    inline std::string hash_string( uint64_t hash )
+    {
+        return fmt::format( "{:016x}", hash );
+    }
+
     inline std::vector<std::string> tokenize( const std::string& str )
     {
         size_t param_end = 0;
@@ -0,0 +1,394 @@
+/**
+ * DMK
+ * Copyright (C) 2015  Dmitriy Ka
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#pragma once
+
+#include "dmk.h"
+#include "dmk_result.h"
+#include "dmk_console.h"
+
+#include <vector>
+#include <set>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <exception>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
+
+namespace dmk
+{
+
+    // Number of threads that may be used at once by parallel_for_each calls sharing the budget
+    // The calling thread is always counted as one, so nested calls never wait for each other
+    class thread_budget
+    {
+    public:
+        explicit thread_budget( size_t threads ) : m_free( threads > 0 ? threads - 1 : 0 )
+        {
+        }
+        void reset( size_t threads )
+        {
+            std::lock_guard<std::mutex> lock( m_mutex );
+            m_free = threads > 0 ? threads - 1 : 0;
+        }
+        bool try_acquire( )
+        {
+            std::lock_guard<std::mutex> lock( m_mutex );
+            if ( m_free == 0 )
+                return false;
+            m_free--;
+            return true;
+        }
+        void release( )
+        {
+            std::lock_guard<std::mutex> lock( m_mutex );
+            m_free++;
+        }
+
+    private:
+        std::mutex m_mutex;
+        size_t m_free;
+    };
+
+    // Fixed number of jobs of external tools (such as compilers) divided among the users running at once
+    // A user keeps the share it got at start, so the total can be exceeded for a while
+    // when users start one after another
+    class job_budget
+    {
+    public:
+        explicit job_budget( size_t jobs ) : m_jobs( std::max( jobs, size_t( 1 ) ) ), m_users( 0 )
+        {
+        }
+        void reset( size_t jobs )
+        {
+            std::lock_guard<std::mutex> lock( m_mutex );
+            m_jobs = std::max( jobs, size_t( 1 ) );
+        }
+        size_t jobs( ) const
+        {
+            std::lock_guard<std::mutex> lock( m_mutex );
+            return m_jobs;
+        }
+
+        // Jobs given to one user for its lifetime
+        class share
+        {
+        public:
+            explicit share( job_budget& budget ) : m_budget( budget ), m_count( budget.acquire( ) )
+            {
+            }
+            ~share( )
+            {
+                m_budget.release( );
+            }
+            share( const share& ) = delete;
+            share& operator=( const share& ) = delete;
+            size_t count( ) const
+            {
+                return m_count;
+            }
+
+        private:
+            job_budget& m_budget;
+            const size_t m_count;
+        };
+
+    private:
+        size_t acquire( )
+        {
+            std::lock_guard<std::mutex> lock( m_mutex );
+            m_users++;
+            return std::max( m_jobs / m_users, size_t( 1 ) );
+        }
+        void release( )
+        {
+            std::lock_guard<std::mutex> lock( m_mutex );
+            m_users--;
+        }
+
+        mutable std::mutex m_mutex;
+        size_t m_jobs;
+        size_t m_users;
+    };
+
+    // Call func for each item using the calling thread plus as many threads as the budget allows
+    // Unless stop_on_error is false, no new items are started after a failure.
+    // A single error is rethrown as is, several errors are combined into one
+    template <typename _Type, typename _Func>
+    void parallel_for_each( const std::vector<_Type>& items,
+                            thread_budget& budget,
+                            _Func&& func,
+                            bool stop_on_error = true )
+    {
+        std::atomic<size_t> next( 0 );
+        std::atomic<bool> failed( false );
+        std::mutex errors_mutex;
+        std::vector<std::exception_ptr> errors;
+        auto worker = [&]( )
+        {
+            for ( size_t i = next++; i < items.size( ) && !failed; i = next++ )
+            {
+                try
+                {
+                    func( items[i] );
+                }
+                catch ( ... )
+                {
+                    std::lock_guard<std::mutex> lock( errors_mutex );
+                    errors.push_back( std::current_exception( ) );
+                    failed = stop_on_error;
+                }
+            }
+        };
+
+        output_capture* capture = output_capture::current( );
+        output_tail* tail       = output_tail::current( );
+        std::vector<std::thread> threads;
+        while ( threads.size( ) + 1 < items.size( ) && budget.try_acquire( ) )
+        {
+            threads.push_back( std::thread( [&]( )
+                                            {
+                                                output_capture::current( ) = capture;
+                                                output_tail::current( )    = tail;
+                                                worker( );
+                                                budget.release( );
+                                            } ) );
+        }
+        worker( );
+        for ( std::thread& t : threads )
+        {
+            t.join( );
+        }
+
+        if ( errors.size( ) == 1 )
+        {
+            std::rethrow_exception( errors.front( ) );
+        }
+        else if ( errors.size( ) > 1 )
+        {
+            std::vector<std::string> messages;
+            for ( const std::exception_ptr& e : errors )
+            {
+                try
+                {
+                    std::rethrow_exception( e );
+                }
+                catch ( const std::exception& e )
+                {
+                    messages.push_back( e.what( ) );
+                }
+                catch ( ... )
+                {
+                    messages.push_back( "Unknown error" );
+                }
+            }
+            throw error( join( messages, "\n" ) );
+        }
+    }
+
+    // Runs tasks in dependency order on a pool of worker threads
+    // A task starts when all its dependencies have succeeded,
+    // tasks that depend on a failed task are skipped
+    class task_graph
+    {
+    public:
+        typedef std::function<bool( )> task_func;
+        typedef std::function<void( size_t )> skip_func;
+
+        enum state
+        {
+            Pending,
+            Running,
+            Succeeded,
+            Failed,
+            Skipped
+        };
+
+        // Add task and return its index
+        size_t add( const std::string& name, task_func&& func )
+        {
+            m_tasks.push_back( task( name, std::move( func ) ) );
+            return m_tasks.size( ) - 1;
+        }
+
+        // Task won't start until the dependency is succeeded
+        void depends( size_t index, size_t dependency )
+        {
+            if ( index == dependency )
+                return;
+            std::vector<size_t>& list = m_tasks[dependency].dependents;
+            if ( std::find( list.begin( ), list.end( ), index ) != list.end( ) )
+                return;
+            list.push_back( index );
+            m_tasks[index].waiting++;
+        }
+
+        size_t size( ) const
+        {
+            return m_tasks.size( );
+        }
+
+        const std::string& name( size_t index ) const
+        {
+            return m_tasks[index].name;
+        }
+
+        state get_state( size_t index ) const
+        {
+            return m_tasks[index].state;
+        }
+
+        // Run all tasks using at most jobs threads
+        // on_skip is called (under the internal lock) for every skipped task
+        // Returns true if all tasks are succeeded
+        bool run( size_t jobs, const skip_func& on_skip = skip_func( ) )
+        {
+            m_on_skip  = on_skip;
+            m_finished = 0;
+            m_running  = 0;
+            m_ready.clear( );
+            for ( size_t i = 0; i < m_tasks.size( ); i++ )
+            {
+                if ( m_tasks[i].waiting == 0 )
+                    m_ready.insert( i );
+            }
+            jobs = std::max( size_t( 1 ), std::min( jobs, m_tasks.size( ) ) );
+            if ( jobs == 1 )
+            {
+                worker( );
+            }
+            else
+            {
+                std::vector<std::thread> threads;
+                for ( size_t i = 0; i < jobs; i++ )
+                {
+                    threads.push_back( std::thread( &task_graph::worker, this ) );
+                }
+                for ( std::thread& t : threads )
+                {
+                    t.join( );
+                }
+            }
+            if ( m_finished != m_tasks.size( ) )
+            {
+                std::vector<std::string> names;
+                for ( const task& t : m_tasks )
+                {
+                    if ( t.state == Pending )
+                        names.push_back( t.name );
+                }
+                throw error( "Dependency cycle detected between: {}", join( names, ", " ) );
+            }
+            for ( const task& t : m_tasks )
+            {
+                if ( t.state != Succeeded )
+                    return false;
+            }
+            return true;
+        }
+
+    private:
+        struct task
+        {
+            task( const std::string& name, task_func&& func )
+                : name( name ), func( std::move( func ) ), waiting( 0 ), state( Pending )
+            {
+            }
+            std::string name;
+            task_func func;
+            std::vector<size_t> dependents;
+            size_t waiting;
+            task_graph::state state;
+        };
+
+        void worker( )
+        {
+            std::unique_lock<std::mutex> lock( m_mutex );
+            for ( ;; )
+            {
+                m_cond.wait( lock,
+                             [this]( )
+                             {
+                                 return !m_ready.empty( ) || m_running == 0;
+                             } );
+                if ( m_ready.empty( ) )
+                {
+                    // nothing is running and nothing is ready: either done or deadlocked by a cycle
+                    m_cond.notify_all( );
+                    return;
+                }
+                size_t index = *m_ready.begin( );
+                m_ready.erase( m_ready.begin( ) );
+                task& t = m_tasks[index];
+                t.state = Running;
+                m_running++;
+
+                lock.unlock( );
+                bool ok = false;
+                try
+                {
+                    ok = t.func( );
+                }
+                catch ( ... )
+                {
+                    ok = false;
+                }
+                lock.lock( );
+
+                m_running--;
+                finish( index, ok ? Succeeded : Failed );
+                m_cond.notify_all( );
+            }
+        }
+
+        void finish( size_t index, state st )
+        {
+            task& t = m_tasks[index];
+            t.state = st;
+            m_finished++;
+            if ( st == Skipped && m_on_skip )
+                m_on_skip( index );
+            for ( size_t d : t.dependents )
+            {
+                task& dep = m_tasks[d];
+                if ( dep.state != Pending )
+                    continue;
+                if ( st != Succeeded )
+                {
+                    finish( d, Skipped );
+                }
+                else if ( --dep.waiting == 0 )
+                {
+                    m_ready.insert( d );
+                }
+            }
+        }
+
+        std::vector<task> m_tasks;
+        std::set<size_t> m_ready;
+        size_t m_running;
+        size_t m_finished;
+        skip_func m_on_skip;
+        std::mutex m_mutex;
+        std::condition_variable m_cond;
+    };
+}
@@ -21,6 +21,9 @@
 
 #include <string.h>
 #include <map>
+#include <memory>
+#include <set>
+#include <vector>
 #include <dmk_string.h>
 #include <dmk_json.h>
 #include <ctime>
@@ -58,7 +61,7 @@ namespace dmk
             json::object result;
             for ( const json::objectpair& o : obj )
             {
-                merge( result, process_key( o.first ), operator( )( o.second ) );
+                merge( result, process_key( *this, o.first ), operator( )( o.second ) );
             }
             return result;
         }
@@ -72,57 +75,7 @@ namespace dmk
             return result;
         }
 
-        std::string operator( )( const std::string& value ) const
-        {
-            if ( value.find_first_of( "<" ) == std::string::npos &&
-                 value.find_first_of( ">" ) == std::string::npos )
-                return value;
-            std::string result = value;
-
-            size_t pos = 0;
-            while ( ( pos = result.find_first_of( "<>", pos ) ) != std::string::npos )
-            {
-                if ( pos == result.size( ) - 1 )
-                {
-                    throw error( "Invalid variable format: \"{}\"", value );
-                }
-                if ( result[pos] == '>' && result[pos + 1] == '>' ||
-                     result[pos] == '<' && result[pos + 1] == '<' )
-                {
-                    result.erase( pos );
-                    pos++;
-                    continue;
-                }
-                if ( result[pos] == '>' )
-                {
-                    throw error( "Invalid variable format: \"{}\"", value );
-                }
-                size_t end = result.find( '>', pos + 1 );
-                if ( end == std::string::npos )
-                {
-                    throw error( "Invalid variable format: \"{}\"", value );
-                }
-                std::string key   = result.substr( pos + 1, end - pos - 1 );
-                key               = asci_lowercase( key );
-                bool no_exception = erase_leading( key, '.' );
-
-                auto it = find( key );
-                if ( it != this->end( ) )
-                {
-                    result.replace( pos, end - pos + 1, it->second );
-                    pos += it->second.size( );
-                }
-                else if ( no_exception )
-                {
-                    pos = end + 1;
-                }
-                else
-                {
-                    throw error( "Undefined variable: \"{}\"", key );
-                }
-            }
-            return result;
-        }
+        std::string operator( )( const std::string& value ) const;
 
         json operator( )( const json& value ) const
         {
@@ -139,6 +92,13 @@ namespace dmk
             }
         }
 
+        // Value of the variable or nullptr if it isn't defined
+        const std::string* lookup( const std::string& key ) const
+        {
+            auto it = find( key );
+            return it != end( ) ? &it->second : nullptr;
+        }
+
         variable_list transform( const std::string& prefix,
                                  const std::string& postfix,
                                  text_case newcase = text_case::nochange ) const
@@ -153,10 +113,13 @@ namespace dmk
         }
 
     private:
+        friend class json_template;
+
         //  key|condition
         //  key|!not-condition
         //  key|first-condition|second-condition
-        std::string process_key( const std::string& key ) const
+        template <typename Vars>
+        static std::string process_key( const Vars& vars, const std::string& key )
         {
             size_t p = key.find_last_of( '|' );
             if ( p != std::string::npos )
@@ -168,10 +131,10 @@ namespace dmk
                     test   = test.substr( 1 );
                     invert = true;
                 }
-                bool result = find( test ) != end( );
+                bool result = vars.lookup( test ) != nullptr;
                 if ( result != invert ) // logical xor
                 {
-                    return process_key( key.substr( 0, p ) );
+                    return process_key( vars, key.substr( 0, p ) );
                 }
                 else
                 {
@@ -183,7 +146,7 @@ namespace dmk
                 return key;
             }
         }
-        void merge( json::object& object, const std::string& key, const json& value ) const
+        static void merge( json::object& object, const std::string& key, const json& value )
         {
             if ( key.empty( ) ) // remove empty keys
             {
@@ -205,6 +168,239 @@ namespace dmk
         }
     };
 
+    // String split into literal segments and variable slots (<name> or <.optional_name>)
+    // << and >> are escapes for < and >
+    // Variable names are lowercased once, expansion is a single pass
+    // (values of the variables aren't expanded again)
+    class expansion_template
+    {
+    public:
+        expansion_template( ) : m_size( 0 )
+        {
+        }
+        explicit expansion_template( const std::string& value ) : m_size( 0 )
+        {
+            std::string literal;
+            size_t start = 0;
+            size_t pos;
+            while ( ( pos = value.find_first_of( "<>", start ) ) != std::string::npos )
+            {
+                literal.append( value, start, pos - start );
+                if ( pos == value.size( ) - 1 )
+                {
+                    throw error( "Invalid variable format: \"{}\"", value );
+                }
+                if ( value[pos + 1] == value[pos] )
+                {
+                    literal += value[pos];
+                    start = pos + 2;
+                    continue;
+                }
+                if ( value[pos] == '>' )
+                {
+                    throw error( "Invalid variable format: \"{}\"", value );
+                }
+                size_t end = value.find( '>', pos + 1 );
+                if ( end == std::string::npos )
+                {
+                    throw error( "Invalid variable format: \"{}\"", value );
+                }
+                add_literal( literal );
+                segment slot;
+                slot.variable = true;
+                slot.text     = asci_lowercase( value.substr( pos + 1, end - pos - 1 ) );
+                slot.optional = erase_leading( slot.text, '.' );
+                slot.raw      = value.substr( pos, end - pos + 1 );
+                m_segments.push_back( std::move( slot ) );
+                start = end + 1;
+            }
+            literal.append( value, start, std::string::npos );
+            add_literal( literal );
+        }
+
+        // True if the string has no variables
+        bool is_literal( ) const
+        {
+            return m_segments.empty( ) || ( m_segments.size( ) == 1 && !m_segments.front( ).variable );
+        }
+
+        template <typename Vars>
+        std::string operator( )( const Vars& vars ) const
+        {
+            std::string result;
+            result.reserve( m_size );
+            for ( const segment& s : m_segments )
+            {
+                if ( !s.variable )
+                {
+                    result += s.text;
+                    continue;
+                }
+                const std::string* v = vars.lookup( s.text );
+                if ( v )
+                    result += *v;
+                else if ( s.optional )
+                    result += s.raw;
+                else
+                    throw error( "Undefined variable: \"{}\"", s.text );
+            }
+            return result;
+        }
+
+    private:
+        struct segment
+        {
+            segment( ) : variable( false ), optional( false )
+            {
+            }
+            std::string text; // literal text or lowercased variable name
+            std::string raw; // variable as written (kept if an optional variable is undefined)
+            bool variable;
+            bool optional;
+        };
+
+        void add_literal( std::string& literal )
+        {
+            if ( literal.empty( ) )
+                return;
+            m_size += literal.size( );
+            segment s;
+            s.text = std::move( literal );
+            m_segments.push_back( std::move( s ) );
+            literal.clear( );
+        }
+
+        std::vector<segment> m_segments;
+        size_t m_size;
+    };
+
+    inline std::string variable_list::operator( )( const std::string& value ) const
+    {
+        if ( value.find_first_of( "<>" ) == std::string::npos )
+            return value;
+        return expansion_template( value )( *this );
+    }
+
+    // Json value with all strings compiled into expansion templates
+    // Parts without variables and conditional keys are kept as is
+    class json_template
+    {
+    public:
+        json_template( ) : m_kind( Literal )
+        {
+        }
+        explicit json_template( const json& value ) : m_kind( Literal )
+        {
+            switch ( value.get_type( ) )
+            {
+            case json::String:
+                m_string = expansion_template( value.as_string( ) );
+                if ( !m_string.is_literal( ) )
+                    m_kind = String;
+                break;
+            case json::Array:
+                for ( const json& a : value.as_array( ) )
+                {
+                    m_items.push_back( json_template( a ) );
+                    if ( m_items.back( ).m_kind != Literal )
+                        m_kind = Array;
+                }
+                break;
+            case json::Object:
+            {
+                std::set<std::string> keys;
+                for ( const json::objectpair& o : value.as_object( ) )
+                {
+                    m_members.push_back( std::make_pair( o.first, json_template( o.second ) ) );
+                    if ( m_members.back( ).second.m_kind != Literal || o.first.empty( ) ||
+                         o.first.find( '|' ) != std::string::npos || !keys.insert( o.first ).second )
+                        m_kind = Object;
+                }
+                break;
+            }
+            default:
+                break;
+            }
+            if ( m_kind == Literal )
+            {
+                m_literal = value;
+                m_items.clear( );
+                m_members.clear( );
+            }
+        }
+
+        // Same result as vars( value )
+        template <typename Vars>
+        json operator( )( const Vars& vars ) const
+        {
+            switch ( m_kind )
+            {
+            case String:
+                return m_string( vars );
+            case Array:
+            {
+                json::array result;
+                result.reserve( m_items.size( ) );
+                for ( const json_template& a : m_items )
+                {
+                    result.push_back( a( vars ) );
+                }
+                return result;
+            }
+            case Object:
+            {
+                json::object result;
+                for ( const auto& o : m_members )
+                {
+                    variable_list::merge( result, variable_list::process_key( vars, o.first ), o.second( vars ) );
+                }
+                return result;
+            }
+            default:
+                return m_literal;
+            }
+        }
+
+        // Same result as operator( )( vars )[key] for an object, but only members with the key are expanded
+        // Null if the result has no such key
+        template <typename Vars>
+        json member( const Vars& vars, const std::string& key ) const
+        {
+            if ( m_kind == Literal )
+            {
+                return m_literal.has_key( key ) ? m_literal.as_object( ).find( key )->second : json( );
+            }
+            if ( m_kind != Object || key.empty( ) )
+            {
+                return json( );
+            }
+            json::object result;
+            for ( const auto& o : m_members )
+            {
+                // key|conditions
+                if ( o.first.compare( 0, key.size( ), key ) != 0 ||
+                     ( o.first.size( ) != key.size( ) && o.first[key.size( )] != '|' ) )
+                    continue;
+                variable_list::merge( result, variable_list::process_key( vars, o.first ), o.second( vars ) );
+            }
+            return result.empty( ) ? json( ) : result.front( ).second;
+        }
+
+    private:
+        enum kind
+        {
+            Literal,
+            String,
+            Array,
+            Object
+        };
+        kind m_kind;
+        json m_literal;
+        expansion_template m_string;
+        std::vector<json_template> m_items;
+        std::vector<std::pair<std::string, json_template>> m_members;
+    };
+
     inline variable_list dynamic_variables( )
     {
         variable_list vars;
@@ -230,4 +426,144 @@ namespace dmk
         left.insert( right.begin( ), right.end( ) );
         return left;
     }
+
+    // Variables computed on first lookup
+    // Used as a layer of variable_scope for large sets of variables of which only a few are usually referenced
+    class lazy_variables
+    {
+    public:
+        virtual ~lazy_variables( ) = default;
+
+        // Value of the variable or nullptr if it isn't defined
+        // The returned pointer stays valid while the object exists
+        virtual const std::string* lookup( const std::string& key ) const = 0;
+
+        // All variables (computes everything)
+        virtual variable_list flatten( ) const = 0;
+    };
+
+    // Chain of immutable variable lists shared between scopes
+    // Lookup goes from the first layer to the last one, so the left operand of + wins as for variable_list
+    // Composing scopes copies only layer pointers
+    class variable_scope
+    {
+    public:
+        variable_scope( ) = default;
+        variable_scope( const variable_list& vars )
+        {
+            if ( !vars.empty( ) )
+                m_layers.push_back( std::make_shared<const variable_list>( vars ) );
+        }
+        variable_scope( variable_list&& vars )
+        {
+            if ( !vars.empty( ) )
+                m_layers.push_back( std::make_shared<const variable_list>( std::move( vars ) ) );
+        }
+        variable_scope( const std::shared_ptr<const lazy_variables>& vars )
+        {
+            m_layers.push_back( layer( vars ) );
+        }
+
+        const std::string* lookup( const std::string& key ) const
+        {
+            for ( const layer& l : m_layers )
+            {
+                const std::string* v = l.lookup( key );
+                if ( v )
+                    return v;
+            }
+            return nullptr;
+        }
+
+        bool empty( ) const
+        {
+            return m_layers.empty( );
+        }
+
+        // Override the variable in this scope only (the shared layers are left untouched)
+        void set( const std::string& key, const std::string& value )
+        {
+            // m_top is owned by this scope if nobody else references it (one reference is in m_layers)
+            if ( !m_top || m_top.use_count( ) > 2 )
+            {
+                m_top = m_top ? std::make_shared<variable_list>( *m_top ) : std::make_shared<variable_list>( );
+                if ( m_top->empty( ) )
+                    m_layers.insert( m_layers.begin( ), layer( m_top ) );
+                else
+                    m_layers.front( ).list = m_top;
+            }
+            ( *m_top )[key] = value;
+        }
+
+        // All variables merged into one list
+        variable_list flatten( ) const
+        {
+            variable_list result;
+            for ( const layer& l : m_layers )
+            {
+                if ( l.list )
+                    result.insert( l.list->begin( ), l.list->end( ) );
+                else
+                    result += l.lazy->flatten( );
+            }
+            return result;
+        }
+
+        variable_list transform( const std::string& prefix,
+                                 const std::string& postfix,
+                                 text_case newcase = text_case::nochange ) const
+        {
+            return flatten( ).transform( prefix, postfix, newcase );
+        }
+
+        void print( ) const
+        {
+            flatten( ).print( );
+        }
+
+        std::string operator( )( const std::string& value ) const
+        {
+            if ( value.find_first_of( "<>" ) == std::string::npos )
+                return value;
+            return expansion_template( value )( *this );
+        }
+
+        json operator( )( const json& value ) const
+        {
+            return json_template( value )( *this );
+        }
+
+        variable_scope& operator+=( const variable_scope& right )
+        {
+            m_layers.insert( m_layers.end( ), right.m_layers.begin( ), right.m_layers.end( ) );
+            return *this;
+        }
+
+    private:
+        // Either a variable list or lazily computed variables
+        struct layer
+        {
+            layer( const std::shared_ptr<const variable_list>& vars ) : list( vars )
+            {
+            }
+            layer( const std::shared_ptr<const lazy_variables>& vars ) : lazy( vars )
+            {
+            }
+            const std::string* lookup( const std::string& key ) const
+            {
+                return list ? list->lookup( key ) : lazy->lookup( key );
+            }
+            std::shared_ptr<const variable_list> list;
+            std::shared_ptr<const lazy_variables> lazy;
+        };
+
+        std::vector<layer> m_layers;
+        std::shared_ptr<variable_list> m_top;
+    };
+
+    inline variable_scope operator+( variable_scope left, const variable_scope& right )
+    {
+        left += right;
+        return left;
+    }
 }
@@ -20,15 +20,215 @@
 #pragma once
 
 #include "cmgen.h"
+#include <dmk_sha256.h>
+#include <dmk_archive.h>
+#include <dmk_thread.h>
+#include <mutex>
 
 namespace dmk
 {
 
+    // Persistent cache of downloaded files
+    // Each file is stored as <cache_dir>/<key>/<filename>, where key is the expected sha256
+    // of the file or the hash of its url when no checksum is specified.
+    // Modification time of an entry is updated on every use (used for pruning)
+    class download_cache
+    {
+    public:
+        struct entry
+        {
+            path file;
+            uint64_t size;
+            double age;
+        };
+
+        struct statistics
+        {
+            int64_t hits;
+            int64_t misses;
+        };
+
+        static path entry_path( const std::string& url, const std::string& sha256, const path& filename )
+        {
+            std::string key = sha256.empty( ) ? "url-" + hash_string( fnv1a_hash( url ) ) : asci_lowercase( sha256 );
+            return env->cache_dir / key / filename;
+        }
+
+        // Return the cached file or empty path if the file isn't cached or fails verification
+        static path find( const std::string& url, const std::string& sha256, const path& filename )
+        {
+            path file = entry_path( url, sha256, filename );
+            if ( !is_file( file ) )
+                return path( );
+            if ( !sha256.empty( ) && file_sha256( file ) != asci_lowercase( sha256 ) )
+            {
+                yellow_text c;
+                println( "Cached file {} is damaged, removing", file );
+                safe_remove_all( file.parent_path( ) );
+                return path( );
+            }
+            touch_mtime( file );
+            count( true );
+            return file;
+        }
+
+        // Download url into the cache and return the cached file
+        static path download( const std::string& url, const std::string& sha256, const path& filename )
+        {
+            path file = entry_path( url, sha256, filename );
+            path tmpfolder;
+            do // another job may take the same name
+            {
+                tmpfolder = unique_path( env->cache_dir, "", "tmp%04d" );
+            } while ( !create_directory( tmpfolder ) );
+            try
+            {
+                path tmpfile = tmpfolder / filename;
+                exec<build_process>( tmpfolder,
+                                     env->curl_path,
+                                     argument_list{
+                                         "-f", "-o", tmpfile.string( ), "-L", url, "--stderr", "-" } );
+                if ( !sha256.empty( ) )
+                {
+                    std::string actual = file_sha256( tmpfile );
+                    if ( actual != asci_lowercase( sha256 ) )
+                        throw error( "Checksum mismatch for {}: expected {}, got {}", url, sha256, actual );
+                }
+                create_directories( file.parent_path( ) );
+                rename( tmpfile, file );
+                safe_remove_all( tmpfolder );
+            }
+            catch ( ... )
+            {
+                safe_remove_all( tmpfolder );
+                throw;
+            }
+            count( false );
+            return file;
+        }
+
+        // All cached files, least recently used first
+        static std::vector<entry> entries( )
+        {
+            std::vector<entry> result;
+            for ( const directory_entry& dir : directory_iterator( env->cache_dir ) )
+            {
+                if ( !is_directory( dir ) || begins_with( dir.path( ).filename( ).string( ), "tmp" ) )
+                    continue;
+                for ( const directory_entry& f : directory_iterator( dir ) )
+                {
+                    if ( is_file( f ) )
+                        result.push_back( entry{ f.path( ), file_size( f ), file_age( f ) } );
+                }
+            }
+            std::sort( result.begin( ), result.end( ),
+                       []( const entry& l, const entry& r )
+                       {
+                           return l.age > r.age;
+                       } );
+            return result;
+        }
+
+        // Remove entries older than max_age seconds, then the least recently used ones
+        // until the total size doesn't exceed max_size
+        static std::vector<entry> prune( uint64_t max_size, double max_age )
+        {
+            std::vector<entry> list = entries( );
+            uint64_t total          = 0;
+            for ( const entry& e : list )
+            {
+                total += e.size;
+            }
+            std::vector<entry> removed;
+            for ( const entry& e : list )
+            {
+                if ( e.age <= max_age && total <= max_size )
+                    break;
+                safe_remove_all( e.file.parent_path( ) );
+                total -= e.size;
+                removed.push_back( e );
+            }
+            return removed;
+        }
+
+        static statistics stats( )
+        {
+            statistics result{ 0, 0 };
+            path file = stats_path( );
+            if ( is_file( file ) )
+            {
+                std::string text = file_get_string( file );
+                char* end        = nullptr;
+                result.hits      = std::strtoll( text.c_str( ), &end, 10 );
+                result.misses    = std::strtoll( end, nullptr, 10 );
+            }
+            return result;
+        }
+
+        static void reset_stats( )
+        {
+            std::lock_guard<std::mutex> lock( mutex( ) );
+            file_put_string( stats_path( ), "0 0\n" );
+        }
+
+    private:
+        static path stats_path( )
+        {
+            return env->cache_dir / "stats.txt";
+        }
+
+        static std::mutex& mutex( )
+        {
+            static std::mutex m;
+            return m;
+        }
+
+        static void count( bool hit )
+        {
+            std::lock_guard<std::mutex> lock( mutex( ) );
+            statistics s = stats( );
+            ( hit ? s.hits : s.misses )++;
+            file_put_string( stats_path( ), fmt::format( "{} {}\n", s.hits, s.misses ) );
+        }
+    };
+
     // Download/Clone/Copy external sources into local directory
     class fetcher
     {
     public:
         static ptr<fetcher> create( const project* proj, const json& package, const path& destination );
+
+        // Fetch all items. Items that may run concurrently are fetched in parallel
+        // (limited by jobs) after the others are fetched in order.
+        // Every item is tried, errors are combined
+        static void fetch_all( const project* proj, const std::vector<json>& items, const path& destination )
+        {
+            static thread_budget sequential( 1 );
+            std::vector<ptr<fetcher>> ordered;
+            std::vector<ptr<fetcher>> concurrent;
+            for ( const json& item : items )
+            {
+                if ( item.is_null( ) )
+                    continue;
+                ptr<fetcher> f = create( proj, item, destination );
+                ( f->is_concurrent( ) ? concurrent : ordered ).push_back( f );
+            }
+            for ( const ptr<fetcher>& f : ordered )
+            {
+                f->fetch( );
+            }
+            parallel_for_each( concurrent,
+                               concurrent.size( ) > 1 ? jobs : sequential,
+                               []( const ptr<fetcher>& f )
+                               {
+                                   f->fetch( );
+                               },
+                               false );
+        }
+
+        // Limits how many items of a list are fetched at once
+        static thread_budget jobs;
+
         void fetch( )
         {
             console_title ct( true, "Fetching {}...", m_project->name( ) );
@@ -49,6 +249,11 @@ namespace dmk
         virtual void do_fetch( )
         {
         }
+        // Repository clones need an empty destination and are never run concurrently
+        virtual bool is_concurrent( ) const
+        {
+            return true;
+        }
         fetcher( const project* proj, const json& package, const path& destination )
             : m_project( proj ), m_package( package ), m_destination( destination )
         {
@@ -66,11 +271,15 @@ namespace dmk
     protected:
         using fetcher::fetcher;
         friend class fetcher;
+        virtual bool is_concurrent( ) const override
+        {
+            return false;
+        }
         virtual void do_fetch( ) override
         {
             if ( is_directory( m_destination / ".git" ) )
             {
-                exec<build_process>( m_destination, env->git_path, "pull" );
+                exec<build_process>( m_destination, env->git_path, argument_list{ "pull" } );
             }
             else
             {
@@ -82,10 +291,14 @@ namespace dmk
                 std::string branch = m_package["branch"] || "master";
                 exec<build_process>( m_destination.parent_path( ),
                                      env->git_path,
-                                     "clone -b {} --single-branch --depth 1 {} {}",
-                                     qo( branch ),
-                                     url,
-                                     m_destination.filename( ) );
+                                     argument_list{ "clone",
+                                                    "-b",
+                                                    branch,
+                                                    "--single-branch",
+                                                    "--depth",
+                                                    "1",
+                                                    url,
+                                                    m_destination.filename( ).string( ) } );
             }
         }
     };
@@ -96,11 +309,15 @@ namespace dmk
     protected:
         using fetcher::fetcher;
         friend class fetcher;
+        virtual bool is_concurrent( ) const override
+        {
+            return false;
+        }
         virtual void do_fetch( ) override
         {
             if ( is_directory( m_destination / ".hg" ) )
             {
-                exec<build_process>( m_destination, env->hg_path, "pull" );
+                exec<build_process>( m_destination, env->hg_path, argument_list{ "pull" } );
             }
             else
             {
@@ -108,10 +325,8 @@ namespace dmk
                 std::string branch = m_package["branch"] || "default";
                 exec<build_process>( m_destination.parent_path( ),
                                      env->hg_path,
-                                     "clone -b {} {} {}",
-                                     qo( branch ),
-                                     url,
-                                     m_destination.filename( ) );
+                                     argument_list{
+                                         "clone", "-b", branch, url, m_destination.filename( ).string( ) } );
             }
         }
     };
@@ -131,22 +346,46 @@ namespace dmk
             }
             return filepath.filename( );
         }
-        // Download file to temporary folder and return file path
+        // Take file from the download cache (downloading it if needed) and return file path
+        // The file must not be modified or removed by the caller
         path download( )
         {
-            std::string url = m_package["url"] || "";
-            path filename   = path( m_package["file"] || extract_filename( url ).string( ) );
-            path tmpfolder = unique_path( env->temp_dir, "", "tmpfolder%04d" );
-            create_directory( tmpfolder );
-            path tmpfile = tmpfolder / filename;
-            exec<build_process>(
-                tmpfolder, env->curl_path, "-o {} -L {} --stderr -", qo( tmpfile ), qo( url ) );
+            std::string url    = m_package["url"] || "";
+            std::string sha256 = m_package["sha256"] || "";
+            path filename      = path( m_package["file"] || extract_filename( url ).string( ) );
+            path file          = download_cache::find( url, sha256, filename );
+            if ( !file.empty( ) )
+            {
+                if ( !build_process::quiet )
+                    println( "Using cached {}", file );
+                return file;
+            }
+            return download_cache::download( url, sha256, filename );
+        }
+        // Extract archive using the built-in decoders
+        // Returns false if the format isn't supported by them
+        bool extract( const path& file, const path& target_dir, int strip_levels )
+        {
+            if ( !build_process::quiet )
+                println( "Extracting {} -> {}", file.filename( ), target_dir );
+            return extract_archive( file, target_dir, strip_levels );
+        }
+        // Create temporary folder that is removed after fetching
+        path temp_folder( const path& parent = env->temp_dir, const std::string& pattern = "tmpfolder%04d" )
+        {
+            path tmpfolder;
+            create_directories( parent );
+            do // another job may take the same name
+            {
+                tmpfolder = unique_path( parent, "", pattern );
+            } while ( !create_directory( tmpfolder ) );
             m_temporaries.push_back( tmpfolder );
-            return tmpfile;
+            return tmpfolder;
         }
     };
 
-    // Download archive and uncompress using tar
+    // Download archive and uncompress it
+    // tar, tar.gz and zip are extracted in-process, other formats using tar
     class archive_fetcher : public download_fetcher
     {
     protected:
@@ -158,16 +397,19 @@ namespace dmk
             path tmpfile     = download( );
             int strip_levels = m_package["strip"] || 1;
 
+            if ( extract( tmpfile, target_dir, strip_levels ) )
+                return;
             exec<build_process>( m_destination,
                                  env->tar_path,
-                                 "-xf {} --strip={} -C {}",
-                                 qo( tmpfile ),
-                                 strip_levels,
-                                 qo( target_dir ) );
+                                 argument_list{ "-xf",
+                                                tmpfile.string( ),
+                                                "--strip=" + std::to_string( strip_levels ),
+                                                "-C",
+                                                target_dir.string( ) } );
         }
     };
 
-    // Download archive and uncompress using unzip
+    // Download zip archive and uncompress it
     class ziparchive_fetcher : public download_fetcher
     {
     protected:
@@ -175,26 +417,18 @@ namespace dmk
         friend class fetcher;
         virtual void do_fetch( ) override
         {
-            std::string url  = m_package["url"] || "";
             path target_dir  = path( m_package["target_dir"] || m_destination.string( ) );
             path tmpfile     = download( );
             int strip_levels = m_package["strip"] || 1;
 
-            path target_tmp_dir = target_dir / "tmp-zip";
-            create_directories( target_tmp_dir );
-            exec<build_process>(
-                m_destination, env->unzip_path, "-q {} -d {}", qo( tmpfile ), qo( target_tmp_dir ) );
-
-            if ( strip_levels == 0 )
-                move_content( target_tmp_dir, target_dir );
-            else if ( strip_levels == 1 )
-                move_content_strip1( target_tmp_dir, target_dir );
-            else
-                throw error( "ziparchive_fetcher: Invalid strip value ({})", strip_levels );
+            if ( !extract( tmpfile, target_dir, strip_levels ) )
+                throw error( "ziparchive_fetcher: {} isn't a zip archive", tmpfile.filename( ) );
         }
     };
 
-    // Download archive and uncompress using 7zip
+    // Download archive and uncompress it
+    // tar.bz2 and tar.xz are decompressed by 7zip and streamed to the built-in tar extractor,
+    // 7z archives are extracted using 7zip
     class sevenziparchive_fetcher : public download_fetcher
     {
     protected:
@@ -202,31 +436,28 @@ namespace dmk
         friend class fetcher;
         virtual void do_fetch( ) override
         {
-            std::string url  = m_package["url"] || "";
             path target_dir  = path( m_package["target_dir"] || m_destination.string( ) );
             path tmpfile     = download( );
             int strip_levels = m_package["strip"] || 1;
 
-            path target_tmp_dir = target_dir / "tmp-7zip";
-            create_directories( target_tmp_dir );
+            if ( extract( tmpfile, target_dir, strip_levels ) )
+                return;
+
             std::string fn = tmpfile.filename( ).string( );
-            if ( ends_with( fn, ".tar.gz" ) || ends_with( fn, ".tar.bz" ) || ends_with( fn, ".tar.xz" ) )
-            {
-                path tar_file = tmpfile;
-                tar_file.replace_extension( );
-                exec<build_process>( tmpfile.parent_path( ), env->sevenzip_path, "x {}", qo( tmpfile ) );
-                m_temporaries.push_back( tar_file );
-                // stage 1:
-                // stage 2: unpack tar
-                exec<build_process>(
-                    m_destination, env->sevenzip_path, "x -o{} {}", qo( target_tmp_dir ), qo( tar_file ) );
-            }
-            else
+            if ( ends_with( fn, ".tar.bz" ) || ends_with( fn, ".tar.bz2" ) || ends_with( fn, ".tar.xz" ) ||
+                 ends_with( fn, ".tbz2" ) || ends_with( fn, ".txz" ) )
             {
-                exec<build_process>(
-                    m_destination, env->sevenzip_path, "x -o{} {}", qo( target_tmp_dir ), qo( tmpfile ) );
+                pipe_input tar( argument_list{ env->sevenzip_path.string( ), "x", "-so", tmpfile.string( ) } );
+                extract_tar( tar, target_dir, strip_levels );
+                tar.finish( );
+                return;
             }
 
+            path target_tmp_dir = temp_folder( target_dir, "tmp-7zip%04d" );
+            exec<build_process>( m_destination,
+                                 env->sevenzip_path,
+                                 argument_list{ "x", "-o" + target_tmp_dir.string( ), tmpfile.string( ) } );
+
             if ( strip_levels == 0 )
                 move_content( target_tmp_dir, target_dir );
             else if ( strip_levels == 1 )
@@ -244,6 +475,7 @@ namespace dmk
         friend class fetcher;
         virtual void do_fetch( ) override
         {
+            // Options of the installer, $NAME and ~ are expanded (see process::split_arguments)
             std::string command = m_package["command"] || "";
             path tmpfile = download( );
             exec<build_process>( m_destination, tmpfile, command );
@@ -280,9 +512,11 @@ namespace dmk
             std::string url = m_package["url"] || "";
             exec<build_process>( m_destination,
                                  env->wget_path,
-                                 "-m -np -nH --cut-dirs={} {}",
-                                 count_substr( url, '/' ) - 3,
-                                 qo( url ) );
+                                 argument_list{ "-m",
+                                                "-np",
+                                                "-nH",
+                                                "--cut-dirs=" + std::to_string( count_substr( url, '/' ) - 3 ),
+                                                url } );
         }
     };
 
@@ -294,13 +528,7 @@ namespace dmk
         friend class fetcher;
         virtual void do_fetch( ) override
         {
-            for ( const json& item : m_package.flatten( ) )
-            {
-                if ( item.is_null( ) )
-                    continue;
-                ptr<fetcher> f = fetcher::create( m_project, item, m_destination );
-                f->fetch( );
-            }
+            fetch_all( m_project, m_package.flatten( ), m_destination );
         }
     };
 
@@ -0,0 +1,193 @@
+/**
+ * CMGen
+ * Copyright (C) 2015  Dmitriy Ka
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#pragma once
+
+#include "cmgen.h"
+#include <unordered_map>
+#include <mutex>
+
+namespace dmk
+{
+
+    // Hashes of directory tree listings: names, sizes and modification times of all the files
+    // (version control directories are skipped)
+    // The listing of each directory is stored as <dir>/<hash of the tree path>.bin along with
+    // the modification time of the directory. Directories with unchanged time aren't read again,
+    // so a file changed in place (without being created, removed or renamed) isn't noticed
+    // until its directory changes; commands with ! don't depend on the manifests
+    class manifest_cache
+    {
+    public:
+        explicit manifest_cache( const path& dir ) : m_dir( dir )
+        {
+            create_directories( m_dir );
+        }
+        manifest_cache( const manifest_cache& ) = delete;
+        manifest_cache& operator=( const manifest_cache& ) = delete;
+
+        std::string hash( const path& directory )
+        {
+            const std::string key = directory.string( );
+            const path cached     = m_dir / ( hash_string( fnv1a_hash( key ) ) + ".bin" );
+            json listings;
+            {
+                std::lock_guard<std::mutex> lock( m_mutex );
+                auto it = m_loaded.find( key );
+                listings = it != m_loaded.end( ) ? it->second : read( cached, key );
+            }
+            json updated = json::object( );
+            std::vector<std::string> manifest;
+            bool changed = false;
+            if ( is_directory( directory ) )
+            {
+                scan( directory, "", listings, updated, manifest, changed );
+            }
+            changed = changed || updated.size( ) != listings.size( );
+            std::sort( manifest.begin( ), manifest.end( ) );
+            uint64_t hash = fnv1a_hash( "" );
+            for ( const std::string& line : manifest )
+            {
+                hash = fnv1a_hash( line + '\n', hash );
+            }
+            std::lock_guard<std::mutex> lock( m_mutex );
+            m_loaded[key] = updated;
+            if ( changed )
+                write( cached, key, updated );
+            return hash_string( hash );
+        }
+
+    private:
+        // The listing of each directory is
+        // {"mtime": time, "files": [lines], "dirs": [subdirectory names]}
+        static void scan( const path& directory,
+                          const std::string& prefix,
+                          const json& listings,
+                          json& updated,
+                          std::vector<std::string>& manifest,
+                          bool& changed )
+        {
+            const int64_t mtime = file_mtime( directory );
+            const json& cached  = listings[prefix];
+            json listing;
+            if ( cached.is_object( ) && cached["mtime"].as_int( ) == mtime )
+            {
+                listing = cached;
+            }
+            else
+            {
+                changed = true;
+                json::array files;
+                json::array dirs;
+                for ( const directory_entry& entry : directory_iterator( directory ) )
+                {
+                    const path& p    = entry.path( );
+                    std::string name = p.filename( ).string( );
+                    if ( is_symlink( p ) )
+                    {
+                        files.push_back( json( name + " -> " + read_symlink( p ).string( ) ) );
+                    }
+                    else if ( is_directory( p ) )
+                    {
+                        if ( name == ".git" || name == ".svn" || name == ".hg" )
+                            continue;
+                        dirs.push_back( json( name ) );
+                    }
+                    else
+                    {
+                        files.push_back( json( fmt::format( "{}\t{}\t{}", name, file_size( p ), file_mtime( p ) ) ) );
+                    }
+                }
+                listing          = json::object( );
+                listing["mtime"] = mtime;
+                listing["files"] = json( std::move( files ) );
+                listing["dirs"]  = json( std::move( dirs ) );
+            }
+            for ( const json& file : listing["files"].as_array( ) )
+            {
+                manifest.push_back( prefix + file.as_string( ) );
+            }
+            // Changes made within the same second can keep the time of the directory,
+            // such listings are stored only after they settle
+            if ( file_age( directory ) >= 2.0 )
+                updated[prefix] = listing;
+            for ( const json& d : listing["dirs"].as_array( ) )
+            {
+                const std::string name = d.as_string( );
+                if ( is_directory( directory / name ) )
+                    scan( directory / name, prefix + name + "/", listings, updated, manifest, changed );
+            }
+        }
+
+        // Empty object if there is no valid entry for the tree
+        static json read( const path& cached, const std::string& key )
+        {
+            if ( !is_file( cached ) )
+                return json::object( );
+            try
+            {
+                file_contents contents( cached );
+                const size_t length = std::strlen( signature( ) );
+                if ( contents.size( ) < length || std::memcmp( contents.data( ), signature( ), length ) != 0 )
+                    return json::object( );
+                json entry = json_binary::read( contents.data( ) + length, contents.size( ) - length );
+                if ( entry["path"].as_string( ) != key || !entry["listings"].is_object( ) )
+                    return json::object( );
+                return entry["listings"];
+            }
+            catch ( const std::exception& )
+            {
+                return json::object( );
+            }
+        }
+
+        // The cache is optional, failure to write it is ignored
+        void write( const path& cached, const std::string& key, const json& listings )
+        {
+            json entry = json::object( );
+            entry["path"]     = key;
+            entry["listings"] = listings;
+            std::string bytes = signature( );
+            json_binary::write( entry, bytes );
+            // Written under another name, so readers never see a partially written file
+            path temp = unique_path( m_dir, ".tmp", cached.stem( ).string( ) + "-%04d" );
+            try
+            {
+                file_put_bytes( temp, bytes, open_mode::Binary );
+                rename( temp, cached );
+            }
+            catch ( const std::exception& )
+            {
+                remove_if_exists( temp );
+            }
+        }
+
+        // Changed along with the format of the entries
+        static const char* signature( )
+        {
+            return "CMGM0001";
+        }
+
+        const path m_dir;
+        std::mutex m_mutex;
+        std::unordered_map<std::string, json> m_loaded;
+    };
+
+    extern ptr<manifest_cache> manifests;
+}
@@ -20,6 +20,10 @@
 #pragma once
 
 #include "cmgen.h"
+#include "state.h"
+#include "descriptors.h"
+#include <unordered_map>
+#include <mutex>
 
 namespace dmk
 {
@@ -27,22 +31,26 @@ namespace dmk
     class project
     {
     public:
-        project( const std::string& name ) : m_name( name ), m_source_dir( env->source_root_dir / name )
+        project( const std::string& name )
+            : m_name( name ), m_source_dir( env->source_root_dir / name ), m_data_expanded( false )
         {
             if ( !is_directory( m_source_dir ) )
             {
                 throw command_error( "Project doesn't exist in directory {}", m_source_dir );
             }
-            path data_path  = module_path( name );
-            m_original_data = file_get_json( data_path );
+            descriptor_cache::descriptor descriptor = descriptors->get( module_path( name ) );
+            m_hash          = descriptor.hash;
+            m_original_data = descriptor.data;
             m_version = m_original_data["version"].as_string( );
             create_directories( m_source_dir );
 
-            m_external_variables = env->env + env->variables + dynamic_variables( );
+            m_external_variables = env->env_scope + env->variables_scope + dynamic_variables( );
 
-            m_variables["project"]    = name;
-            m_variables["module"]     = name;
-            m_variables["source_dir"] = m_source_dir.string( );
+            variable_list vars;
+            variable_list cross;
+            vars["project"]    = name;
+            vars["module"]     = name;
+            vars["source_dir"] = m_source_dir.string( );
             for ( const json::objectpair& v : m_original_data.as_object( ) )
             {
                 if ( v.first.find( '|' ) != std::string::npos ) // skip conditions
@@ -52,44 +60,33 @@ namespace dmk
                 case json::String:
                 case json::Int:
                 case json::Double:
-                    m_variables["this." + v.first] = v.second.to_string( );
+                    vars["this." + v.first] = v.second.to_string( );
                     break;
                 }
             }
 
             if ( !m_version.empty( ) )
             {
-                m_variables["version"]            = m_version;
-                m_variables["version(.)"]         = m_version;
-                m_variables["version()"]          = replace_all( m_version, ".", "" );
-                m_variables["version(-)"]         = replace_all( m_version, ".", "-" );
-                m_variables["version(_)"]         = replace_all( m_version, ".", "_" );
-                m_variables["version(/)"]         = replace_all( m_version, ".", "/" );
-                m_variables["version_no"]         = replace_all( m_version, ".", "" );
-                m_variables["version_minus"]      = replace_all( m_version, ".", "-" );
-                m_variables["version_underscore"] = replace_all( m_version, ".", "_" );
-                m_variables["version_slash"]      = replace_all( m_version, ".", "/" );
+                vars["version"]            = m_version;
+                vars["version(.)"]         = m_version;
+                vars["version()"]          = replace_all( m_version, ".", "" );
+                vars["version(-)"]         = replace_all( m_version, ".", "-" );
+                vars["version(_)"]         = replace_all( m_version, ".", "_" );
+                vars["version(/)"]         = replace_all( m_version, ".", "/" );
+                vars["version_no"]         = replace_all( m_version, ".", "" );
+                vars["version_minus"]      = replace_all( m_version, ".", "-" );
+                vars["version_underscore"] = replace_all( m_version, ".", "_" );
+                vars["version_slash"]      = replace_all( m_version, ".", "/" );
 
                 std::vector<std::string> parts = split( m_version, "." );
-                m_variables["version1"]        = parts.size( ) >= 1 ? parts[0] : "";
-                m_variables["version2"]        = parts.size( ) >= 2 ? parts[1] : "";
-                m_variables["version3"]        = parts.size( ) >= 3 ? parts[2] : "";
-                m_variables["version4"]        = parts.size( ) >= 4 ? parts[3] : "";
+                vars["version1"]               = parts.size( ) >= 1 ? parts[0] : "";
+                vars["version2"]               = parts.size( ) >= 2 ? parts[1] : "";
+                vars["version3"]               = parts.size( ) >= 3 ? parts[2] : "";
+                vars["version4"]               = parts.size( ) >= 4 ? parts[3] : "";
             }
 
-            for ( const architecture& arch : env->archs )
-            {
-                for ( const configuration& cfg : env->configs_all )
-                {
-                    m_cross_variables +=
-                        dir_variables( arch, cfg, m_name )
-                            .transform(
-                                "", "_" + asci_lowercase( arch.name ) + "_" + asci_lowercase( cfg.name ) );
-                }
-                m_cross_variables +=
-                    root_dir_variables( arch, m_name ).transform( "", "_" + asci_lowercase( arch.name ) );
-            }
-            m_data = ( m_external_variables + variables( ) + cross_variables( ) )( m_original_data );
+            m_variables       = std::move( vars );
+            m_cross_variables = variable_scope( std::make_shared<const cross_variable_list>( m_name ) );
         }
         const std::string& name( ) const
         {
@@ -99,23 +96,56 @@ namespace dmk
         {
             return m_version;
         }
+        // Hash of the module descriptor
+        const std::string& hash( ) const
+        {
+            return m_hash;
+        }
+        // Expanded descriptor
         const json& data( ) const
         {
+            std::lock_guard<std::mutex> lock( m_data_mutex );
+            if ( !m_data_expanded )
+            {
+                m_data          = get_template( )( data_variables( ) );
+                m_data_expanded = true;
+            }
             return m_data;
         }
+        // Same as data( )[key] (or null), only the members with this key are expanded
+        json data( const std::string& key ) const
+        {
+            std::lock_guard<std::mutex> lock( m_data_mutex );
+            if ( m_data_expanded )
+            {
+                return m_data.has_key( key ) ? m_data.as_object( ).find( key )->second : json( );
+            }
+            auto it = m_data_members.find( key );
+            if ( it == m_data_members.end( ) )
+            {
+                it = m_data_members.emplace( key, get_template( ).member( data_variables( ), key ) ).first;
+            }
+            return it->second;
+        }
         json data( const architecture& arch, const configuration& config ) const
         {
-            return ( m_external_variables + variables( arch, config ) )( m_original_data );
+            const json_template* tmpl;
+            {
+                std::lock_guard<std::mutex> lock( m_data_mutex );
+                tmpl = &get_template( );
+            }
+            // the template isn't changed once created, workers expand it at once
+            return ( *tmpl )( m_external_variables + variables( arch, config ) );
         }
         const path& source_dir( ) const
         {
             return m_source_dir;
         }
-        const variable_list& variables( ) const
+        const variable_scope& variables( ) const
         {
             return m_variables;
         }
-        const variable_list& cross_variables( ) const
+        const variable_scope& cross_variables( ) const
         {
             return m_cross_variables;
         }
@@ -192,12 +222,12 @@ namespace dmk
             return vars;
         }
 
-        variable_list variables( const architecture& arch, const configuration& config ) const
+        variable_scope variables( const architecture& arch, const configuration& config ) const
         {
             return m_variables + m_cross_variables + work_variables( arch, config, m_name );
         }
 
-        variable_list public_variables( const architecture& arch, const configuration& config ) const
+        variable_scope public_variables( const architecture& arch, const configuration& config ) const
         {
             return m_variables + work_variables( arch, config, m_name );
         }
@@ -296,11 +326,11 @@ namespace dmk
 
         static bool is_imported( const std::string& name )
         {
-            return is_file( flag_path( name, "imported" ) );
+            return states->is_set( name, "imported" );
         }
-        static void set_imported( const std::string& name )
+        static void set_imported( const std::string& name, double duration = 0.0 )
         {
-            touch_file( flag_path( name, "imported" ) );
+            states->set( name, "imported", "", "", "", duration );
         }
         static void clear_imported( const std::string& name )
         {
@@ -310,18 +340,21 @@ namespace dmk
             }
             if ( !is_local( name ) )
             {
-                remove_if_exists( flag_path( name, "imported" ) );
+                states->clear( name, "imported" );
                 remove_imported( name );
             }
         }
 
         static bool is_configured( const std::string& name, const architecture& arch )
         {
-            return is_file( flag_path( name, "configured", arch ) );
+            return states->is_set( name, "configured", env->platform, arch.name );
         }
-        static void set_configured( const std::string& name, const architecture& arch )
+        static void set_configured( const std::string& name,
+                                    const architecture& arch,
+                                    const std::string& hash = "",
+                                    double duration = 0.0 )
         {
-            touch_file( flag_path( name, "configured", arch ) );
+            states->set( name, "configured", env->platform, arch.name, hash, duration );
         }
         static void clear_configured( const std::string& name, bool clean = true )
         {
@@ -330,10 +363,32 @@ namespace dmk
                 clear_configured( name, a, clean );
             }
         }
+        // Configuration is considered up to date while its fingerprint is unchanged
+        static bool is_configured( const std::string& name,
+                                   const architecture& arch,
+                                   const configuration& config,
+                                   const std::string& fingerprint )
+        {
+            state_log::record r;
+            return states->get( name, "configured", env->platform, state_key( arch, config ), r ) && r.set &&
+                   r.hash == fingerprint;
+        }
+        static void set_configured( const std::string& name,
+                                    const architecture& arch,
+                                    const configuration& config,
+                                    const std::string& fingerprint,
+                                    double duration = 0.0 )
+        {
+            states->set( name, "configured", env->platform, state_key( arch, config ), fingerprint, duration );
+        }
         static void clear_configured( const std::string& name, const architecture& arch, bool clean = true )
         {
             clear_built( name, arch, clean );
-            remove_if_exists( flag_path( name, "configured", arch ) );
+            for ( auto c : env->configs_all )
+            {
+                states->clear( name, "configured", env->platform, state_key( arch, c ) );
+            }
+            states->clear( name, "configured", env->platform, arch.name );
             if ( clean )
             {
                 remove_configured( name, arch );
@@ -342,21 +397,99 @@ namespace dmk
 
         static bool is_built( const std::string& name, const architecture& arch )
         {
-            return is_file( flag_path( name, "built", arch ) );
-        }
-        static void set_built( const std::string& name, const architecture& arch )
-        {
-            touch_file( flag_path( name, "built", arch ) );
+            return states->is_set( name, "built", env->platform, arch.name );
+        }
+        static void set_built( const std::string& name,
+                               const architecture& arch,
+                               const std::string& hash = "",
+                               double duration = 0.0 )
+        {
+            states->set( name, "built", env->platform, arch.name, hash, duration );
+        }
+        // Build is considered up to date while its fingerprint is unchanged
+        // and its outputs are the same as right after the build (if they were recorded)
+        static bool is_built( const std::string& name,
+                              const architecture& arch,
+                              const configuration& config,
+                              const std::string& fingerprint,
+                              const std::string& outputs = "" )
+        {
+            state_log::record r;
+            if ( !states->get( name, "built", env->platform, state_key( arch, config ), r ) || !r.set )
+                return false;
+            size_t sep = r.hash.find( '/' );
+            if ( sep == std::string::npos )
+                return r.hash == fingerprint;
+            return r.hash.substr( 0, sep ) == fingerprint &&
+                   ( outputs.empty( ) || r.hash.substr( sep + 1 ) == outputs );
+        }
+        // The outputs are stored along with the fingerprint as fingerprint/outputs
+        static void set_built( const std::string& name,
+                               const architecture& arch,
+                               const configuration& config,
+                               const std::string& fingerprint,
+                               double duration = 0.0,
+                               const std::string& outputs = "" )
+        {
+            std::string hash = outputs.empty( ) ? fingerprint : fingerprint + '/' + outputs;
+            states->set( name, "built", env->platform, state_key( arch, config ), hash, duration );
+        }
+        // Fingerprint of the last build of the module for the configuration
+        // (multi-build modules are built for all configurations at once)
+        static std::string built_fingerprint( const std::string& name,
+                                              const architecture& arch,
+                                              const configuration& config )
+        {
+            std::string result;
+            state_log::record r;
+            for ( auto c : env->configs_all )
+            {
+                if ( config.name != configuration::all( ).name && c.name != config.name &&
+                     c.name != configuration::all( ).name )
+                    continue;
+                if ( states->get( name, "built", env->platform, state_key( arch, c ), r ) && r.set )
+                    result += r.hash;
+            }
+            return result;
         }
         static void clear_built( const std::string& name, const architecture& arch, bool clean = true )
         {
-            remove_if_exists( flag_path( name, "built", arch ) );
+            for ( auto c : env->configs_all )
+            {
+                states->clear( name, "built", env->platform, state_key( arch, c ) );
+            }
+            states->clear( name, "built", env->platform, arch.name );
             if ( clean )
             {
                 remove_built( name, arch );
             }
         }
 
+        // Move state from the flag files used by previous versions into the state log
+        static void import_flag_files( )
+        {
+            for ( const directory_entry& entry : directory_iterator( env->modules_dir ) )
+            {
+                if ( entry.path( ).extension( ) != ".txt" )
+                    continue;
+                std::string name = entry.path( ).stem( ).string( );
+                if ( is_file( flag_path( name, "imported" ) ) )
+                    set_imported( name );
+                for ( const architecture& a : env->archs )
+                {
+                    if ( is_file( flag_path( name, "configured", a ) ) )
+                        set_configured( name, a );
+                    if ( is_file( flag_path( name, "built", a ) ) )
+                        set_built( name, a );
+                }
+            }
+        }
+
+        static std::string state_key( const architecture& arch, const configuration& config )
+        {
+            return arch.name + '/' + config.name;
+        }
+
         static path flag_path( const std::string& name, const std::string& flag, const architecture& arch )
         {
             return env->flags_dir / ( name + '-' + flag + '-' + env->platform + '-' + arch.name );
@@ -382,44 +515,198 @@ namespace dmk
             return is_file( ( env->modules_dir / name ).string( ) + ".localproject" );
         }
 
-        static void build_dependencies_list( std::vector<std::string>& list, const std::string& name )
+    private:
+        // Variables data( ) is expanded with
+        variable_scope data_variables( ) const
         {
-            json module = file_get_json( project::module_path( name ) );
-            for ( const json& d : module["dependencies"].flatten( ) )
+            return m_external_variables + variables( ) + cross_variables( );
+        }
+
+        // Caller holds m_data_mutex
+        const json_template& get_template( ) const
+        {
+            if ( !m_template )
+                m_template.reset( new json_template( m_original_data ) );
+            return *m_template;
+        }
+
+        // Directory variables of every architecture and configuration: <lib_dir_x64_release>, <lib_root_dir_x64>
+        // Each group of variables is computed on the first lookup of one of them
+        class cross_variable_list : public lazy_variables
+        {
+        public:
+            explicit cross_variable_list( const std::string& name ) : m_name( name )
             {
-                std::string dep = d || "";
-                if ( dep.empty( ) )
-                    continue;
-                // if this dependency isn't in the list...
-                auto it = std::find( list.begin( ), list.end( ), dep );
-                if ( it == list.end( ) )
+                for ( const architecture& arch : env->archs )
+                {
+                    for ( const configuration& cfg : env->configs_all )
+                    {
+                        m_groups.push_back(
+                            group{ "_" + asci_lowercase( arch.name ) + "_" + asci_lowercase( cfg.name ), &arch, &cfg } );
+                    }
+                    m_groups.push_back( group{ "_" + asci_lowercase( arch.name ), &arch, nullptr } );
+                }
+            }
+
+            const std::string* lookup( const std::string& key ) const override
+            {
+                for ( const group& g : m_groups )
                 {
-                    list.push_back( dep );
-                    build_dependencies_list( list, dep );
+                    if ( key.size( ) > g.suffix.size( ) &&
+                         key.compare( key.size( ) - g.suffix.size( ), g.suffix.size( ), g.suffix ) == 0 )
+                    {
+                        const std::string* value = values( g ).lookup( key );
+                        if ( value )
+                            return value;
+                    }
                 }
-                else
+                return nullptr;
+            }
+
+            variable_list flatten( ) const override
+            {
+                variable_list result;
+                for ( const group& g : m_groups )
                 {
-                    list.erase( it );
-                    list.push_back( dep );
+                    result += values( g );
                 }
+                return result;
             }
-        }
 
-        static std::vector<std::string> get_dependencies( const std::string& name )
-        {
-            std::vector<std::string> list;
-            build_dependencies_list( list, name );
-            return list;
-        }
+        private:
+            struct group
+            {
+                std::string suffix;
+                const architecture* arch;
+                const configuration* config; // nullptr for root directories
+            };
+
+            const variable_list& values( const group& g ) const
+            {
+                std::lock_guard<std::mutex> lock( m_mutex );
+                auto it = m_values.find( g.suffix );
+                if ( it == m_values.end( ) )
+                {
+                    variable_list vars = g.config ? dir_variables( *g.arch, *g.config, m_name )
+                                                  : root_dir_variables( *g.arch, m_name );
+                    it = m_values.emplace( g.suffix, vars.transform( "", g.suffix ) ).first;
+                }
+                return it->second;
+            }
+
+            const std::string m_name;
+            std::vector<group> m_groups;
+            mutable std::mutex m_mutex;
+            mutable std::map<std::string, variable_list> m_values;
+        };
 
-    private:
         const std::string m_name;
         const path m_source_dir;
         std::string m_version;
+        std::string m_hash;
         json m_original_data;
-        json m_data;
-        variable_list m_variables;
-        variable_list m_cross_variables;
-        variable_list m_external_variables;
+        variable_scope m_variables;
+        variable_scope m_cross_variables;
+        variable_scope m_external_variables;
+
+        // Expanded on first use
+        mutable std::mutex m_data_mutex;
+        mutable std::unique_ptr<json_template> m_template;
+        mutable bool m_data_expanded;
+        mutable json m_data;
+        mutable std::unordered_map<std::string, json> m_data_members;
+    };
+
+    // Dependencies between modules
+    // Each module descriptor is read once, the order is computed in linear time
+    class dependency_graph
+    {
+    public:
+        // Read descriptors of the module and all modules it depends on
+        void load( const std::string& name )
+        {
+            std::vector<std::string> pending{ name };
+            while ( !pending.empty( ) )
+            {
+                std::string current = pending.back( );
+                pending.pop_back( );
+                if ( m_dependencies.find( current ) != m_dependencies.end( ) )
+                    continue;
+                json module = descriptors->get( project::module_path( current ) ).data;
+                std::vector<std::string>& deps = m_dependencies[current];
+                for ( const json& d : module["dependencies"].flatten( ) )
+                {
+                    std::string dep = d || "";
+                    if ( dep.empty( ) || std::find( deps.begin( ), deps.end( ), dep ) != deps.end( ) )
+                        continue;
+                    deps.push_back( dep );
+                    pending.push_back( dep );
+                }
+            }
+        }
+
+        // Direct dependencies of the loaded module
+        const std::vector<std::string>& dependencies( const std::string& name ) const
+        {
+            static const std::vector<std::string> empty;
+            auto it = m_dependencies.find( name );
+            return it != m_dependencies.end( ) ? it->second : empty;
+        }
+
+        // Given modules and everything they depend on, each module placed after its dependencies
+        std::vector<std::string> order( const std::vector<std::string>& names ) const
+        {
+            std::vector<std::string> result;
+            std::unordered_map<std::string, mark> marks;
+            std::vector<std::string> path;
+            for ( const std::string& name : names )
+            {
+                visit( name, marks, path, result );
+            }
+            return result;
+        }
+
+        // All modules the given module depends on (directly or not), dependencies first
+        std::vector<std::string> all_dependencies( const std::string& name ) const
+        {
+            std::vector<std::string> result = order( { name } );
+            result.pop_back( );
+            return result;
+        }
+
+    private:
+        enum mark
+        {
+            Unvisited,
+            Visiting,
+            Visited
+        };
+
+        void visit( const std::string& name,
+                    std::unordered_map<std::string, mark>& marks,
+                    std::vector<std::string>& path,
+                    std::vector<std::string>& result ) const
+        {
+            mark& m = marks[name];
+            if ( m == Visited )
+                return;
+            if ( m == Visiting )
+            {
+                std::vector<std::string> cycle( std::find( path.begin( ), path.end( ), name ), path.end( ) );
+                cycle.push_back( name );
+                throw error( "Circular dependency: {}", join( cycle, " -> " ) );
+            }
+            m = Visiting;
+            path.push_back( name );
+            for ( const std::string& dep : dependencies( name ) )
+            {
+                visit( dep, marks, path, result );
+            }
+            path.pop_back( );
+            marks[name] = Visited;
+            result.push_back( name );
+        }
+
+        std::unordered_map<std::string, std::vector<std::string>> m_dependencies;
     };
 }
@@ -0,0 +1,295 @@
+/**
+ * CMGen
+ * Copyright (C) 2015  Dmitriy Ka
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#pragma once
+
+#include "cmgen.h"
+#include <unordered_map>
+#include <mutex>
+#include <ctime>
+
+namespace dmk
+{
+
+    // Import/configure/build state of the modules
+    // Every change is appended to a log file as a single line, so an interrupted write
+    // can only damage the last line (which is ignored on load).
+    // The latest record of each (module, flag, platform, arch) is kept in memory.
+    // When most of the log is superseded records, it is rewritten on load with the last
+    // history_length records of each state
+    class state_log
+    {
+    public:
+        struct record
+        {
+            record( ) : time( 0 ), set( false ), duration( 0.0 )
+            {
+            }
+            int64_t time;
+            bool set;
+            std::string module;
+            std::string flag;
+            std::string platform;
+            std::string arch;
+            std::string hash;
+            double duration;
+        };
+
+        explicit state_log( const path& filename ) : m_filename( filename ), m_file( nullptr )
+        {
+            m_existed = is_file( m_filename );
+            if ( m_existed )
+            {
+                std::vector<record> records = read( );
+                for ( const record& r : records )
+                {
+                    m_index[key( r.module, r.flag, r.platform, r.arch )] = r;
+                }
+                if ( records.size( ) > compact_records )
+                    compact( records );
+            }
+        }
+        ~state_log( )
+        {
+            if ( m_file )
+                fclose( m_file );
+        }
+        state_log( const state_log& ) = delete;
+        state_log& operator=( const state_log& ) = delete;
+
+        // False if the log has just been created
+        bool existed( ) const
+        {
+            return m_existed;
+        }
+
+        bool is_set( const std::string& module,
+                     const std::string& flag,
+                     const std::string& platform = "",
+                     const std::string& arch     = "" ) const
+        {
+            record r;
+            return get( module, flag, platform, arch, r ) && r.set;
+        }
+
+        bool get( const std::string& module,
+                  const std::string& flag,
+                  const std::string& platform,
+                  const std::string& arch,
+                  record& result ) const
+        {
+            std::lock_guard<std::mutex> lock( m_mutex );
+            auto it = m_index.find( key( module, flag, platform, arch ) );
+            if ( it == m_index.end( ) )
+                return false;
+            result = it->second;
+            return true;
+        }
+
+        void set( const std::string& module,
+                  const std::string& flag,
+                  const std::string& platform = "",
+                  const std::string& arch     = "",
+                  const std::string& hash     = "",
+                  double duration = 0.0 )
+        {
+            update( module, flag, platform, arch, true, hash, duration );
+        }
+
+        void clear( const std::string& module,
+                    const std::string& flag,
+                    const std::string& platform = "",
+                    const std::string& arch     = "" )
+        {
+            if ( !is_set( module, flag, platform, arch ) )
+                return;
+            update( module, flag, platform, arch, false, "", 0.0 );
+        }
+
+        // All records of the module (or of all modules) in chronological order
+        std::vector<record> history( const std::string& module = "" ) const
+        {
+            std::vector<record> result;
+            if ( !is_file( m_filename ) )
+                return result;
+            for ( record& r : read( ) )
+            {
+                if ( module.empty( ) || r.module == module )
+                    result.push_back( std::move( r ) );
+            }
+            return result;
+        }
+
+    private:
+        // Smaller logs aren't compacted
+        static const size_t compact_records = 1000;
+        // Records of each state kept by compaction (for history)
+        static const size_t history_length = 4;
+
+        static std::string key( const std::string& module,
+                                const std::string& flag,
+                                const std::string& platform,
+                                const std::string& arch )
+        {
+            return module + '\t' + flag + '\t' + platform + '\t' + arch;
+        }
+
+        // time  set  module  flag  platform  arch  hash  duration
+        static std::string format( const record& r )
+        {
+            return fmt::format( "{}\t{}\t{}\t{}\t{}\t{}\t{}\t{:.3f}\n",
+                                r.time,
+                                r.set ? 1 : 0,
+                                r.module,
+                                r.flag,
+                                r.platform,
+                                r.arch,
+                                r.hash,
+                                r.duration );
+        }
+
+        std::vector<record> read( ) const
+        {
+            std::vector<record> result;
+            std::string text = file_get_string( m_filename );
+            size_t pos = 0;
+            for ( ;; )
+            {
+                size_t end = text.find( '\n', pos );
+                if ( end == std::string::npos )
+                    break; // incomplete last line
+                std::vector<std::string> fields = split( text.substr( pos, end - pos ), '\t' );
+                pos = end + 1;
+                if ( fields.size( ) != 8 )
+                    continue;
+                record r;
+                r.time     = std::strtoll( fields[0].c_str( ), nullptr, 10 );
+                r.set      = fields[1] == "1";
+                r.module   = fields[2];
+                r.flag     = fields[3];
+                r.platform = fields[4];
+                r.arch     = fields[5];
+                r.hash     = fields[6];
+                r.duration = std::strtod( fields[7].c_str( ), nullptr );
+                result.push_back( std::move( r ) );
+            }
+            return result;
+        }
+
+        // Remove the last line left without a newline by an interrupted write,
+        // otherwise the next record would be appended to it and lost
+        void drop_incomplete_line( ) const
+        {
+            FILE* f = open_file( m_filename, open_mode::Read | open_mode::Binary );
+            if ( !f )
+                return;
+            bool complete = fseek( f, -1, SEEK_END ) != 0 || fgetc( f ) == '\n';
+            fclose( f );
+            if ( complete )
+                return;
+            std::string text = file_get_string( m_filename );
+            size_t end       = text.rfind( '\n' );
+            resize_file( m_filename, end == std::string::npos ? 0 : end + 1 );
+        }
+
+        // Rewrite the log without the superseded records if they are more than half of it
+        // The new log is written under another name and renamed over the old one, so it is replaced
+        // at once (compaction is optional, the old log is kept if it fails)
+        void compact( const std::vector<record>& records ) const
+        {
+            std::unordered_map<std::string, size_t> remaining;
+            for ( const record& r : records )
+                remaining[key( r.module, r.flag, r.platform, r.arch )]++;
+            std::string text;
+            size_t kept = 0;
+            for ( const record& r : records )
+            {
+                if ( remaining[key( r.module, r.flag, r.platform, r.arch )]-- <= history_length )
+                {
+                    text += format( r );
+                    kept++;
+                }
+            }
+            if ( kept * 2 >= records.size( ) )
+                return;
+            path temp = unique_path( m_filename.parent_path( ), ".tmp", m_filename.stem( ).string( ) + "-%04d" );
+            FILE* f   = open_file( temp, open_mode::Write | open_mode::Binary );
+            if ( !f )
+                return;
+            bool ok = fwrite( text.data( ), 1, text.size( ), f ) == text.size( ) && sync_file( f );
+            ok      = fclose( f ) == 0 && ok;
+            try
+            {
+                if ( ok )
+                    rename( temp, m_filename );
+                else
+                    remove_if_exists( temp );
+            }
+            catch ( const std::exception& )
+            {
+                remove_if_exists( temp );
+            }
+        }
+
+        void update( const std::string& module,
+                     const std::string& flag,
+                     const std::string& platform,
+                     const std::string& arch,
+                     bool set,
+                     const std::string& hash,
+                     double duration )
+        {
+            record r;
+            r.time     = static_cast<int64_t>( std::time( NULL ) );
+            r.set      = set;
+            r.module   = module;
+            r.flag     = flag;
+            r.platform = platform;
+            r.arch     = arch;
+            r.hash     = hash;
+            r.duration = duration;
+            std::string line = format( r );
+
+            std::lock_guard<std::mutex> lock( m_mutex );
+            if ( !m_file )
+            {
+                drop_incomplete_line( );
+                m_file = open_file( m_filename, open_mode::Append | open_mode::Binary );
+                if ( !m_file )
+                    throw file_error( system_error, "Can't open state log {}", m_filename );
+            }
+            // A record that finishes a step is synced, so a crash of the system can't lose it
+            // while the outputs of the step are kept
+            if ( fwrite( line.data( ), 1, line.size( ), m_file ) != line.size( ) ||
+                 ( set ? !sync_file( m_file ) : fflush( m_file ) != 0 ) )
+            {
+                throw file_error( system_error, "Can't write state log {}", m_filename );
+            }
+            m_index[key( module, flag, platform, arch )] = std::move( r );
+        }
+
+        const path m_filename;
+        FILE* m_file;
+        bool m_existed;
+        mutable std::mutex m_mutex;
+        std::unordered_map<std::string, record> m_index;
+    };
+
+    extern ptr<state_log> states;
+}
@@ -0,0 +1,107 @@
+/**
+ * CMGen
+ * Copyright (C) 2015  Dmitriy Ka
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+// Time to load 600 generated module descriptors (a few of them larger than map_threshold):
+// read into a string and parse, parse from file_contents, and read the binary form cached by cmgen
+
+#include <dmk_path.h>
+#include <chrono>
+#include <iostream>
+
+using namespace dmk;
+
+static const size_t descriptors = 600;
+static const size_t rounds      = 5;
+
+static json generate( size_t index, size_t options )
+{
+    json::object result;
+    result.push_back( json::objectpair( "version", json( fmt::format( "1.{}.{}", index % 10, index % 7 ) ) ) );
+    result.push_back( json::objectpair(
+        "url", json( fmt::format( "https://example.com/module{0}/module{0}-1.{1}.tar.gz", index, index % 10 ) ) ) );
+    result.push_back( json::objectpair( "type", json( "cmake" ) ) );
+    json::array list;
+    for ( size_t o = 0; o < options; o++ )
+    {
+        list.push_back( json( fmt::format( "-DMODULE{}_OPTION_{}=ON", index, o ) ) );
+    }
+    result.push_back( json::objectpair( "options", json( std::move( list ) ) ) );
+    result.push_back( json::objectpair( "dependencies", json( json::array{ json( "zlib" ), json( "openssl" ) } ) ) );
+    return json( std::move( result ) );
+}
+
+// Best time of the rounds in milliseconds
+template <typename _Func>
+static double measure( _Func&& func )
+{
+    double best = 0;
+    for ( size_t r = 0; r < rounds; r++ )
+    {
+        auto start = std::chrono::steady_clock::now( );
+        func( );
+        double ms = std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now( ) - start ).count( );
+        best      = r == 0 ? ms : std::min( best, ms );
+    }
+    return best;
+}
+
+int main( )
+{
+    const path dir = unique_path( temp_directory_path( ), "", "cmgen-bench-descriptors-%04d" );
+    create_directories( dir );
+    std::vector<path> texts, binaries;
+    uint64_t total = 0;
+    for ( size_t i = 0; i < descriptors; i++ )
+    {
+        // every 100th descriptor is larger than map_threshold
+        const json value = generate( i, i % 100 == 0 ? 8000 : 20 + i % 40 );
+        const std::string text = value.stringify( );
+        std::string binary;
+        json_binary::write( value, binary );
+        texts.push_back( dir / fmt::format( "module{}.json", i ) );
+        binaries.push_back( dir / fmt::format( "module{}.bin", i ) );
+        file_put_bytes( texts.back( ), text, open_mode::Binary );
+        file_put_bytes( binaries.back( ), binary, open_mode::Binary );
+        total += text.size( );
+    }
+
+    size_t items  = 0;
+    double string = measure( [&]( ) {
+        for ( const path& p : texts )
+            items += json::parse( file_get_string( p ) ).size( );
+    } );
+    double contents = measure( [&]( ) {
+        for ( const path& p : texts )
+            items += file_get_json( p ).size( );
+    } );
+    double binary = measure( [&]( ) {
+        for ( const path& p : binaries )
+        {
+            file_contents data( p );
+            items += json_binary::read( data.data( ), data.size( ) ).size( );
+        }
+    } );
+    remove_all( dir );
+
+    std::cout << fmt::format( "{} descriptors, {:.1f} MB of text\n", descriptors, total / 1e6 );
+    std::cout << fmt::format( "file_get_string + parse: {:8.2f} ms\n", string );
+    std::cout << fmt::format( "file_get_json:           {:8.2f} ms\n", contents );
+    std::cout << fmt::format( "binary cache:            {:8.2f} ms\n", binary );
+    return items ? 0 : 1;
+}
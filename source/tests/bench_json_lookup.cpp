@@ -0,0 +1,80 @@
+/**
+ * CMGen
+ * Copyright (C) 2015  Dmitriy Ka
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+// Lookup time in an object with 1,000 keys without the hash index of ordered_map and with it
+// Const lookups use the index only after a non-const lookup has built it
+
+#include <dmk_json.h>
+#include <chrono>
+#include <iostream>
+
+using namespace dmk;
+
+static const size_t keys   = 1000;
+static const size_t rounds = 200;
+
+// Nanoseconds per lookup of every key
+template <typename _Func>
+static double measure( const std::vector<std::string>& names, _Func&& lookup )
+{
+    size_t found = 0;
+    auto start   = std::chrono::steady_clock::now( );
+    for ( size_t r = 0; r < rounds; r++ )
+    {
+        for ( const std::string& name : names )
+        {
+            found += lookup( name ) ? 1 : 0;
+        }
+    }
+    auto time = std::chrono::steady_clock::now( ) - start;
+    if ( found != rounds * names.size( ) )
+        throw json_error( "Lookup failed" );
+    return std::chrono::duration<double, std::nano>( time ).count( ) / ( rounds * names.size( ) );
+}
+
+int main( )
+{
+    std::vector<std::string> names;
+    json::object obj;
+    for ( size_t k = 0; k < keys; k++ )
+    {
+        names.push_back( fmt::format( "variable_name_{}", k ) );
+        obj.push_back( json::objectpair( names.back( ), json( static_cast<int64_t>( k ) ) ) ); // no index yet
+    }
+    json value( std::move( obj ) );
+    const json& cvalue       = value;
+    const json::object& cobj = cvalue.as_object( );
+
+    double find_linear  = measure( names, [&]( const std::string& n ) { return cobj.find( n ) != cobj.end( ); } );
+    double index_linear = measure( names, [&]( const std::string& n ) { return cvalue[n].is_int( ); } );
+
+    // a non-const lookup builds the index (the storage isn't shared, so it isn't copied)
+    auto build_start = std::chrono::steady_clock::now( );
+    value[names.front( )];
+    double build = std::chrono::duration<double, std::micro>( std::chrono::steady_clock::now( ) - build_start ).count( );
+
+    double find_indexed  = measure( names, [&]( const std::string& n ) { return cobj.find( n ) != cobj.end( ); } );
+    double index_indexed = measure( names, [&]( const std::string& n ) { return cvalue[n].is_int( ); } );
+
+    std::cout << fmt::format( "{} keys, {} rounds\n", keys, rounds );
+    std::cout << fmt::format( "find:        {:8.1f} ns without index, {:8.1f} ns with index\n", find_linear, find_indexed );
+    std::cout << fmt::format( "operator[]:  {:8.1f} ns without index, {:8.1f} ns with index\n", index_linear, index_indexed );
+    std::cout << fmt::format( "index built in {:.1f} us\n", build );
+    return 0;
+}
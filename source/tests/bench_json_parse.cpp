@@ -0,0 +1,79 @@
+/**
+ * CMGen
+ * Copyright (C) 2015  Dmitriy Ka
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+// Parser throughput on a generated document of about 9 MB, shaped like module descriptors
+// (objects of short strings, paths, numbers and option arrays, printed with indentation)
+
+#include <dmk_json.h>
+#include <chrono>
+#include <iostream>
+
+using namespace dmk;
+
+static const size_t modules = 12000;
+static const size_t rounds  = 5;
+
+static json generate( )
+{
+    json::array result;
+    for ( size_t i = 0; i < modules; i++ )
+    {
+        json::object module;
+        module.push_back( json::objectpair( "name", json( fmt::format( "module{}", i ) ) ) );
+        module.push_back( json::objectpair( "version", json( fmt::format( "{}.{}.{}", i % 7, i % 13, i % 29 ) ) ) );
+        module.push_back( json::objectpair(
+            "url", json( fmt::format( "https://example.com/downloads/module{0}/module{0}-{1}.tar.gz", i, i % 97 ) ) ) );
+        module.push_back( json::objectpair( "type", json( i % 3 ? "cmake" : "command" ) ) );
+        module.push_back( json::objectpair( "size", json( static_cast<int64_t>( i * 7919 ) ) ) );
+        module.push_back( json::objectpair( "ratio", json( i / 7.0 ) ) );
+        module.push_back( json::objectpair( "shared", json( i % 2 == 0 ) ) );
+        json::array options;
+        for ( size_t o = 0; o < 8; o++ )
+        {
+            options.push_back( json( fmt::format( "-DOPTION_{}_{}=\"value with \\\\ and \\\"quotes\\\"\"", i, o ) ) );
+        }
+        module.push_back( json::objectpair( "options", json( std::move( options ) ) ) );
+        json::array dependencies;
+        for ( size_t d = 1; d <= i % 5; d++ )
+        {
+            dependencies.push_back( json( fmt::format( "module{}", ( i + d * 31 ) % modules ) ) );
+        }
+        module.push_back( json::objectpair( "dependencies", json( std::move( dependencies ) ) ) );
+        result.push_back( json( std::move( module ) ) );
+    }
+    return json( std::move( result ) );
+}
+
+int main( )
+{
+    const std::string text = generate( ).stringify( );
+    double best            = 0;
+    for ( size_t r = 0; r < rounds; r++ )
+    {
+        auto start = std::chrono::steady_clock::now( );
+        json value = json::parse( text.data( ), text.size( ) );
+        double s   = std::chrono::duration<double>( std::chrono::steady_clock::now( ) - start ).count( );
+        if ( value.as_array( ).size( ) != modules )
+            throw json_error( "Unexpected parse result" );
+        best = std::max( best, text.size( ) / s / 1e6 );
+    }
+    std::cout << fmt::format( "{:.1f} MB document, {:.1f} MB/s (best of {})", text.size( ) / 1e6, best, rounds )
+              << std::endl;
+    return 0;
+}
@@ -0,0 +1,117 @@
+/**
+ * CMGen
+ * Copyright (C) 2015  Dmitriy Ka
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+// Command lines of processes are split and expanded as the shell would do it,
+// expansions that need a shell are rejected
+
+#include <dmk_console.h>
+#include <iostream>
+
+using namespace dmk;
+
+static size_t failures = 0;
+
+static void fail( const std::string& message )
+{
+    std::cerr << message << std::endl;
+    failures++;
+}
+
+static std::string show( const argument_list& args )
+{
+    std::string result;
+    for ( const std::string& a : args )
+        result += "[" + a + "]";
+    return result;
+}
+
+static void check( const environment_block& env, const std::string& cmdline, const argument_list& expected )
+{
+    try
+    {
+        argument_list result;
+        process::split_arguments( cmdline, env, result );
+        if ( result != expected )
+            fail( fmt::format( "{}: got {}, expected {}", cmdline, show( result ), show( expected ) ) );
+    }
+    catch ( const std::exception& e )
+    {
+        fail( fmt::format( "{}: {}", cmdline, e.what( ) ) );
+    }
+}
+
+static void check_error( const environment_block& env, const std::string& cmdline )
+{
+    try
+    {
+        argument_list result;
+        process::split_arguments( cmdline, env, result );
+        fail( fmt::format( "{}: no error, got {}", cmdline, show( result ) ) );
+    }
+    catch ( const error& )
+    {
+    }
+}
+
+int main( )
+{
+    const environment_block env( *environment_block::inherited( ),
+                                 environment_block::variables{ { "HOME", "/home/user" },
+                                                               { "PREFIX", "/opt/x y" },
+                                                               { "EMPTY", "" },
+                                                               { "V_1", "v" } } );
+    check( env, "a  b\tc\n", { "a", "b", "c" } );
+    check( env, "'a b' \"c d\" e\\ f", { "a b", "c d", "e f" } );
+    check( env, "'$PREFIX' \"\\$PREFIX\" \\$PREFIX", { "$PREFIX", "$PREFIX", "$PREFIX" } );
+    check( env, "--prefix=$PREFIX", { "--prefix=/opt/x y" } );
+    check( env, "\"${PREFIX}/lib\" ${V_1}x $V_1.x", { "/opt/x y/lib", "vx", "v.x" } );
+    check( env, "a $EMPTY $UNSET_VARIABLE_12345 b", { "a", "b" } );
+    check( env, "\"$EMPTY\" ''", { "", "" } );
+    check( env, "~ ~/bin a~ '~' -I~", { "/home/user", "/home/user/bin", "a~", "~", "-I~" } );
+    check( env, "$ a$ \"$\" 100$", { "$", "a$", "$", "100$" } );
+    check_error( env, "$(pwd)" );
+    check_error( env, "\"`pwd`\"" );
+    check_error( env, "${PREFIX:-/usr}" );
+    check_error( env, "${PREFIX" );
+    check_error( env, "$1 $@" );
+    check_error( env, "~root/bin" );
+    check_error( env, "'unterminated" );
+
+    // Variables set after the arguments are added are used for the expansion
+    try
+    {
+        const path dir = unique_path( temp_directory_path( ), "", "cmgen-test-arguments-%04d" );
+        create_directories( dir );
+        process cmd( "/bin/sh", dir );
+        cmd( "-c 'printf %s \"$0\" > out.txt' \"${CMGEN_TEST_VALUE}\"" );
+        cmd.set_env( "CMGEN_TEST_VALUE", "a b $c" );
+        cmd( );
+        std::string out = file_get_string( dir / "out.txt" );
+        if ( out != "a b $c" )
+            fail( fmt::format( "Process got {}", out ) );
+        remove_all( dir );
+    }
+    catch ( const std::exception& e )
+    {
+        fail( e.what( ) );
+    }
+
+    std::cout << fmt::format( "arguments: {} failures", failures ) << std::endl;
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,146 @@
+/**
+ * CMGen
+ * Copyright (C) 2015  Dmitriy Ka
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+// file_contents reads files smaller than map_threshold and maps larger ones,
+// both must give the same bytes as file_get_bytes, including the sizes around the threshold,
+// empty files, files without a known size (/proc) and mapped files truncated while in use
+
+#include <dmk_path.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <iostream>
+
+using namespace dmk;
+
+static int failures = 0;
+
+static void fail( const std::string& message )
+{
+    std::cerr << message << std::endl;
+    failures++;
+}
+
+static std::string make_bytes( size_t size )
+{
+    std::string result( size, '\0' );
+    uint32_t x = 2463534242u;
+    for ( size_t i = 0; i < size; i++ )
+    {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        result[i] = static_cast<char>( x );
+    }
+    return result;
+}
+
+static void test_sizes( const path& dir )
+{
+    const size_t threshold = file_contents::map_threshold;
+    for ( size_t size : { size_t( 0 ), size_t( 1 ), size_t( 4095 ), size_t( 4096 ), threshold - 1, threshold,
+                          threshold + 1, size_t( 3 * 1024 * 1024 + 7 ) } )
+    {
+        const path filename    = dir / fmt::format( "file{}.bin", size );
+        const std::string data = make_bytes( size );
+        file_put_bytes( filename, data, open_mode::Binary );
+
+        file_contents contents( filename );
+        if ( contents.size( ) != size || contents.str( ) != data )
+            fail( fmt::format( "{} bytes: file_contents returns {} different bytes", size, contents.size( ) ) );
+        if ( contents.mapped( ) != ( size >= threshold ) )
+            fail( fmt::format( "{} bytes: mapped is {}", size, contents.mapped( ) ) );
+        std::string bytes;
+        file_get_bytes( filename, bytes, open_mode::Binary );
+        if ( bytes != data )
+            fail( fmt::format( "{} bytes: file_get_bytes returns {} different bytes", size, bytes.size( ) ) );
+    }
+
+    try
+    {
+        file_put_bytes( dir / "empty.json", std::string( ) );
+        file_get_json( dir / "empty.json" );
+        fail( "Empty json file was parsed" );
+    }
+    catch ( const json_error& )
+    {
+    }
+}
+
+// stat reports no size for them
+static void test_proc( )
+{
+    const path status = "/proc/self/status";
+    if ( !exists( status ) )
+        return;
+    file_contents contents( status );
+    if ( contents.size( ) == 0 || contents.str( ).compare( 0, 5, "Name:" ) != 0 )
+        fail( fmt::format( "{} is read as {} bytes", status, contents.size( ) ) );
+}
+
+static void test_truncated( const path& dir )
+{
+    const path filename    = dir / "truncated.bin";
+    const std::string data = make_bytes( 1024 * 1024 );
+    file_put_bytes( filename, data, open_mode::Binary );
+    file_contents contents( filename );
+    if ( !contents.mapped( ) )
+        fail( "1 MB file isn't mapped" );
+
+    const size_t left = 300 * 1024;
+    resize_file( filename, left );
+    if ( contents.size( ) != data.size( ) || std::memcmp( contents.data( ), data.data( ), left ) != 0 )
+        fail( "Mapped data before the new end of file changed" );
+
+    // past the new end of file the mapping has no pages
+    pid_t pid = fork( );
+    if ( pid == 0 )
+    {
+        volatile char c = contents.data( )[contents.size( ) - 1];
+        (void)c;
+        _exit( 0 );
+    }
+    int status = 0;
+    waitpid( pid, &status, 0 );
+    if ( !WIFSIGNALED( status ) || WTERMSIG( status ) != SIGBUS )
+        fail( "Reading past the end of the truncated mapping doesn't raise SIGBUS" );
+
+    // the next read sees the new size
+    file_contents reread( filename );
+    if ( reread.size( ) != left || reread.str( ) != data.substr( 0, left ) )
+        fail( "Truncated file is read wrong" );
+}
+
+int main( )
+{
+    const path dir = unique_path( temp_directory_path( ), "", "cmgen-test-file-contents-%04d" );
+    create_directories( dir );
+    try
+    {
+        test_sizes( dir );
+        test_proc( );
+        test_truncated( dir );
+    }
+    catch ( const std::exception& e )
+    {
+        fail( e.what( ) );
+    }
+    remove_all( dir );
+    std::cout << fmt::format( "file_contents: {} failures", failures ) << std::endl;
+    return failures == 0 ? 0 : 1;
+}
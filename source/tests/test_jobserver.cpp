@@ -0,0 +1,100 @@
+/**
+ * CMGen
+ * Copyright (C) 2015  Dmitriy Ka
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+// Several make projects are built at once sharing the jobserver as cmgen does it,
+// the number of jobs running at once must never exceed the size of the pool
+
+#include <dmk_thread.h>
+#include <iostream>
+
+using namespace dmk;
+
+static const size_t budget           = 3;
+static const size_t projects         = 6;
+static const size_t jobs_per_project = 8;
+
+int main( )
+{
+    try
+    {
+        path root    = unique_path( temp_directory_path( ), "", "cmgen-test-jobserver-%04d" );
+        path running = root / "running";
+        path counts  = root / "counts.txt";
+        create_directories( running );
+
+        // every job marks itself running and records how many jobs are running now
+        std::vector<path> dirs;
+        for ( size_t p = 0; p < projects; p++ )
+        {
+            path dir = root / fmt::format( "p{}", p );
+            create_directories( dir );
+            std::string targets;
+            for ( size_t j = 0; j < jobs_per_project; j++ )
+                targets += fmt::format( " t{}", j );
+            file_put_string( dir / "Makefile",
+                             fmt::format( "JOBS ={0}\n"
+                                          "all: $(JOBS)\n"
+                                          "$(JOBS):\n"
+                                          "\t@mkdir {1}/p{2}-$@ && ls {1} | wc -l >> {3} && sleep 0.1 && rmdir {1}/p{2}-$@\n",
+                                          targets,
+                                          running.string( ),
+                                          p,
+                                          counts.string( ) ) );
+            dirs.push_back( dir );
+        }
+
+        jobserver server( budget );
+        auto environment = std::make_shared<const environment_block>(
+            *environment_block::inherited( ),
+            environment_block::variables{ { "MAKEFLAGS", server.makeflags( ) } } );
+        path make = find_in_path( "make" );
+        thread_budget threads( projects );
+        parallel_for_each( dirs,
+                           threads,
+                           [&]( const path& dir )
+                           {
+                               // the first job of the tool is paid with a slot as in builder::build_arch
+                               jobserver::slot slot( &server );
+                               process cmd( make, dir );
+                               cmd.set_env( environment );
+                               cmd( );
+                           } );
+
+        std::vector<std::string> lines = split( file_get_string( counts ), '\n' );
+        size_t jobs = 0;
+        size_t peak = 0;
+        for ( const std::string& line : lines )
+        {
+            if ( line.empty( ) )
+                continue;
+            jobs++;
+            peak = std::max( peak, static_cast<size_t>( std::atoi( line.c_str( ) ) ) );
+        }
+        remove_all( root );
+        std::cout << fmt::format( "{} jobs, at most {} at once, budget {}", jobs, peak, budget ) << std::endl;
+        if ( jobs != projects * jobs_per_project || peak > budget )
+            return 1;
+        return 0;
+    }
+    catch ( const std::exception& e )
+    {
+        std::cerr << e.what( ) << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,263 @@
+/**
+ * CMGen
+ * Copyright (C) 2015  Dmitriy Ka
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+// The vectorized scanners of the json parser (SSE2, and AVX2 when the test is built with -mavx2)
+// must give the same results as a plain loop, and the parser must handle strings and escapes
+// that cross 16 and 32 byte blocks, comments and input without a terminating '\0'.
+// Every input ends right before an inaccessible page, so reading past its end crashes the test
+
+#include <dmk_json.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <iostream>
+
+using namespace dmk;
+
+static int failures = 0;
+
+static void fail( const std::string& message )
+{
+    if ( failures++ < 20 )
+        std::cerr << message << std::endl;
+}
+
+// Text placed at the end of a readable page followed by a PROT_NONE page
+class guarded_text
+{
+public:
+    explicit guarded_text( const std::string& text )
+    {
+        const size_t page = static_cast<size_t>( sysconf( _SC_PAGESIZE ) );
+        m_size            = ( text.size( ) + page - 1 ) / page * page + page;
+        m_base            = static_cast<char*>(
+            mmap( nullptr, m_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 ) );
+        if ( m_base == MAP_FAILED || mprotect( m_base + m_size - page, page, PROT_NONE ) != 0 )
+            throw error( system_error, "Can't allocate guarded memory" );
+        m_end   = m_base + m_size - page;
+        m_begin = m_end - text.size( );
+        std::memcpy( m_begin, text.data( ), text.size( ) );
+    }
+    ~guarded_text( )
+    {
+        munmap( m_base, m_size );
+    }
+    guarded_text( const guarded_text& ) = delete;
+    guarded_text& operator=( const guarded_text& ) = delete;
+
+    char* begin( ) const
+    {
+        return m_begin;
+    }
+    char* end( ) const
+    {
+        return m_end;
+    }
+    size_t size( ) const
+    {
+        return m_end - m_begin;
+    }
+
+private:
+    char* m_base;
+    size_t m_size;
+    char* m_begin;
+    char* m_end;
+};
+
+static const char* scalar_scan_string( const char* text, const char* end )
+{
+    for ( ; text < end; text++ )
+    {
+        if ( *text == '"' || *text == '\\' || static_cast<byte_t>( *text ) < ' ' )
+            return text;
+    }
+    return end;
+}
+
+static const char* scalar_scan_spaces( const char* text, const char* end )
+{
+    while ( text < end && ( *text == ' ' || *text == '\t' || *text == '\r' || *text == '\n' ) )
+        text++;
+    return text;
+}
+
+// A special character at every position of buffers of every length up to three AVX2 blocks,
+// the buffers end at the page end, so their start takes every alignment
+static void test_scanners( )
+{
+    const std::string stops  = std::string( "\"\\\x01\x1F\0", 5 );
+    const std::string passes = "a \x7F\x80\xC3\xFF/";
+    for ( size_t len = 0; len <= 100; len++ )
+    {
+        for ( size_t pos = 0; pos <= len; pos++ )
+        {
+            for ( char stop : stops + passes )
+            {
+                std::string text( len, '\0' );
+                for ( size_t i = 0; i < len; i++ )
+                    text[i] = passes[( i * 7 + len ) % passes.size( )];
+                if ( pos < len )
+                    text[pos] = stop;
+                guarded_text g( text );
+                const char* expected = scalar_scan_string( g.begin( ), g.end( ) );
+                const char* actual   = json_scan_string( g.begin( ), g.end( ) );
+                if ( actual != expected )
+                    fail( fmt::format( "json_scan_string: length {}, {} at {}: got {}, expected {}",
+                                       len,
+                                       int( byte_t( stop ) ),
+                                       pos,
+                                       actual - g.begin( ),
+                                       expected - g.begin( ) ) );
+            }
+
+            for ( char stop : std::string( "a\"/\x0B\x00\xA0", 6 ) )
+            {
+                std::string text( len, ' ' );
+                for ( size_t i = 0; i < len; i++ )
+                    text[i] = " \t\r\n"[( i * 5 + len ) % 4];
+                if ( pos < len )
+                    text[pos] = stop;
+                guarded_text g( text );
+                const char* expected = scalar_scan_spaces( g.begin( ), g.end( ) );
+                const char* actual   = json_scan_spaces( g.begin( ), g.end( ) );
+                if ( actual != expected )
+                    fail( fmt::format( "json_scan_spaces: length {}, {} at {}: got {}, expected {}",
+                                       len,
+                                       int( byte_t( stop ) ),
+                                       pos,
+                                       actual - g.begin( ),
+                                       expected - g.begin( ) ) );
+            }
+        }
+    }
+}
+
+struct escape
+{
+    const char* text;
+    const char* value;
+};
+
+static const escape escapes[] = { { "\\\"", "\"" },     { "\\\\", "\\" },        { "\\/", "/" },
+                                  { "\\n", "\n" },      { "\\t", "\t" },         { "\\r", "\r" },
+                                  { "\\u00e9", "\xC3\xA9" }, { "\\u20AC", "\xE2\x82\xAC" } };
+
+static json parse_guarded( const std::string& text )
+{
+    guarded_text g( text );
+    return json::parse( g.begin( ), g.size( ) );
+}
+
+// Strings with escapes at the block edges, separated by comments and whitespace runs of every length
+static void test_parser( )
+{
+    json::array expected;
+    std::string document = "[";
+    size_t n             = 0;
+    for ( size_t len = 0; len <= 70; len++ )
+    {
+        for ( size_t at : { size_t( 0 ), size_t( 14 ), size_t( 15 ), size_t( 16 ), size_t( 17 ), size_t( 30 ),
+                            size_t( 31 ), size_t( 32 ), size_t( 33 ), len } )
+        {
+            if ( at > len )
+                continue;
+            const escape& e = escapes[n % countof( escapes )];
+            std::string text, value;
+            for ( size_t i = 0; i < len; i++ )
+            {
+                if ( i == at )
+                {
+                    text += e.text;
+                    value += e.value;
+                }
+                char c = "abcdefghij-_ .~"[( i + n ) % 15];
+                text += c;
+                value += c;
+            }
+            if ( at == len )
+            {
+                text += e.text;
+                value += e.value;
+            }
+            if ( n )
+                document += ",";
+            document += std::string( n % 40, n % 3 ? ' ' : '\n' );
+            if ( n % 5 == 0 )
+                document += fmt::format( "// line comment {}\n", std::string( n % 37, '*' ) );
+            if ( n % 7 == 0 )
+                document += fmt::format( "/* block {} comment */", std::string( n % 33, '*' ) );
+            document += "\"" + text + "\"";
+            expected.push_back( json( value ) );
+            n++;
+        }
+    }
+    document += "\n]";
+
+    json actual = parse_guarded( document );
+    if ( !( actual == json( expected ) ) )
+        fail( "Parsed document differs from the expected values" );
+    if ( !( parse_guarded( json( expected ).stringify( ) ) == json( expected ) ) )
+        fail( "Printed and parsed document differs from the expected values" );
+
+    // every prefix of the document, the end of the input must be detected without a '\0'
+    for ( size_t len = 0; len < 400 && len < document.size( ); len++ )
+    {
+        try
+        {
+            parse_guarded( document.substr( 0, len ) );
+            fail( fmt::format( "Prefix of {} characters was parsed", len ) );
+        }
+        catch ( const json_error& )
+        {
+        }
+    }
+
+    // values ending right at the end of the input
+    if ( !( parse_guarded( "123" ) == json( int64_t( 123 ) ) ) || !( parse_guarded( "true" ) == json( true ) ) ||
+         !( parse_guarded( "\"x\"" ) == json( "x" ) ) || !( parse_guarded( "{\"a\":[1,2]}" )["a"][1] == json( int64_t( 2 ) ) ) ||
+         !( parse_guarded( "[1] // comment" ) == json( json::array{ json( int64_t( 1 ) ) } ) ) )
+        fail( "Values at the end of the input aren't parsed" );
+}
+
+int main( )
+{
+#if defined DMK_ARCH_AVX2
+    if ( !__builtin_cpu_supports( "avx2" ) )
+    {
+        std::cout << "AVX2 isn't supported by the CPU, skipped" << std::endl;
+        return 0;
+    }
+    const char* path = "AVX2";
+#elif defined DMK_ARCH_SSE2
+    const char* path = "SSE2";
+#else
+    const char* path = "scalar";
+#endif
+    try
+    {
+        test_scanners( );
+        test_parser( );
+    }
+    catch ( const std::exception& e )
+    {
+        fail( e.what( ) );
+    }
+    std::cout << fmt::format( "{} scanners: {} failures", path, failures ) << std::endl;
+    return failures == 0 ? 0 : 1;
+}
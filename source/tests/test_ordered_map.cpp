@@ -0,0 +1,120 @@
+/**
+ * CMGen
+ * Copyright (C) 2015  Dmitriy Ka
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+// The hash index of ordered_map must find the same items as a linear search
+// after the operations that move items (erase, insert, pop_back, clear)
+
+#include <dmk_json.h>
+#include <iostream>
+
+using namespace dmk;
+
+typedef ordered_map<int> map_type;
+
+static int failures = 0;
+
+// Position of the first item with the key, as found by a linear search
+static size_t expected( const map_type& map, const std::string& key )
+{
+    for ( size_t i = 0; i < map.size( ); i++ )
+    {
+        if ( ( map.begin( ) + i )->first == key )
+            return i;
+    }
+    return map.size( );
+}
+
+// Checks both the non-const lookup (builds the index) and the const one (uses it when up to date)
+static void check( map_type& map, size_t keys, const char* step )
+{
+    for ( size_t k = 0; k < keys; k++ )
+    {
+        const std::string key = fmt::format( "key{}", k );
+        const size_t pos      = expected( map, key );
+        const map_type& cmap  = map;
+        size_t found          = map.find( key ) - map.begin( );
+        size_t const_found    = cmap.find( key ) - cmap.begin( );
+        if ( found != pos || const_found != pos )
+        {
+            std::cerr << fmt::format( "{}: {} found at {} (const {}), expected {}", step, key, found, const_found, pos )
+                      << std::endl;
+            failures++;
+            return;
+        }
+    }
+}
+
+static void fill( map_type& map, size_t from, size_t to )
+{
+    for ( size_t k = from; k < to; k++ )
+    {
+        map[fmt::format( "key{}", k )] = static_cast<int>( k );
+    }
+}
+
+int main( )
+{
+    const size_t keys = 200;
+    map_type map;
+    fill( map, 0, 100 );
+    check( map, keys, "fill" );
+
+    // appended items extend the index
+    fill( map, 100, 150 );
+    check( map, keys, "append" );
+
+    map.erase( map.begin( ) + 10, map.begin( ) + 20 );
+    check( map, keys, "erase range" );
+    map.erase( map.begin( ) );
+    check( map, keys, "erase" );
+
+    map.insert( map.begin( ) + 5, map_type::value_type( "key180", 180 ) );
+    check( map, keys, "insert" );
+
+    // the first of the items with equal keys is found
+    map.push_back( map_type::value_type( "key50", -1 ) );
+    map.insert( map.begin( ), map_type::value_type( "key60", -1 ) );
+    check( map, keys, "duplicates" );
+
+    map.pop_back( );
+    map.pop_back( );
+    check( map, keys, "pop_back" );
+
+    // shrinking below the threshold and growing again
+    while ( map.size( ) > map_type::index_threshold / 2 )
+        map.pop_back( );
+    check( map, keys, "shrink" );
+    fill( map, 0, keys );
+    check( map, keys, "grow" );
+
+    map.clear( );
+    check( map, keys, "clear" );
+    fill( map, 150, keys );
+    check( map, keys, "refill" );
+
+    // copies keep an index that matches their items
+    map_type copy = map;
+    copy.erase( copy.begin( ) + 3 );
+    check( copy, keys, "copy" );
+    check( map, keys, "original" );
+
+    if ( failures == 0 )
+        std::cout << "ordered_map index matches linear search" << std::endl;
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,173 @@
+/**
+ * CMGen
+ * Copyright (C) 2015  Dmitriy Ka
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+// Output of processes started with log_output goes to their log files and to the output_tail
+// of the thread: concurrent processes keep their output apart, the tail keeps only the last lines,
+// and a background child left holding the pipes doesn't keep the caller waiting
+
+#include <dmk_console.h>
+#include <iostream>
+#include <thread>
+#include <chrono>
+#include <csignal>
+
+using namespace dmk;
+
+static const size_t threads_count = 8;
+static const size_t lines_count   = 2000;
+static const size_t tail_lines    = static_cast<size_t>( output_tail::default_lines );
+
+static size_t failures = 0;
+static std::mutex failures_mutex;
+
+static void fail( const std::string& message )
+{
+    std::lock_guard<std::mutex> lock( failures_mutex );
+    std::cerr << message << std::endl;
+    failures++;
+}
+
+static void remove_logs( const output_tail& tail )
+{
+    for ( const path& log : tail.logs( ) )
+        remove_if_exists( log );
+}
+
+static std::string expected_log( size_t id, const std::string& stream, size_t first, size_t last )
+{
+    std::string result;
+    for ( size_t i = first; i <= last; i++ )
+        result += fmt::format( "p{} {} {}\n", id, stream, i );
+    return result;
+}
+
+// Processes print to both streams at once, each log and tail must get only the lines of its process
+static void test_concurrent( )
+{
+    std::vector<std::thread> threads;
+    for ( size_t t = 0; t < threads_count; t++ )
+    {
+        threads.push_back( std::thread( [t]( )
+                                        {
+                                            try
+                                            {
+                                                output_tail tail;
+                                                process cmd( "/bin/sh" );
+                                                cmd.log_output( true );
+                                                cmd.arg( "-c" ).arg( fmt::format(
+                                                    "i=1; while [ $i -le {1} ]; do echo p{0} out $i; "
+                                                    "echo p{0} err $i >&2; i=$((i+1)); done",
+                                                    t,
+                                                    lines_count ) );
+                                                cmd( );
+                                                std::vector<path> logs = tail.logs( );
+                                                if ( logs.size( ) != 2 ||
+                                                     file_get_string( logs[0] ) !=
+                                                         expected_log( t, "out", 1, lines_count ) ||
+                                                     file_get_string( logs[1] ) !=
+                                                         expected_log( t, "err", 1, lines_count ) )
+                                                    fail( fmt::format( "Process {}: wrong log files", t ) );
+                                                std::vector<std::string> lines = tail.lines( );
+                                                if ( lines.size( ) != tail_lines )
+                                                    fail( fmt::format(
+                                                        "Process {}: {} lines in the tail", t, lines.size( ) ) );
+                                                for ( const std::string& line : lines )
+                                                {
+                                                    if ( line.substr( 0, line.rfind( ' ' ) ) !=
+                                                             fmt::format( "p{} out", t ) &&
+                                                         line.substr( 0, line.rfind( ' ' ) ) !=
+                                                             fmt::format( "p{} err", t ) )
+                                                        fail( fmt::format( "Process {}: {} in the tail", t, line ) );
+                                                }
+                                                remove_logs( tail );
+                                            }
+                                            catch ( const std::exception& e )
+                                            {
+                                                fail( e.what( ) );
+                                            }
+                                        } ) );
+    }
+    for ( std::thread& t : threads )
+        t.join( );
+}
+
+// The tail keeps the last lines of all the processes started while it exists
+static void test_tail_wrap( )
+{
+    output_tail tail;
+    for ( size_t id = 0; id < 2; id++ )
+    {
+        process cmd( "/bin/sh" );
+        cmd.log_output( true );
+        cmd.arg( "-c" ).arg( fmt::format(
+            "i=1; while [ $i -le {1} ]; do echo p{0} out $i; i=$((i+1)); done", id, tail_lines + 10 ) );
+        cmd( );
+    }
+    std::vector<std::string> lines = tail.lines( );
+    std::string text;
+    for ( const std::string& line : lines )
+        text += line + '\n';
+    if ( text != expected_log( 1, "out", 11, tail_lines + 10 ) )
+        fail( fmt::format( "Tail after wrapping:\n{}", text ) );
+    if ( tail.logs( ).size( ) != 4 )
+        fail( fmt::format( "{} log files in the tail", tail.logs( ).size( ) ) );
+    remove_logs( tail );
+}
+
+// A child left in the background keeps the pipes open, the output is released after 5 seconds
+static void test_daemon( )
+{
+    const path pid_file = unique_path( temp_directory_path( ), ".pid", "cmgen-test-output-%04d" );
+    output_tail tail;
+    process cmd( "/bin/sh" );
+    cmd.log_output( true );
+    cmd.arg( "-c" ).arg( "echo started; sleep 60 & echo $! > " + pid_file.string( ) + "; echo done" );
+    auto start = std::chrono::steady_clock::now( );
+    cmd( );
+    double elapsed = std::chrono::duration<double>( std::chrono::steady_clock::now( ) - start ).count( );
+    if ( elapsed < 4.5 || elapsed > 20.0 )
+        fail( fmt::format( "Process with a background child took {:.1f} s", elapsed ) );
+    std::vector<std::string> lines = tail.lines( );
+    if ( lines != std::vector<std::string>{ "started", "done" } )
+        fail( fmt::format( "Output of the process with a background child: {}", join( lines, "|" ) ) );
+    if ( is_file( pid_file ) )
+    {
+        pid_t pid = static_cast<pid_t>( std::atoi( file_get_string( pid_file ).c_str( ) ) );
+        if ( pid > 0 )
+            kill( pid, SIGTERM );
+        remove( pid_file );
+    }
+    remove_logs( tail );
+}
+
+int main( )
+{
+    try
+    {
+        test_concurrent( );
+        test_tail_wrap( );
+        test_daemon( );
+    }
+    catch ( const std::exception& e )
+    {
+        fail( e.what( ) );
+    }
+    std::cout << fmt::format( "output capture: {} failures", failures ) << std::endl;
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,97 @@
+/**
+ * CMGen
+ * Copyright (C) 2015  Dmitriy Ka
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+// Processes started from many threads at once must each run in their own working directory
+// while the working directory of the parent stays the same
+
+#include <dmk_console.h>
+#include <iostream>
+#include <thread>
+#include <atomic>
+
+using namespace dmk;
+
+static const size_t threads_count = 16;
+static const size_t processes     = 400;
+
+int main( )
+{
+    try
+    {
+        // canonical, to be compared with pwd -P
+        path root          = unique_path( canonical( temp_directory_path( ) ), "", "cmgen-test-working-dir-%04d" );
+        const path current = current_path( );
+        std::vector<path> dirs;
+        for ( size_t i = 0; i < processes; i++ )
+        {
+            dirs.push_back( root / fmt::format( "d{}", i ) );
+            create_directories( dirs.back( ) );
+        }
+
+        std::atomic<size_t> next( 0 );
+        std::atomic<size_t> failures( 0 );
+        std::vector<std::thread> threads;
+        for ( size_t t = 0; t < threads_count; t++ )
+        {
+            threads.push_back( std::thread( [&]( )
+                                            {
+                                                for ( size_t i = next++; i < processes; i = next++ )
+                                                {
+                                                    try
+                                                    {
+                                                        process cmd( "/bin/sh", dirs[i] );
+                                                        cmd.arg( "-c" ).arg( "pwd -P > pwd.txt" );
+                                                        cmd( );
+                                                    }
+                                                    catch ( const std::exception& e )
+                                                    {
+                                                        std::cerr << e.what( ) << std::endl;
+                                                        failures++;
+                                                    }
+                                                }
+                                            } ) );
+        }
+        for ( std::thread& t : threads )
+            t.join( );
+
+        for ( const path& dir : dirs )
+        {
+            std::string pwd = exclude_trailing( file_get_string( dir / "pwd.txt" ), '\n' );
+            if ( pwd != dir.string( ) )
+            {
+                std::cerr << fmt::format( "Process started in {} ran in {}", dir.string( ), pwd ) << std::endl;
+                failures++;
+            }
+        }
+        if ( current_path( ) != current )
+        {
+            std::cerr << fmt::format( "Working directory changed to {}", current_path( ).string( ) ) << std::endl;
+            failures++;
+        }
+        remove_all( root );
+        std::cout << fmt::format( "{} processes from {} threads, {} failures", processes, threads_count, failures )
+                  << std::endl;
+        return failures == 0 ? 0 : 1;
+    }
+    catch ( const std::exception& e )
+    {
+        std::cerr << e.what( ) << std::endl;
+        return 1;
+    }
+}